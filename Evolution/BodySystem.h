@@ -14,6 +14,7 @@
 #include "Timer.h"
 #include <list>
 #include <algorithm>
+#include <functional>
 
 class BodySystem
 {
@@ -44,12 +45,49 @@ public:
         return (uint)bodies.size();
     }
     
+    /// hash of the state of every body, a sum of one hash a body so the order of `bodies` doesn't matter
+    /// two runs that took the same steps have the same checksum, unless one of them diverged
+    uint64_t checksum() const {
+        uint64_t sum = 0;
+        
+        for(const Body* body : bodies) {
+            const Stick& stick = body->stick;
+            
+            uint64_t h = 0;
+            h = hash_float(h, body->position.x);
+            h = hash_float(h, body->position.y);
+            h = hash_float(h, body->velocity.x);
+            h = hash_float(h, body->velocity.y);
+            h = hash_float(h, body->health);
+            h = hash_float(h, stick.position.x);
+            h = hash_float(h, stick.position.y);
+            h = hash_float(h, stick.velocity.x);
+            h = hash_float(h, stick.velocity.y);
+            h = hash_float(h, stick.normal.x);
+            h = hash_float(h, stick.normal.y);
+            h = hash_float(h, stick.angularVelocity);
+            sum += h;
+        }
+        
+        return sum;
+    }
+    
+    /// gets `checksum()` after every step, if set
+    std::function<void(uint64_t)> checksumHook;
+    
 protected:
     
     BrainSystem bs;
     
     std::list<Body*> bodies;
     
+    /// what the brains and the bodies of this system draw from, see RandomScope
+    SeededRandom random;
+    
+    inline void reportChecksum() const {
+        if(checksumHook) checksumHook(checksum());
+    }
+    
 };
 
 #endif /* BodySystem_h */
@@ -153,6 +153,39 @@ public:
             brains[i]->reward = 0.0f;
     }
     
+    /// copies the brains of `list` that belong to the system into new brains, made in the order of `list`,
+    /// so they sit on the heap in about that order, and deletes the old ones
+    /// `list` then holds the copies, brains of other systems stay where they are
+    void relocate(std::vector<Brain*>* list) {
+        std::vector<std::pair<Brain*, uint>> places(count);
+        for(uint i = 0; i != count; ++i)
+            places[i] = std::make_pair(brains[i], i);
+        
+        std::sort(places.begin(), places.end());
+        
+        /// a brain may be used by more than one body, it is copied once
+        std::vector<Brain*> copies(count, NULL);
+        
+        for(Brain*& brain : *list) {
+            auto it = std::lower_bound(places.begin(), places.end(), std::make_pair(brain, 0u));
+            
+            if(it == places.end() || it->first != brain)
+                continue;
+            
+            if(copies[it->second] == NULL)
+                copies[it->second] = new Brain(*brain);
+            
+            brain = copies[it->second];
+        }
+        
+        for(uint i = 0; i != count; ++i) {
+            if(copies[i] != NULL) {
+                delete brains[i];
+                brains[i] = copies[i];
+            }
+        }
+    }
+    
     void write(FILE* os) const {
         fwrite(&count, sizeof(count), 1, os);
         
@@ -204,7 +237,9 @@ public:
     }
     
     inline void shuffle() {
-        std::random_shuffle(brains, brains + count);
+        std::random_shuffle(brains, brains + count, [] (uint n) {
+            return rand32(n);
+        });
     }
     
 protected:
@@ -25,37 +25,112 @@ struct Room {
     
     float time;
     
+    /// `depth_ratio` of the deepest overlap in the last substep
+    float depth = 0.0f;
+    
+    /// substeps of the last call to `step`
+    int substeps = 0;
+    
+    /// rooms are stepped on different threads, so each draws from its own stream
+    SeededRandom random;
+    
     inline void initialize() {
         A->target = B;
         B->target = A;
     }
     
+    /// pairs that met within a substep, with continuous collision
+    int impacts = 0;
+    
     void solve(float dt) {
-        AABB bA = A->aabb();
-        AABB bB = B->aabb();
-        AABB bAs = A->stick.aabb();
-        AABB bBs = B->stick.aabb();
+        depth = World::solveBodies(A, B, dt);
+    }
+    
+    /// a substep of the position solver, see World::positionBased
+    void relax(float dt, float maxTranslation, const PositionSolver* xpbd) {
+        BodyState a, b;
+        a.save(A);
+        b.save(B);
+        
+        A->predict(dt, maxTranslation);
+        B->predict(dt, maxTranslation);
+        
+        float lambdaA = 0.0f;
+        float lambdaB = 0.0f;
+        
+        depth = 0.0f;
+        
+        for(int i = 0; i != xpbd->iterations; ++i) {
+            World::correctArm(A, xpbd->armCompliance, &lambdaA, dt);
+            World::correctArm(B, xpbd->armCompliance, &lambdaB, dt);
+            depth = std::max(depth, World::correctBodies(A, B, dt));
+        }
+        
+        a.derive(A, dt);
+        b.derive(B, dt);
+    }
+    
+    /// a substep of both bodies, solved with impulses or, if `xpbd` isn't NULL, on positions
+    void advance(float dt, float maxTranslation, const PositionSolver* xpbd) {
+        if(xpbd != NULL) {
+            relax(dt, maxTranslation, xpbd);
+            return;
+        }
+        
+        solve(dt);
+        A->step(dt, maxTranslation);
+        B->step(dt, maxTranslation);
+    }
+    
+    /// if `ccd` isn't NULL a substep in which they would meet is stepped again in pieces
+    void move(float dt, const ContinuousCollision* ccd, const PositionSolver* xpbd) {
+        if(ccd == NULL) {
+            advance(dt, max_translation, xpbd);
+            return;
+        }
+        
+        BodyState a, b;
+        a.save(A);
+        b.save(B);
+        
+        advance(dt, ccd->maxTranslation, xpbd);
+        
+        if(World::impactTime(A, a, B, b, dt) >= dt)
+            return;
         
-        if(touches(bA, bB)) World::solveBodyBody(A, B, dt);
-        if(touches(bA, bBs)) World::solveBodyStick(A, &B->stick, dt);
-        if(touches(bB, bAs)) World::solveBodyStick(B, &A->stick, dt);
-        if(touches(bAs, bBs)) World::solveStickStick(&A->stick, &B->stick, dt);
+        ++impacts;
+        
+        a.restore(A);
+        b.restore(B);
+        
+        int k = std::max(2, ccd->count(dt, std::max(SubstepScheduler::rate(A), SubstepScheduler::rate(B))));
+        float h = dt / k;
+        
+        for(int i = 0; i != k; ++i)
+            advance(h, ccd->maxTranslation, xpbd);
     }
     
-    void step(float dt, int its) {
+    /// `scheduler` picks the substeps instead of `its`, if it isn't NULL
+    /// `ccd` sweeps the bodies over each substep, if it isn't NULL
+    /// `xpbd` solves on positions instead of impulses, if it isn't NULL
+    void step(float dt, int its, const SubstepScheduler* scheduler = NULL, const ContinuousCollision* ccd = NULL, const PositionSolver* xpbd = NULL) {
+        RandomScope scope(&random);
+        
         A->setInputs(aabb);
         B->setInputs(aabb);
         
         A->think(dt);
         B->think(dt);
         
+        if(scheduler != NULL)
+            its = scheduler->count(dt, std::max(SubstepScheduler::rate(A), SubstepScheduler::rate(B)), depth);
+        
+        substeps = its;
+        
         dt /= (float) its;
         
-        for(int i = 0; i < its; ++i) {
-            solve(dt);
-            A->step(dt);
-            B->step(dt);
-        }
+        for(int i = 0; i < its; ++i)
+            move(dt, ccd, xpbd);
         
         //A->constrain(aabb);
         //B->constrain(aabb);
@@ -67,6 +142,7 @@ struct Room {
         
         body->stick = def->stick;
         body->stick.owner = body;
+        body->stick.updateMass();
         
         body->stick.position += body->position;
         body->stick.velocity += body->velocity;
@@ -77,6 +153,7 @@ struct Room {
     inline void reset() {
         copyStatistics(A, &dA);
         copyStatistics(B, &dB);
+        depth = 0.0f;
     }
     
 };
@@ -94,9 +171,27 @@ public:
     
     int generation = 0;
     
+    /// let `scheduler` pick the substeps of each room instead of `col`
+    bool adaptiveSubsteps = false;
+    
+    /// reports the most substeps any room took in a call to `step`
+    SubstepScheduler scheduler;
+    
+    /// sweep the bodies of each room over each substep, see ContinuousCollision
+    bool continuous = false;
+    
+    ContinuousCollision ccd;
+    
+    /// solve each room on positions, see World::positionBased
+    bool positionBased = false;
+    
+    PositionSolver xpbd;
+    
     Builder(int x, int y, float w, float h, const BodyDef& clone) {
         assert(x != 0 && y != 0);
         
+        RandomScope scope(&random);
+        
         float hx = x * 0.5f;
         float hy = y * 0.5f;
         vec2 hd = vec2(w * 0.5f, h * 0.5f);
@@ -115,6 +210,9 @@ public:
                 room.B = new Body(&bd);
                 room.dB = bd;
                 
+                /// the builder has stream 0
+                room.random.stream = (uint32_t)rooms.size() + 1;
+                
                 bodies.push_back(room.A);
                 bodies.push_back(room.B);
                 
@@ -139,9 +237,12 @@ public:
     }
     
     inline void _step_range(int i, int n, float dt, int its) {
+        const SubstepScheduler* s = adaptiveSubsteps ? &scheduler : NULL;
+        const ContinuousCollision* c = continuous ? &ccd : NULL;
+        const PositionSolver* p = positionBased ? &xpbd : NULL;
         int end = i + n;
         for(; i != end; ++i)
-            rooms[i].step(dt, its);
+            rooms[i].step(dt, its, s, c, p);
     }
     
     inline void step_range(int i, int n, float dt, int col, int its) {
@@ -166,6 +267,8 @@ public:
     float step(float dt, int col, int its) {
         assert(dt <= subThreshold);
         
+        RandomScope scope(&random);
+        
         time += dt;
         subTime += dt;
         
@@ -220,9 +323,27 @@ public:
         for(int j = 0; j != i; ++j)
             threads[j].join();
         
+        if(adaptiveSubsteps) {
+            int most = 0;
+            for(const Room& R : rooms)
+                most = std::max(most, R.substeps);
+            
+            scheduler.report(most);
+        }
+        
+        reportChecksum();
+        
         return score;
     }
     
+    /// pairs that met within a substep so far, with `continuous`
+    inline int getImpacts() const {
+        int n = 0;
+        for(const Room& R : rooms)
+            n += R.impacts;
+        return n;
+    }
+    
     inline Brain* getBestBrain() const {
         return bs.best();
     }
@@ -0,0 +1,125 @@
+//
+//  BVH4.cpp
+//  Evolution
+//
+
+#include "BVH4.hpp"
+
+void BVH4::build(const DynamicTree& tree) {
+    nodes.clear();
+    leafData.clear();
+    leafAABBs.clear();
+    leafFilters.clear();
+    
+    int root = tree.getRoot();
+    
+    if(root == null_node)
+        return;
+    
+    collapse(tree, root);
+}
+
+int BVH4::collapse(const DynamicTree& tree, int node) {
+    int index = (int)nodes.size();
+    nodes.emplace_back();
+    
+    int slots[4];
+    int n = 0;
+    
+    if(tree.getNode(node).isLeaf()) {
+        /// only happens at the root
+        slots[n++] = node;
+    }else{
+        slots[n++] = tree.getNode(node).child1;
+        slots[n++] = tree.getNode(node).child2;
+    }
+    
+    /// open the largest internal child until there are four
+    while(n < 4) {
+        int best = -1;
+        float bestArea = -1.0f;
+        
+        for(int i = 0; i != n; ++i) {
+            const TreeNode& child = tree.getNode(slots[i]);
+            
+            if(!child.isLeaf() && child.aabb.area() > bestArea) {
+                best = i;
+                bestArea = child.aabb.area();
+            }
+        }
+        
+        if(best == -1)
+            break;
+        
+        const TreeNode& child = tree.getNode(slots[best]);
+        slots[best] = child.child1;
+        slots[n++] = child.child2;
+    }
+    
+    int children[4];
+    
+    for(int i = 0; i != n; ++i) {
+        const TreeNode& child = tree.getNode(slots[i]);
+        
+        if(child.isLeaf()) {
+            children[i] = ~(int)leafData.size();
+            leafData.push_back(child.data);
+            leafAABBs.push_back(child.aabb);
+            leafFilters.push_back(child.filter);
+        }else{
+            children[i] = collapse(tree, slots[i]);
+        }
+    }
+    
+    /// `nodes` may have moved while the children were added
+    BVH4Node& result = nodes[index];
+    
+    for(int i = 0; i != 4; ++i) {
+        if(i < n) {
+            const AABB& aabb = tree.getNode(slots[i]).aabb;
+            result.lowerX[i] = aabb.lowerBound.x;
+            result.lowerY[i] = aabb.lowerBound.y;
+            result.upperX[i] = aabb.upperBound.x;
+            result.upperY[i] = aabb.upperBound.y;
+            result.children[i] = children[i];
+        }else{
+            result.lowerX[i] = FLT_MAX;
+            result.lowerY[i] = FLT_MAX;
+            result.upperX[i] = -FLT_MAX;
+            result.upperY[i] = -FLT_MAX;
+            result.children[i] = 0;
+        }
+    }
+    
+    return index;
+}
+
+void BVH4::queryPairs(int begin, int end, std::vector<Contact>* list) const {
+    Collector collector;
+    collector.contacts = list;
+    collector.key = key;
+    
+    for(int i = begin; i != end; ++i) {
+        collector.current = leafData[i];
+        query(&collector, leafAABBs[i], &leafFilters[i]);
+    }
+}
+
+void BVH4::query(std::vector<Contact>* list) {
+    queryPairs(0, (int)leafData.size(), list);
+}
+
+void BVH4::query(std::vector<Contact>* list, ThreadPool* pool) {
+    buffers.resize(pool->size());
+    
+    pool->parallel_for((int)leafData.size(), [this] (int begin, int end, int worker) {
+        buffers[worker].clear();
+        queryPairs(begin, end, &buffers[worker]);
+    });
+    
+    /// chunks follow the leaf order, so the result does not depend on the worker count
+    for(std::vector<Contact>& buffer : buffers) {
+        list->insert(list->end(), buffer.begin(), buffer.end());
+        buffer.clear();
+    }
+}
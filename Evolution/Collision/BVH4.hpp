@@ -0,0 +1,148 @@
+//
+//  BVH4.hpp
+//  Evolution
+//
+
+#ifndef BVH4_hpp
+#define BVH4_hpp
+
+#include "DynamicTree.hpp"
+
+#include <cassert>
+#include <cfloat>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/// deepest traversal of a query, 3 entries a level
+#define bvh4_stack_size 256
+
+/// boxes of the four children stored side by side, so all four are tested at once
+struct BVH4Node
+{
+    alignas(16) float lowerX[4];
+    alignas(16) float lowerY[4];
+    alignas(16) float upperX[4];
+    alignas(16) float upperY[4];
+    
+    /// index of a child node, or ~i for leaf i
+    /// empty slots have an inverted box and never touch anything
+    int children[4];
+};
+
+/**
+ ** A read-only snapshot of a DynamicTree, made for fast queries.
+ ** Every node takes up to four children by opening the largest internal nodes below it.
+ ** Nodes are stored depth first, so the first child of a node is the next node.
+ ** Leaf data lives in separate arrays and is only read on a hit.
+ **/
+
+class BVH4
+{
+    
+    std::vector<BVH4Node> nodes;
+    
+    /// data of each leaf, in depth first order
+    std::vector<void*> leafData;
+    
+    /// box and filter of each leaf, only used by the pair query
+    std::vector<AABB> leafAABBs;
+    std::vector<Filter> leafFilters;
+    
+    /// scratch space of each worker for parallel queries
+    std::vector<std::vector<Contact>> buffers;
+    
+    /// writes the children of tree node `node` into a new node, returns its index
+    int collapse(const DynamicTree& tree, int node);
+    
+    /// bit i is set if child i touches `aabb`
+    inline int overlaps(const BVH4Node& node, const AABB& aabb) const {
+#ifdef __SSE__
+        __m128 m = _mm_and_ps(_mm_cmple_ps(_mm_load_ps(node.lowerX), _mm_set1_ps(aabb.upperBound.x)), _mm_cmple_ps(_mm_set1_ps(aabb.lowerBound.x), _mm_load_ps(node.upperX)));
+        m = _mm_and_ps(m, _mm_cmple_ps(_mm_load_ps(node.lowerY), _mm_set1_ps(aabb.upperBound.y)));
+        m = _mm_and_ps(m, _mm_cmple_ps(_mm_set1_ps(aabb.lowerBound.y), _mm_load_ps(node.upperY)));
+        return _mm_movemask_ps(m);
+#else
+        int mask = 0;
+        for(int i = 0; i != 4; ++i) {
+            if(node.lowerX[i] <= aabb.upperBound.x && aabb.lowerBound.x <= node.upperX[i] && node.lowerY[i] <= aabb.upperBound.y && aabb.lowerBound.y <= node.upperY[i])
+                mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+    
+    void queryPairs(int begin, int end, std::vector<Contact>* list) const;
+    
+public:
+    
+    /// orders the data of a pair, see ProxyKey
+    ProxyKey key = NULL;
+    
+    BVH4() {}
+    
+    BVH4(const BVH4&) = delete;
+    
+    BVH4& operator = (const BVH4&) = delete;
+    
+    /// throws away the last snapshot and makes a new one of `tree`
+    void build(const DynamicTree& tree);
+    
+    inline int getNodeCount() const {
+        return (int)nodes.size();
+    }
+    
+    inline int getProxyCount() const {
+        return (int)leafData.size();
+    }
+    
+    /// read-only, so many of these can run at once
+    /// leaves that should not collide with `filter` are skipped, if it isn't NULL
+    template <class T>
+    void query(T* callback, const AABB& aabb, const Filter* filter = NULL) const;
+    
+    void query(std::vector<Contact>* list);
+    
+    /// splits the leaves between the workers of `pool`
+    /// the result is the same as the serial query no matter how many workers there are
+    void query(std::vector<Contact>* list, ThreadPool* pool);
+    
+};
+
+template <class T>
+void BVH4::query(T* callback, const AABB& aabb, const Filter* filter) const {
+    if(nodes.empty())
+        return;
+    
+    int stack[bvh4_stack_size];
+    int top = 0;
+    
+    stack[top++] = 0;
+    
+    while(top != 0) {
+        const BVH4Node& node = nodes[stack[--top]];
+        
+        int mask = overlaps(node, aabb);
+        
+        while(mask != 0) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            
+            int child = node.children[i];
+            
+            if(child < 0) {
+                if(filter != NULL && !should_collide(*filter, leafFilters[~child]))
+                    continue;
+                
+                if(!callback->callback(leafData[~child]))
+                    return;
+            }else{
+                assert(top < bvh4_stack_size);
+                stack[top++] = child;
+            }
+        }
+    }
+}
+
+#endif /* BVH4_hpp */
@@ -0,0 +1,367 @@
+//
+//  Broadphase.h
+//  Evolution
+//
+
+#ifndef Broadphase_h
+#define Broadphase_h
+
+#include "DynamicTree.hpp"
+#include "BVH4.hpp"
+#include "UniformGrid.hpp"
+#include "SweepAndPrune.hpp"
+#include "TiledBroadphase.hpp"
+
+/// the tree refits instead of reinserting once this fraction of its proxies moves in a step
+#define refit_fraction 0.5f
+
+/// keeps the `k` nearest proxies a region query finds, for structures without a nearest query
+template <class T>
+struct NearestCollector
+{
+    T* filter;
+    
+    vec2 p;
+    
+    int k;
+    int found;
+    
+    float bound;
+    
+    void** results;
+    float* lengthSqs;
+    
+    bool callback(void* data) {
+        if(!filter->accept(data))
+            return true;
+        
+        float lengthSq = filter->lengthSq(data, p);
+        
+        if(lengthSq < bound) {
+            found = insert_nearest(data, lengthSq, found, k, results, lengthSqs);
+            
+            if(found == k)
+                bound = lengthSqs[k - 1];
+        }
+        
+        return true;
+    }
+};
+
+/**
+ ** Forwards to one of the broadphase structures, picked by `type`.
+ ** Every structure has the same interface:
+ ** createProxy, moveProxy, destoryProxy, region query and pair query.
+ **/
+
+class Broadphase
+{
+    
+    int type;
+    
+    /// the tree moves its proxies with `refitProxy`
+    bool refitting;
+    
+    /// proxies that left their boxes since the last `update`
+    int moves;
+    
+    /// the tree changed since `bvh` was made
+    bool changed;
+    
+    inline bool useBVH() const {
+        return type == e_tree && snapshot;
+    }
+    
+public:
+    
+    enum type
+    {
+        e_tree,
+        e_grid,
+        e_sap,
+        e_tiles
+    };
+    
+    DynamicTree tree;
+    
+    /// snapshot of `tree` taken by `update`, answers the queries of the tree
+    BVH4 bvh;
+    
+    UniformGrid grid;
+    
+    SweepAndPrune sap;
+    
+    TiledBroadphase tiles;
+    
+    float refitFraction = refit_fraction;
+    
+    /// query a 4-wide snapshot of the tree instead of the tree itself
+    bool snapshot = true;
+    
+    Broadphase(const AABB& bounds, float cellSize, float tileSize) : type(e_tree), refitting(false), moves(0), changed(true), grid(bounds, cellSize), tiles(bounds, tileSize) {}
+    
+    inline int getType() const {
+        return type;
+    }
+    
+    inline bool isRefitting() const {
+        return refitting;
+    }
+    
+    /// only valid while there are no proxies
+    inline void setType(int t) {
+        type = t;
+    }
+    
+    /// pairs of every structure are ordered by `key`, or by address if it is NULL
+    inline void setProxyKey(ProxyKey key) {
+        tree.key = key;
+        bvh.key = key;
+        grid.key = key;
+        sap.key = key;
+        tiles.key = key;
+    }
+    
+    inline int createProxy(const AABB& aabb, void* data, const Filter& filter = Filter()) {
+        switch(type) {
+            case e_grid:
+                return grid.createProxy(aabb, data, filter);
+            case e_sap:
+                return sap.createProxy(aabb, data, filter);
+            case e_tiles:
+                return tiles.createProxy(aabb, data, filter);
+            default:
+                changed = true;
+                return tree.createProxy(aabb, data, filter);
+        }
+    }
+    
+    /// the tree builds itself from all of them at once, the others add them one by one
+    inline void createProxies(int n, const AABB* aabbs, void* const* data, const Filter* filters, int* proxyIds, ThreadPool* pool) {
+        switch(type) {
+            case e_grid:
+                for(int i = 0; i != n; ++i)
+                    proxyIds[i] = grid.createProxy(aabbs[i], data[i], filters != NULL ? filters[i] : Filter());
+                break;
+            case e_sap:
+                for(int i = 0; i != n; ++i)
+                    proxyIds[i] = sap.createProxy(aabbs[i], data[i], filters != NULL ? filters[i] : Filter());
+                break;
+            case e_tiles:
+                for(int i = 0; i != n; ++i)
+                    proxyIds[i] = tiles.createProxy(aabbs[i], data[i], filters != NULL ? filters[i] : Filter());
+                tiles.update(pool);
+                break;
+            default:
+                tree.createProxies(n, aabbs, data, filters, proxyIds, pool);
+                changed = true;
+                break;
+        }
+    }
+    
+    inline bool moveProxy(int proxyId, const AABB& aabb, const vec2& displacement) {
+        switch(type) {
+            case e_grid:
+                return grid.moveProxy(proxyId, aabb, displacement);
+            case e_sap:
+                return sap.moveProxy(proxyId, aabb, displacement);
+            case e_tiles:
+                return tiles.moveProxy(proxyId, aabb, displacement);
+            default:
+                if(refitting ? tree.refitProxy(proxyId, aabb, displacement) : tree.moveProxy(proxyId, aabb, displacement)) {
+                    ++moves;
+                    changed = true;
+                    return true;
+                }
+                
+                return false;
+        }
+    }
+    
+    inline void destoryProxy(int proxyId) {
+        switch(type) {
+            case e_grid:
+                grid.destoryProxy(proxyId);
+                break;
+            case e_sap:
+                sap.destoryProxy(proxyId);
+                break;
+            case e_tiles:
+                tiles.destoryProxy(proxyId);
+                break;
+            default:
+                tree.destoryProxy(proxyId);
+                changed = true;
+                break;
+        }
+    }
+    
+    inline const AABB& getFatAABB(int proxyId) const {
+        switch(type) {
+            case e_grid:
+                return grid.getFatAABB(proxyId);
+            case e_sap:
+                return sap.getFatAABB(proxyId);
+            case e_tiles:
+                return tiles.getFatAABB(proxyId);
+            default:
+                return tree.getFatAABB(proxyId);
+        }
+    }
+    
+    /// points the proxy to other data, after what it pointed to moved
+    inline void setProxyData(int proxyId, void* data) {
+        switch(type) {
+            case e_grid:
+                grid.setProxyData(proxyId, data);
+                break;
+            case e_sap:
+                sap.setProxyData(proxyId, data);
+                break;
+            case e_tiles:
+                tiles.setProxyData(proxyId, data);
+                break;
+            default:
+                tree.setProxyData(proxyId, data);
+                changed = true;
+                break;
+        }
+    }
+    
+    /// lays the proxies out in memory in the order of `proxyIds`, which has every proxy
+    /// proxyIds[i] becomes proxy i, returns false if the structure keeps its layout
+    /// only the tree has one, the others keep their ids
+    inline bool reorderProxies(const int* proxyIds, int n, ThreadPool* pool) {
+        if(type != e_tree || n != tree.getProxyCount())
+            return false;
+        
+        tree.reorderLeaves(proxyIds, n, pool);
+        changed = true;
+        return true;
+    }
+    
+    /// called before any query
+    inline void update() {
+        switch(type) {
+            case e_grid:
+                grid.update();
+                break;
+            case e_sap:
+                sap.update();
+                break;
+            case e_tiles:
+                tiles.update();
+                break;
+            default:
+                if(tree.isStale()) tree.refit();
+                
+                if(snapshot && changed) {
+                    bvh.build(tree);
+                    changed = false;
+                }
+                break;
+        }
+    }
+    
+    /// called once a step, after the proxies moved
+    /// refits the tree on `pool`, rebuilds it if that made it too bad,
+    /// and picks how the tree moves its proxies next step
+    inline void update(ThreadPool* pool, float rebuildFactor) {
+        if(type == e_tiles)
+            tiles.update(pool);
+        
+        if(type == e_tree) {
+            if(tree.isStale()) {
+                tree.refit(pool);
+                rebuildIfDegraded(rebuildFactor, pool);
+            }
+            
+            refitting = moves > refitFraction * tree.getProxyCount();
+            moves = 0;
+        }
+        
+        update();
+    }
+    
+    /// only the tree gets worse over time
+    inline bool rebuildIfDegraded(float factor, ThreadPool* pool) {
+        if(type == e_tree && tree.rebuildIfDegraded(factor, pool)) {
+            changed = true;
+            return true;
+        }
+        
+        return false;
+    }
+    
+    /// read-only, safe to call from many threads after `update()`
+    template <class T>
+    inline void query(T* callback, const AABB& aabb, std::vector<int>* stack) const {
+        switch(type) {
+            case e_grid:
+                grid.query(callback, aabb, stack);
+                break;
+            case e_sap:
+                sap.query(callback, aabb, stack);
+                break;
+            case e_tiles:
+                tiles.query(callback, aabb, stack);
+                break;
+            default:
+                if(useBVH()) {
+                    bvh.query(callback, aabb);
+                }else{
+                    tree.query(callback, aabb, stack);
+                }
+                break;
+        }
+    }
+    
+    /// see DynamicTree::queryNearest
+    /// the tree searches best first, the others check every proxy within `radius` of `p`
+    template <class T>
+    inline int queryNearest(T* filter, const vec2& p, float radius, int k, void** results, float* lengthSqs, std::vector<NearestNode>* heap, std::vector<int>* stack) const {
+        if(type == e_tree)
+            return tree.queryNearest(filter, p, radius, k, results, lengthSqs, heap);
+        
+        if(k <= 0)
+            return 0;
+        
+        NearestCollector<T> collector;
+        collector.filter = filter;
+        collector.p = p;
+        collector.k = k;
+        collector.found = 0;
+        collector.bound = radius * radius;
+        collector.results = results;
+        collector.lengthSqs = lengthSqs;
+        
+        vec2 ext = vec2(radius, radius);
+        query(&collector, AABB(p - ext, p + ext), stack);
+        
+        return collector.found;
+    }
+    
+    /// pairs that `should_collide` drops are never reported
+    inline void query(std::vector<Contact>* list, ThreadPool* pool) {
+        switch(type) {
+            case e_grid:
+                grid.query(list, pool);
+                break;
+            case e_sap:
+                sap.query(list, pool);
+                break;
+            case e_tiles:
+                tiles.query(list, pool);
+                break;
+            default:
+                if(useBVH()) {
+                    bvh.query(list, pool);
+                }else{
+                    tree.query(list, pool);
+                }
+                break;
+        }
+    }
+};
+
+#endif /* Broadphase_h */
@@ -14,6 +14,29 @@
 #define aabb_multipiler 2.0f
 
 #include "vec2.h"
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+/// which proxies may pair up, the same rules as in Box2D
+/// two proxies of the same positive group always pair up, of the same negative group never,
+/// otherwise each must have the category of the other in its mask
+struct Filter
+{
+    uint16_t category;
+    uint16_t mask;
+    
+    int group;
+    
+    inline Filter() : category(0x0001), mask(0xffff), group(0) {}
+};
+
+inline bool should_collide(const Filter& a, const Filter& b) {
+    if(a.group == b.group && a.group != 0)
+        return a.group > 0;
+    
+    return (a.category & b.mask) != 0 && (b.category & a.mask) != 0;
+}
 
 /// axis aligned bounding box
 struct AABB
@@ -60,6 +83,78 @@ inline bool touches(const AABB& a, const AABB& b) {
     return firstbitf(d1.x) * firstbitf(d1.y) * firstbitf(d2.x) * firstbitf(d2.y);
 }
 
+/// squared distance from `p` to the closest point of the box, 0 inside
+inline float aabb_distance_sq(const AABB& aabb, const vec2& p) {
+    float dx = std::max(0.0f, std::max(aabb.lowerBound.x - p.x, p.x - aabb.upperBound.x));
+    float dy = std::max(0.0f, std::max(aabb.lowerBound.y - p.y, p.y - aabb.upperBound.y));
+    return dx * dx + dy * dy;
+}
+
+/// puts `data` into the `found` nearest results so far, sorted nearest first
+/// the furthest one falls off once there are `k`, returns the new count
+/// `results` and `lengthSqs` hold `k` each
+inline int insert_nearest(void* data, float lengthSq, int found, int k, void** results, float* lengthSqs) {
+    assert(0 <= found && found <= k);
+    
+    int i = found < k ? found++ : k - 1;
+    
+    while(i > 0 && lengthSqs[i - 1] > lengthSq) {
+        results[i] = results[i - 1];
+        lengthSqs[i] = lengthSqs[i - 1];
+        --i;
+    }
+    
+    results[i] = data;
+    lengthSqs[i] = lengthSq;
+    
+    return found;
+}
+
+/// spreads the low 16 bits of `x` out to the even bits
+inline uint32_t spread_bits(uint32_t x) {
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+/// z-order curve index of `p` inside `bounds`, 16 bits an axis
+inline uint32_t morton_code(const vec2& p, const AABB& bounds) {
+    vec2 ext = bounds.upperBound - bounds.lowerBound;
+    float fx = ext.x > 0.0f ? (p.x - bounds.lowerBound.x) / ext.x : 0.0f;
+    float fy = ext.y > 0.0f ? (p.y - bounds.lowerBound.y) / ext.y : 0.0f;
+    uint32_t x = (uint32_t)(std::min(std::max(fx, 0.0f), 1.0f) * 65535.0f);
+    uint32_t y = (uint32_t)(std::min(std::max(fy, 0.0f), 1.0f) * 65535.0f);
+    return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+/// stable sort of `values` by `keys`, one byte of the keys a pass from the lowest
+/// `tempKeys` and `tempValues` are scratch space of `n` each, the result ends up in `keys` and `values`
+template <class T>
+void radix_sort(uint32_t* keys, T* values, int n, uint32_t* tempKeys, T* tempValues) {
+    for(int shift = 0; shift != 32; shift += 8) {
+        int offsets[257] = {0};
+        
+        for(int i = 0; i != n; ++i)
+            ++offsets[((keys[i] >> shift) & 0xff) + 1];
+        
+        for(int b = 0; b != 256; ++b)
+            offsets[b + 1] += offsets[b];
+        
+        for(int i = 0; i != n; ++i) {
+            int j = offsets[(keys[i] >> shift) & 0xff]++;
+            tempKeys[j] = keys[i];
+            tempValues[j] = values[i];
+        }
+        
+        /// an even number of passes, so the last one writes back into `keys`
+        std::swap(keys, tempKeys);
+        std::swap(values, tempValues);
+    }
+}
+
 inline AABB extendAABB(const AABB& aabb) {
     static const vec2 extension = vec2(aabb_extension, aabb_extension);
     return AABB(aabb.lowerBound - extension, aabb.upperBound + extension);
@@ -75,4 +170,34 @@ struct Contact
     }
 };
 
+/// a number for the data of a proxy that doesn't depend on where it was allocated
+/// pairs are ordered by it instead of by address when it is set
+typedef uint (*ProxyKey)(const void* data);
+
+/// `a` comes before `b`, by `key` if it isn't NULL, otherwise by address
+inline bool proxy_less(ProxyKey key, const void* a, const void* b) {
+    return key != NULL ? key(a) < key(b) : a < b;
+}
+
+/// turns region queries around each proxy into a list of pairs
+/// each pair is reported once, by the proxy that comes first
+struct Collector
+{
+    std::vector<Contact>* contacts;
+    
+    void* current;
+    
+    ProxyKey key = NULL;
+    
+    bool callback(void* data) {
+        if(proxy_less(key, current, data)) {
+            Contact contact;
+            contact.obj1 = current;
+            contact.obj2 = data;
+            contacts->push_back(contact);
+        }
+        return true;
+    }
+};
+
 #endif /* Collision_h */
@@ -13,6 +13,9 @@ DynamicTree::DynamicTree() {
     count = 0;
     next = 0;
     root = null_node;
+    builtAreaRatio = 0.0f;
+    levelsDirty = true;
+    stale = false;
     
     nodes = (TreeNode*)Alloc(sizeof(TreeNode) * capacity);
 
@@ -66,6 +69,8 @@ int DynamicTree::allocate_node() {
 }
 
 void DynamicTree::insertProxy(int proxyId) {
+    levelsDirty = true;
+    
     if(root == null_node) {
         root = proxyId;
         nodes[root].parent = null_node;
@@ -189,7 +194,9 @@ bool DynamicTree::moveProxy(int nodeId, const AABB &aabb, const vec2& displaceme
     return true;
 }
 
-void DynamicTree::removeProxy(int leaf) {    
+void DynamicTree::removeProxy(int leaf) {
+    levelsDirty = true;
+    
     if (leaf == root) {
         root = null_node;
         return;
@@ -268,13 +275,483 @@ void DynamicTree::query(std::vector<Contact> *list) {
     Collector collector;
     
     collector.contacts = list;
+    collector.key = key;
+    
+    std::vector<int> stack;
     
     for(int i = 0; i < capacity; ++i) {
         if(nodes[i].height == 0) {
             collector.current = nodes[i].data;
-            query(&collector, nodes[i].aabb);
+            query(&collector, nodes[i].aabb, &stack, &nodes[i].filter);
+        }
+    }
+}
+
+void DynamicTree::query(std::vector<Contact> *list, ThreadPool *pool) {
+    if(root == null_node) return;
+    
+    if(nodes[root].isLeaf()) return;
+    
+    leaves.clear();
+    for(int i = 0; i < capacity; ++i) {
+        if(nodes[i].height == 0)
+            leaves.push_back(i);
+    }
+    
+    workers.resize(pool->size());
+    
+    pool->parallel_for((int)leaves.size(), [this] (int begin, int end, int worker) {
+        Worker& w = workers[worker];
+        
+        w.contacts.clear();
+        
+        Collector collector;
+        collector.contacts = &w.contacts;
+        collector.key = key;
+        
+        for(int i = begin; i != end; ++i) {
+            const TreeNode& leaf = nodes[leaves[i]];
+            collector.current = leaf.data;
+            query(&collector, leaf.aabb, &w.stack, &leaf.filter);
+        }
+    });
+    
+    /// chunks are in leaf order, so appending them in worker order gives the serial order
+    for(Worker& w : workers) {
+        list->insert(list->end(), w.contacts.begin(), w.contacts.end());
+        w.contacts.clear();
+    }
+}
+
+void DynamicTree::queryPacket(const AABB* aabbs, const int* order, int count, Worker* w) const {
+    /// bounds of the packet, to throw away nodes with one test
+    AABB bounds = aabbs[order[0]];
+    for(int i = 1; i != count; ++i)
+        bounds = combine_aabb(bounds, aabbs[order[i]]);
+    
+    if(!touches(bounds, nodes[root].aabb))
+        return;
+    
+    uint32_t all = count == 32 ? 0xffffffff : ((uint32_t)1 << count) - 1;
+    
+    w->packetStack.clear();
+    w->packetStack.push_back(std::make_pair(root, all));
+    
+    while(!w->packetStack.empty()) {
+        int node = w->packetStack.back().first;
+        uint32_t mask = w->packetStack.back().second;
+        w->packetStack.pop_back();
+        
+        const AABB& aabb = nodes[node].aabb;
+        
+        uint32_t active = 0;
+        
+        if(touches(bounds, aabb)) {
+            for(uint32_t m = mask; m != 0; m &= m - 1) {
+                int i = __builtin_ctz(m);
+                
+                if(touches(aabbs[order[i]], aabb))
+                    active |= (uint32_t)1 << i;
+            }
+        }
+        
+        if(active == 0)
+            continue;
+        
+        if(nodes[node].isLeaf()) {
+            for(uint32_t m = active; m != 0; m &= m - 1) {
+                int i = __builtin_ctz(m);
+                w->hits.push_back(std::make_pair(order[i], nodes[node].data));
+            }
+            
+            continue;
+        }
+        
+        /// same order as the single query
+        w->packetStack.push_back(std::make_pair(nodes[node].child1, active));
+        w->packetStack.push_back(std::make_pair(nodes[node].child2, active));
+    }
+}
+
+void DynamicTree::queryBatch(const AABB* aabbs, int n, BatchResults* batch, ThreadPool* pool) {
+    batch->offsets.assign(n + 1, 0);
+    batch->results.clear();
+    
+    if(root == null_node || n == 0)
+        return;
+    
+    AABB bounds = nodes[root].aabb;
+    
+    packetCodes.resize(n);
+    packetOrder.resize(n);
+    
+    for(int i = 0; i != n; ++i) {
+        packetCodes[i] = morton_code(0.5f * (aabbs[i].lowerBound + aabbs[i].upperBound), bounds);
+        packetOrder[i] = i;
+    }
+    
+    std::sort(packetOrder.begin(), packetOrder.end(), [this] (int a, int b) {
+        return packetCodes[a] < packetCodes[b] || (packetCodes[a] == packetCodes[b] && a < b);
+    });
+    
+    int packets = (n + query_packet_size - 1) / query_packet_size;
+    
+    workers.resize(pool->size());
+    
+    pool->parallel_for(packets, [&] (int begin, int end, int worker) {
+        Worker& w = workers[worker];
+        w.hits.clear();
+        
+        for(int i = begin; i != end; ++i) {
+            int first = i * query_packet_size;
+            int count = std::min(query_packet_size, n - first);
+            queryPacket(aabbs, packetOrder.data() + first, count, &w);
+        }
+    });
+    
+    /// counting sort of the hits by query
+    /// every query is in one packet, so its hits keep their traversal order
+    for(Worker& w : workers) {
+        for(const std::pair<int, void*>& hit : w.hits)
+            ++batch->offsets[hit.first + 1];
+    }
+    
+    for(int i = 0; i != n; ++i)
+        batch->offsets[i + 1] += batch->offsets[i];
+    
+    batch->results.resize(batch->offsets[n]);
+    
+    /// the start of every query is its write cursor, it ends up at the start of the next one
+    for(Worker& w : workers) {
+        for(const std::pair<int, void*>& hit : w.hits)
+            batch->results[batch->offsets[hit.first]++] = hit.second;
+        
+        w.hits.clear();
+    }
+    
+    for(int i = n; i > 0; --i)
+        batch->offsets[i] = batch->offsets[i - 1];
+    
+    batch->offsets[0] = 0;
+}
+
+void DynamicTree::createProxies(int n, const AABB* aabbs, void* const* data, const Filter* filters, int* proxyIds, ThreadPool* pool) {
+    for(int i = 0; i != n; ++i) {
+        int node = allocate_node();
+        nodes[node].height = 0;
+        nodes[node].aabb = aabbs[i];
+        nodes[node].data = data[i];
+        nodes[node].filter = filters != NULL ? filters[i] : Filter();
+        nodes[node].parent = null_node;
+        proxyIds[i] = node;
+    }
+    
+    rebuild(pool);
+}
+
+int DynamicTree::partition(int begin, int end) {
+    /// bounds of the centers
+    vec2 lower = vec2(FLT_MAX, FLT_MAX);
+    vec2 upper = vec2(-FLT_MAX, -FLT_MAX);
+    
+    for(int i = begin; i != end; ++i) {
+        const AABB& aabb = nodes[leaves[i]].aabb;
+        vec2 c = 0.5f * (aabb.lowerBound + aabb.upperBound);
+        lower = min(lower, c);
+        upper = max(upper, c);
+    }
+    
+    vec2 extent = upper - lower;
+    
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    int bestSplit = 0;
+    
+    for(int axis = 0; axis != 2; ++axis) {
+        float lo = axis == 0 ? lower.x : lower.y;
+        float ext = axis == 0 ? extent.x : extent.y;
+        
+        if(ext <= 0.0f)
+            continue;
+        
+        float k = sah_bins / ext;
+        
+        int counts[sah_bins] = {0};
+        AABB bounds[sah_bins];
+        
+        for(int b = 0; b != sah_bins; ++b)
+            bounds[b] = AABB(vec2(FLT_MAX, FLT_MAX), vec2(-FLT_MAX, -FLT_MAX));
+        
+        for(int i = begin; i != end; ++i) {
+            const AABB& aabb = nodes[leaves[i]].aabb;
+            float c = 0.5f * (axis == 0 ? aabb.lowerBound.x + aabb.upperBound.x : aabb.lowerBound.y + aabb.upperBound.y);
+            int b = std::min(sah_bins - 1, (int)((c - lo) * k));
+            ++counts[b];
+            bounds[b] = combine_aabb(bounds[b], aabb);
+        }
+        
+        /// cost of the right side of each split, swept from the right
+        float rightCost[sah_bins];
+        AABB right = AABB(vec2(FLT_MAX, FLT_MAX), vec2(-FLT_MAX, -FLT_MAX));
+        int rightCount = 0;
+        
+        for(int b = sah_bins - 1; b > 0; --b) {
+            right = combine_aabb(right, bounds[b]);
+            rightCount += counts[b];
+            rightCost[b] = rightCount == 0 ? 0.0f : right.perimeter() * rightCount;
+        }
+        
+        AABB left = AABB(vec2(FLT_MAX, FLT_MAX), vec2(-FLT_MAX, -FLT_MAX));
+        int leftCount = 0;
+        
+        for(int b = 0; b != sah_bins - 1; ++b) {
+            left = combine_aabb(left, bounds[b]);
+            leftCount += counts[b];
+            
+            if(leftCount == 0 || leftCount == end - begin)
+                continue;
+            
+            float cost = left.perimeter() * leftCount + rightCost[b + 1];
+            
+            if(cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b + 1;
+            }
+        }
+    }
+    
+    int mid;
+    
+    if(bestAxis == -1) {
+        /// every center is the same, any split is as good as the others
+        mid = (begin + end) / 2;
+    }else{
+        float lo = bestAxis == 0 ? lower.x : lower.y;
+        float k = sah_bins / (bestAxis == 0 ? extent.x : extent.y);
+        
+        int* split = std::partition(leaves.data() + begin, leaves.data() + end, [&] (int leaf) {
+            const AABB& aabb = nodes[leaf].aabb;
+            float c = 0.5f * (bestAxis == 0 ? aabb.lowerBound.x + aabb.upperBound.x : aabb.lowerBound.y + aabb.upperBound.y);
+            return std::min(sah_bins - 1, (int)((c - lo) * k)) < bestSplit;
+        });
+        
+        mid = (int)(split - leaves.data());
+    }
+    
+    return mid;
+}
+
+int DynamicTree::build(int begin, int end, int base, int depth) {
+    if(end - begin == 1)
+        return leaves[begin];
+    
+    /// a negative depth means this already is a task
+    if(depth == 0 || (depth > 0 && end - begin < min_build_task)) {
+        BuildTask task;
+        task.begin = begin;
+        task.end = end;
+        task.base = base;
+        task.node = null_node;
+        tasks.push_back(task);
+        
+        /// -2, -3, ... so it can't be mistaken for null_node
+        return -(int)tasks.size() - 1;
+    }
+    
+    int mid = partition(begin, end);
+    
+    int node = internals[base];
+    int child1 = build(begin, mid, base + 1, depth - 1);
+    int child2 = build(mid, end, base + mid - begin, depth - 1);
+    
+    nodes[node].child1 = child1;
+    nodes[node].child2 = child2;
+    
+    if(depth > 0) {
+        /// children may still be tasks, fixed after the tasks are done
+        tops.push_back(node);
+        return node;
+    }
+    
+    nodes[child1].parent = node;
+    nodes[child2].parent = node;
+    fix(node);
+    
+    return node;
+}
+
+void DynamicTree::rebuild(ThreadPool* pool) {
+    leaves.clear();
+    
+    for(int i = 0; i < capacity; ++i) {
+        if(nodes[i].height == 0) {
+            leaves.push_back(i);
+        }else if(nodes[i].height > 0) {
+            free_node(i);
         }
     }
+    
+    int n = (int)leaves.size();
+    
+    if(n == 0) {
+        root = null_node;
+        return;
+    }
+    
+    /// every internal node the build needs is allocated up front
+    internals.resize(n - 1);
+    for(int i = 0; i != n - 1; ++i) {
+        int node = allocate_node();
+        nodes[node].height = 1;
+        internals[i] = node;
+    }
+    
+    /// split the top of the tree serially until there is enough work for every worker
+    int depth = 0;
+    if(pool != NULL) {
+        while((1 << depth) < 4 * pool->size())
+            ++depth;
+    }
+    
+    tasks.clear();
+    tops.clear();
+    root = build(0, n, 0, depth);
+    
+    auto run = [this] (int begin, int end, int /* worker */) {
+        for(int i = begin; i != end; ++i) {
+            BuildTask& task = tasks[i];
+            task.node = build(task.begin, task.end, task.base, -1);
+        }
+    };
+    
+    if(pool != NULL) {
+        pool->parallel_for((int)tasks.size(), run);
+    }else{
+        run(0, (int)tasks.size(), 0);
+    }
+    
+    if(root < null_node)
+        root = tasks[-root - 2].node;
+    
+    nodes[root].parent = null_node;
+    
+    /// hook the tasks up to the top of the tree and fix it bottom up
+    /// `tops` has children before their parents
+    for(int node : tops) {        
+        int child1 = nodes[node].child1;
+        int child2 = nodes[node].child2;
+        
+        if(child1 < null_node)
+            child1 = nodes[node].child1 = tasks[-child1 - 2].node;
+        
+        if(child2 < null_node)
+            child2 = nodes[node].child2 = tasks[-child2 - 2].node;
+        
+        nodes[child1].parent = node;
+        nodes[child2].parent = node;
+        
+        fix(node);
+    }
+    
+    builtAreaRatio = getAreaRatio();
+    levelsDirty = true;
+    stale = false;
+}
+
+void DynamicTree::refit(ThreadPool* pool) {
+    if(root == null_node) {
+        stale = false;
+        return;
+    }
+    
+    if(levelsDirty) {
+        /// counting sort of the internal nodes by height
+        int height = nodes[root].height;
+        
+        levelStart.assign(height + 1, 0);
+        
+        for(int i = 0; i < capacity; ++i) {
+            if(nodes[i].height > 0)
+                ++levelStart[nodes[i].height];
+        }
+        
+        for(int h = 1; h <= height; ++h)
+            levelStart[h] += levelStart[h - 1];
+        
+        levels.resize(levelStart[height]);
+        
+        for(int i = capacity - 1; i >= 0; --i) {
+            if(nodes[i].height > 0)
+                levels[--levelStart[nodes[i].height]] = i;
+        }
+        
+        /// levelStart[h] is now the start of height h + 1
+        levelStart.erase(levelStart.begin());
+        levelStart.push_back((int)levels.size());
+        
+        levelsDirty = false;
+    }
+    
+    auto run = [this] (int begin, int end, int /* worker */) {
+        for(int i = begin; i != end; ++i) {
+            int node = levels[i];
+            nodes[node].aabb = combine_aabb(nodes[nodes[node].child1].aabb, nodes[nodes[node].child2].aabb);
+        }
+    };
+    
+    /// children are always lower than their parents, so every level only reads finished ones
+    int begin = 0;
+    for(int end : levelStart) {
+        int n = end - begin;
+        
+        if(pool != NULL && n >= min_refit_level) {
+            pool->parallel_for(n, [&] (int b, int e, int worker) {
+                run(begin + b, begin + e, worker);
+            });
+        }else{
+            run(begin, end, 0);
+        }
+        
+        begin = end;
+    }
+    
+    stale = false;
+}
+
+void DynamicTree::reorderLeaves(const int* proxyIds, int n, ThreadPool* pool) {
+    assert(n == getProxyCount());
+    
+    std::vector<TreeNode> moved(n);
+    for(int i = 0; i != n; ++i) {
+        assert(nodes[proxyIds[i]].isLeaf());
+        moved[i] = nodes[proxyIds[i]];
+    }
+    
+    /// the tree holds 2n - 1 nodes, so n < capacity
+    freeFrom(n);
+    
+    for(int i = 0; i != n; ++i) {
+        nodes[i] = moved[i];
+        nodes[i].parent = null_node;
+    }
+    
+    next = n;
+    count = n;
+    
+    rebuild(pool);
+}
+
+bool DynamicTree::rebuildIfDegraded(float factor, ThreadPool* pool) {
+    if(root == null_node)
+        return false;
+    
+    if(builtAreaRatio > 0.0f && getAreaRatio() < factor * builtAreaRatio)
+        return false;
+    
+    rebuild(pool);
+    
+    return true;
 }
 
 void DynamicTree::validateStructure() {
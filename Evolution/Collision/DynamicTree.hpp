@@ -10,11 +10,37 @@
 #define DynamicTree_hpp
 
 #include "Collision.h"
+#include "ThreadPool.h"
 
 #include <stack>
+#include <algorithm>
+#include <functional>
 
 #define null_node -1
 
+/// centroid bins per axis in the SAH build
+#define sah_bins 16
+
+/// subtrees smaller than this are not split into parallel tasks
+#define min_build_task 256
+
+/// levels smaller than this are refit on the calling thread
+#define min_refit_level 256
+
+/// queries that traverse the tree together in a batched query, one bit each in a mask
+#define query_packet_size 32
+
+/// node waiting in the best-first search, and the squared distance to its box
+typedef std::pair<float, int> NearestNode;
+
+/// output of a batched query
+/// query i hit results[offsets[i]] ... results[offsets[i + 1] - 1]
+struct BatchResults
+{
+    std::vector<int> offsets;
+    std::vector<void*> results;
+};
+
 struct TreeNode
 {
     int child1;
@@ -37,6 +63,9 @@ struct TreeNode
     
     AABB aabb;
     
+    /// only used by leaves
+    Filter filter;
+    
     inline bool isLeaf() const {
         return child1 == null_node;
     }
@@ -118,6 +147,74 @@ class DynamicTree
     
     void removeProxy(int leaf);
     
+    /// scratch space of one worker for parallel queries
+    struct Worker
+    {
+        std::vector<int> stack;
+        std::vector<Contact> contacts;
+        
+        /// nodes of a packet and the queries still touching them
+        std::vector<std::pair<int, uint32_t>> packetStack;
+        
+        /// query index and data of every hit of a batched query
+        std::vector<std::pair<int, void*>> hits;
+    };
+    
+    std::vector<Worker> workers;
+    
+    /// leaves in index order
+    std::vector<int> leaves;
+    
+    /// queries of a batched query sorted by morton code, and their codes
+    std::vector<int> packetOrder;
+    std::vector<uint32_t> packetCodes;
+    
+    /// traverses the tree once for queries order[begin] ... order[end - 1]
+    void queryPacket(const AABB* aabbs, const int* order, int count, Worker* w) const;
+    
+    /// internal nodes handed out to the SAH build
+    std::vector<int> internals;
+    
+    /// area ratio right after the last rebuild
+    float builtAreaRatio;
+    
+    /// subtree of the SAH build that is built as one task
+    struct BuildTask
+    {
+        int begin;
+        int end;
+        
+        /// first of the `end - begin - 1` internal nodes of the task
+        int base;
+        
+        /// root of the built subtree
+        int node;
+    };
+    
+    std::vector<BuildTask> tasks;
+    
+    /// internal nodes built before the tasks, children first
+    std::vector<int> tops;
+    
+    /// internal nodes grouped by height, for the refit
+    /// nodes of height h are levels[levelStart[h - 1]] ... levels[levelStart[h] - 1]
+    std::vector<int> levels;
+    std::vector<int> levelStart;
+    
+    /// the tree changed shape since `levels` was made
+    bool levelsDirty;
+    
+    /// leaves moved by `refitProxy` since the last refit
+    bool stale;
+    
+    /// splits leaves[begin] ... leaves[end - 1] in two by binned SAH, returns the split
+    int partition(int begin, int end);
+    
+    /// builds a subtree out of leaves[begin] ... leaves[end - 1]
+    /// uses internals[base] ... internals[base + end - begin - 2]
+    /// when `depth` runs out, the subtree is left to a task and a negative task marker is returned
+    int build(int begin, int end, int base, int depth);
+    
     int computeHeight(int nodeId) const {
         assert(0 <= nodeId && nodeId < capacity);
         TreeNode* node = nodes + nodeId;
@@ -132,22 +229,8 @@ class DynamicTree
     
 public:
     
-    struct Collector
-    {
-        std::vector<Contact>* contacts;
-        
-        void* current;
-        
-        bool callback(void* data) {
-            if(data > current) {
-                Contact contact;
-                contact.obj1 = current;
-                contact.obj2 = data;
-                contacts->push_back(contact);
-            }
-            return true;
-        }
-    };
+    /// orders the data of a pair, see ProxyKey
+    ProxyKey key = NULL;
     
     DynamicTree();
     
@@ -160,17 +243,55 @@ public:
     DynamicTree& operator = (const DynamicTree& tree) = delete;
     
     /// creates a proxy and inserts it into the tree
-    inline int createProxy(const AABB& aabb, void* data) {
+    inline int createProxy(const AABB& aabb, void* data, const Filter& filter = Filter()) {
         int node = allocate_node();
         nodes[node].height = 0;
         nodes[node].aabb = aabb;
         nodes[node].data = data;
+        nodes[node].filter = filter;
         insertProxy(node);
         return node;
     }
     
+    /// creates many proxies at once and builds the whole tree with binned SAH
+    /// much faster and much better than inserting them one by one
+    /// `filters` can be NULL for the default filter
+    void createProxies(int n, const AABB* aabbs, void* const* data, const Filter* filters, int* proxyIds, ThreadPool* pool = NULL);
+    
     bool moveProxy(int nodeId, const AABB& aabb, const vec2& displacement);
     
+    /// grows the leaf in place like `moveProxy`, but leaves the internal nodes alone
+    /// `refit` must be called before the next query
+    inline bool refitProxy(int nodeId, const AABB& aabb, const vec2& displacement) {
+        assert(nodes[nodeId].isLeaf());
+        
+        if(nodes[nodeId].aabb.contains(aabb))
+            return false;
+        
+        vec2 d = aabb_multipiler * vec2(fabs(displacement.x), fabs(displacement.y));
+        
+        AABB proxyAABB = aabb;
+        proxyAABB.lowerBound -= d;
+        proxyAABB.upperBound += d;
+        nodes[nodeId].aabb = extendAABB(proxyAABB);
+        
+        stale = true;
+        
+        return true;
+    }
+    
+    /// recomputes the boxes of the internal nodes bottom up, one level at a time
+    /// the shape of the tree stays the same, each level is split between the workers of `pool`
+    void refit(ThreadPool* pool = NULL);
+    
+    inline bool isStale() const {
+        return stale;
+    }
+    
+    inline int getProxyCount() const {
+        return root == null_node ? 0 : (count + 1) / 2;
+    }
+    
     inline void destoryProxy(int proxyId) {
         removeProxy(proxyId);
         free_node(proxyId);
@@ -184,13 +305,70 @@ public:
     
     int getMaxBalance() const;
     
+    inline int getRoot() const {
+        return root;
+    }
+    
+    inline const TreeNode& getNode(int node) const {
+        assert(0 <= node && node < capacity);
+        return nodes[node];
+    }
+    
+    inline const AABB& getFatAABB(int proxyId) const {
+        assert(0 <= proxyId && proxyId < capacity);
+        return nodes[proxyId].aabb;
+    }
+    
+    inline void setProxyData(int proxyId, void* data) {
+        assert(nodes[proxyId].isLeaf());
+        nodes[proxyId].data = data;
+    }
+    
     float getAreaRatio() const;
     
+    /// throws away the internal nodes and builds them again from the leaves with binned SAH
+    /// proxy ids stay the same, subtrees are built in parallel on `pool`
+    void rebuild(ThreadPool* pool = NULL);
+    
+    /// moves leaf proxyIds[i] to node i and builds the internal nodes again after the leaves,
+    /// so leaves that are near in the list are near in memory
+    /// `proxyIds` has every proxy of the tree, the caller takes the new ids
+    void reorderLeaves(const int* proxyIds, int n, ThreadPool* pool = NULL);
+    
+    /// rebuilds once the area ratio is `factor` times the ratio after the last rebuild
+    bool rebuildIfDegraded(float factor, ThreadPool* pool = NULL);
+    
     template <class T>
     void query(T* callback, const AABB& aabb);
     
+    /// same as above, but traverses with a stack owned by the caller
+    /// read-only, so many of these can run at once
+    /// leaves that should not collide with `filter` are skipped, if it isn't NULL
+    template <class T>
+    void query(T* callback, const AABB& aabb, std::vector<int>* stack, const Filter* filter = NULL) const;
+    
     void query(std::vector<Contact>* list);
     
+    /// pairs that `should_collide` drops are never reported
+    /// splits the leaves between the workers of `pool`
+    /// the result is the same as the serial query no matter how many workers there are
+    void query(std::vector<Contact>* list, ThreadPool* pool);
+    
+    /// region queries of `n` boxes at once
+    /// the boxes are sorted along a morton curve and split into packets of `query_packet_size`,
+    /// so boxes near each other share one traversal of the upper levels
+    /// the hits of each query are in the order a single query would find them
+    void queryBatch(const AABB* aabbs, int n, BatchResults* batch, ThreadPool* pool);
+    
+    /// best-first search for the `k` leaves nearest to `p`, closer than `radius`
+    /// nodes are visited nearest box first and the radius shrinks to the k-th result found,
+    /// so the search stops as soon as no box left can hold anything closer
+    /// `filter->accept(data)` skips leaves, `filter->lengthSq(data, p)` measures them
+    /// writes the results nearest first and returns how many were found
+    /// read-only, `heap` is scratch space owned by the caller
+    template <class T>
+    int queryNearest(T* filter, const vec2& p, float radius, int k, void** results, float* lengthSqs, std::vector<NearestNode>* heap) const;
+    
 };
 
 template <class T>
@@ -226,4 +404,93 @@ void DynamicTree::query(T *callback, const AABB &aabb) {
     }
 }
 
+template <class T>
+void DynamicTree::query(T *callback, const AABB &aabb, std::vector<int>* stack, const Filter* filter) const {
+    stack->clear();
+    stack->push_back(root);
+    
+    while(!stack->empty()) {
+        int node = stack->back();
+        stack->pop_back();
+        
+        if(node == null_node)
+            continue;
+        
+        if(nodes[node].isLeaf()) {
+            if(touches(aabb, nodes[node].aabb) && (filter == NULL || should_collide(*filter, nodes[node].filter))) {
+                if(!callback->callback(nodes[node].data))
+                    return;
+            }
+            
+            continue;
+        }
+        
+        int child1 = nodes[node].child1;
+        int child2 = nodes[node].child2;
+        
+        if(touches(aabb, nodes[child1].aabb))
+            stack->push_back(child1);
+        
+        if(touches(aabb, nodes[child2].aabb))
+            stack->push_back(child2);
+    }
+}
+
+template <class T>
+int DynamicTree::queryNearest(T* filter, const vec2& p, float radius, int k, void** results, float* lengthSqs, std::vector<NearestNode>* heap) const {
+    if(root == null_node || k <= 0)
+        return 0;
+    
+    int found = 0;
+    float bound = radius * radius;
+    
+    std::greater<NearestNode> nearer;
+    
+    heap->clear();
+    heap->push_back(NearestNode(aabb_distance_sq(nodes[root].aabb, p), root));
+    
+    while(!heap->empty()) {
+        std::pop_heap(heap->begin(), heap->end(), nearer);
+        NearestNode top = heap->back();
+        heap->pop_back();
+        
+        /// everything left is further away
+        if(top.first >= bound)
+            break;
+        
+        const TreeNode& node = nodes[top.second];
+        
+        if(node.isLeaf()) {
+            if(!filter->accept(node.data))
+                continue;
+            
+            float lengthSq = filter->lengthSq(node.data, p);
+            
+            if(lengthSq < bound) {
+                found = insert_nearest(node.data, lengthSq, found, k, results, lengthSqs);
+                
+                if(found == k)
+                    bound = lengthSqs[k - 1];
+            }
+            
+            continue;
+        }
+        
+        float d1 = aabb_distance_sq(nodes[node.child1].aabb, p);
+        float d2 = aabb_distance_sq(nodes[node.child2].aabb, p);
+        
+        if(d1 < bound) {
+            heap->push_back(NearestNode(d1, node.child1));
+            std::push_heap(heap->begin(), heap->end(), nearer);
+        }
+        
+        if(d2 < bound) {
+            heap->push_back(NearestNode(d2, node.child2));
+            std::push_heap(heap->begin(), heap->end(), nearer);
+        }
+    }
+    
+    return found;
+}
+
 #endif /* DynamicTree_hpp */
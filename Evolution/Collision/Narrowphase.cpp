@@ -0,0 +1,428 @@
+//
+//  Narrowphase.cpp
+//  Evolution
+//
+
+#include "Narrowphase.hpp"
+
+static inline float clampf(float x, float a, float b) {
+    return std::min(std::max(x, a), b);
+}
+
+/// no contact, the rest of the point is zeroed so it is never read uninitialized
+static inline void miss(ContactPoint* out) {
+    out->normal = vec2(0.0f, 0.0f);
+    out->point = vec2(0.0f, 0.0f);
+    out->depth = 0.0f;
+}
+
+void collide_circles(const vec2& a, float ra, const vec2& b, float rb, ContactPoint* out) {
+    vec2 D = b - a;
+    float M = D.lengthSq();
+    float r = ra + rb;
+    
+    if(M >= r * r) {
+        miss(out);
+        return;
+    }
+    
+    M = D.length();
+    
+    out->normal = D / M;
+    out->point = 0.5f * (a + b);
+    out->depth = r - M;
+}
+
+void collide_circle_capsule(const vec2& c, float rc, const vec2& p, const vec2& normal, float h, float r, ContactPoint* out) {
+    float R = rc + r;
+    
+    vec2 d = c - p;
+    
+    /// bounding circle of the capsule
+    float reach = R + h;
+    if(d.lengthSq() >= reach * reach) {
+        miss(out);
+        return;
+    }
+    
+    /// closest point of the segment to the circle
+    vec2 u = normal.I();
+    vec2 q = p + clampf(dot(d, u), -h, h) * u;
+    
+    vec2 D = q - c;
+    float M = D.lengthSq();
+    
+    if(M >= R * R) {
+        miss(out);
+        return;
+    }
+    
+    M = sqrtf(M);
+    
+    if(M > FLT_EPSILON) {
+        out->normal = D / M;
+    }else{
+        /// the circle sits right on the segment, push it out the side it is on
+        out->normal = dot(d, normal) > 0.0f ? -normal : normal;
+    }
+    
+    out->point = q - r * out->normal;
+    out->depth = R - M;
+}
+
+/// the point of A at `s` along its axis and the closest point of B
+static inline void collide_capsule_point(const vec2& pA, const vec2& nA, const vec2& uA, float rA, const vec2& pB, const vec2& uB, float hB, float rB, float s, ContactPoint* out) {
+    float r = rA + rB;
+    
+    vec2 a = pA + s * uA;
+    vec2 b = pB + clampf(dot(a - pB, uB), -hB, hB) * uB;
+    
+    vec2 D = b - a;
+    float M = D.lengthSq();
+    
+    if(M >= r * r) {
+        miss(out);
+        return;
+    }
+    
+    M = sqrtf(M);
+    
+    if(M > FLT_EPSILON) {
+        out->normal = D / M;
+    }else{
+        out->normal = dot(pB - pA, nA) > 0.0f ? nA : -nA;
+    }
+    
+    out->point = 0.5f * (a + b);
+    out->depth = r - M;
+}
+
+void collide_capsules(const vec2& pA, const vec2& nA, float hA, float rA, const vec2& pB, const vec2& nB, float hB, float rB, ContactPoint* out) {
+    vec2 d = pB - pA;
+    
+    miss(&out[1]);
+    
+    /// bounding circles of the capsules
+    float reach = rA + rB + hA + hB;
+    if(d.lengthSq() >= reach * reach) {
+        miss(&out[0]);
+        return;
+    }
+    
+    vec2 uA = nA.I();
+    vec2 uB = nB.I();
+    
+    float c = dot(uA, uB);
+    float sine = uA.x * uB.y - uA.y * uB.x;
+    
+    if(fabs(sine) < parallel_tolerance) {
+        /// side by side, touching along the part of A that B overlaps
+        float o = dot(d, uA);
+        float e = fabs(c) * hB;
+        
+        float lower = std::max(-hA, o - e);
+        float upper = std::min(hA, o + e);
+        
+        if(lower < upper) {
+            collide_capsule_point(pA, nA, uA, rA, pB, uB, hB, rB, lower, out);
+            collide_capsule_point(pA, nA, uA, rA, pB, uB, hB, rB, upper, out + 1);
+            return;
+        }
+    }
+    
+    /// closest points of the two segments, A at s and B at t along their axes
+    float dA = dot(uA, d);
+    float dB = dot(uB, d);
+    float denom = 1.0f - c * c;
+    
+    float s = denom > FLT_EPSILON ? clampf((dA - c * dB) / denom, -hA, hA) : 0.0f;
+    float t = s * c - dB;
+    
+    if(t < -hB || t > hB) {
+        t = clampf(t, -hB, hB);
+        s = clampf(t * c + dA, -hA, hA);
+    }
+    
+    collide_capsule_point(pA, nA, uA, rA, pB, uB, hB, rB, s, out);
+}
+
+void Narrowphase::clear() {
+    circles.clear();
+    circleCapsules.clear();
+    capsules.clear();
+    kinds.clear();
+    entries.clear();
+}
+
+void Narrowphase::addCircles(const vec2& a, float ra, const vec2& b, float rb) {
+    kinds.push_back(e_circles);
+    entries.push_back(circles.size());
+    
+    circles.ax.push_back(a.x);
+    circles.ay.push_back(a.y);
+    circles.bx.push_back(b.x);
+    circles.by.push_back(b.y);
+    circles.r.push_back(ra + rb);
+}
+
+void Narrowphase::addCircleCapsule(const vec2& c, float rc, const vec2& p, const vec2& normal, float h, float r) {
+    kinds.push_back(e_circleCapsule);
+    entries.push_back(circleCapsules.size());
+    
+    circleCapsules.cx.push_back(c.x);
+    circleCapsules.cy.push_back(c.y);
+    circleCapsules.px.push_back(p.x);
+    circleCapsules.py.push_back(p.y);
+    circleCapsules.nx.push_back(normal.x);
+    circleCapsules.ny.push_back(normal.y);
+    circleCapsules.rc.push_back(rc);
+    circleCapsules.h.push_back(h);
+    circleCapsules.r.push_back(r);
+}
+
+void Narrowphase::addCapsules(const vec2& pA, const vec2& nA, float hA, float rA, const vec2& pB, const vec2& nB, float hB, float rB) {
+    kinds.push_back(e_capsules);
+    entries.push_back(capsules.size());
+    
+    capsules.pAx.push_back(pA.x);
+    capsules.pAy.push_back(pA.y);
+    capsules.nAx.push_back(nA.x);
+    capsules.nAy.push_back(nA.y);
+    capsules.hA.push_back(hA);
+    capsules.rA.push_back(rA);
+    
+    capsules.pBx.push_back(pB.x);
+    capsules.pBy.push_back(pB.y);
+    capsules.nBx.push_back(nB.x);
+    capsules.nBy.push_back(nB.y);
+    capsules.hB.push_back(hB);
+    capsules.rB.push_back(rB);
+}
+
+void Narrowphase::circlesScalar(int begin, int end, ContactPoints* out) const {
+    ContactPoint p;
+    
+    for(int i = begin; i != end; ++i) {
+        /// the radius is already the sum, split it any way
+        collide_circles(vec2(circles.ax[i], circles.ay[i]), circles.r[i], vec2(circles.bx[i], circles.by[i]), 0.0f, &p);
+        out->set(i, p);
+    }
+}
+
+void Narrowphase::circleCapsulesScalar(int begin, int end, ContactPoints* out) const {
+    const CircleCapsules& C = circleCapsules;
+    
+    ContactPoint p;
+    
+    for(int i = begin; i != end; ++i) {
+        collide_circle_capsule(vec2(C.cx[i], C.cy[i]), C.rc[i], vec2(C.px[i], C.py[i]), vec2(C.nx[i], C.ny[i]), C.h[i], C.r[i], &p);
+        out->set(i, p);
+    }
+}
+
+void Narrowphase::capsulesScalar(int begin, int end, ContactPoints* out) const {
+    const Capsules& C = capsules;
+    
+    ContactPoint p[max_contact_points];
+    
+    for(int i = begin; i != end; ++i) {
+        collide_capsules(vec2(C.pAx[i], C.pAy[i]), vec2(C.nAx[i], C.nAy[i]), C.hA[i], C.rA[i], vec2(C.pBx[i], C.pBy[i]), vec2(C.nBx[i], C.nBy[i]), C.hB[i], C.rB[i], p);
+        
+        for(int k = 0; k != max_contact_points; ++k)
+            out->set(max_contact_points * i + k, p[k]);
+    }
+}
+
+#ifdef avx2_kernels
+
+avx2_target void Narrowphase::circlesVector(int begin, int end, ContactPoints* out) const {
+    const Circles& C = circles;
+    
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 epsilon = _mm256_set1_ps(FLT_EPSILON);
+    
+    int i = begin;
+    
+    for(; i + 8 <= end; i += 8) {
+        __m256 ax = _mm256_loadu_ps(&C.ax[i]);
+        __m256 ay = _mm256_loadu_ps(&C.ay[i]);
+        __m256 bx = _mm256_loadu_ps(&C.bx[i]);
+        __m256 by = _mm256_loadu_ps(&C.by[i]);
+        __m256 r = _mm256_loadu_ps(&C.r[i]);
+        
+        __m256 dx = _mm256_sub_ps(bx, ax);
+        __m256 dy = _mm256_sub_ps(by, ay);
+        __m256 M = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 hit = _mm256_cmp_ps(M, _mm256_mul_ps(r, r), _CMP_LT_OQ);
+        
+        /// same as vec2::length
+        __m256 length = _mm256_max_ps(_mm256_sqrt_ps(M), epsilon);
+        
+        _mm256_storeu_ps(&out->normalX[i], _mm256_div_ps(dx, length));
+        _mm256_storeu_ps(&out->normalY[i], _mm256_div_ps(dy, length));
+        _mm256_storeu_ps(&out->pointX[i], _mm256_mul_ps(half, _mm256_add_ps(ax, bx)));
+        _mm256_storeu_ps(&out->pointY[i], _mm256_mul_ps(half, _mm256_add_ps(ay, by)));
+        _mm256_storeu_ps(&out->depth[i], _mm256_and_ps(hit, _mm256_sub_ps(r, length)));
+    }
+    
+    circlesScalar(i, end, out);
+}
+
+avx2_target void Narrowphase::circleCapsulesVector(int begin, int end, ContactPoints* out) const {
+    const CircleCapsules& C = circleCapsules;
+    
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 epsilon = _mm256_set1_ps(FLT_EPSILON);
+    
+    int i = begin;
+    
+    for(; i + 8 <= end; i += 8) {
+        __m256 cx = _mm256_loadu_ps(&C.cx[i]);
+        __m256 cy = _mm256_loadu_ps(&C.cy[i]);
+        __m256 px = _mm256_loadu_ps(&C.px[i]);
+        __m256 py = _mm256_loadu_ps(&C.py[i]);
+        __m256 nx = _mm256_loadu_ps(&C.nx[i]);
+        __m256 ny = _mm256_loadu_ps(&C.ny[i]);
+        __m256 h = _mm256_loadu_ps(&C.h[i]);
+        __m256 rB = _mm256_loadu_ps(&C.r[i]);
+        __m256 r = _mm256_add_ps(_mm256_loadu_ps(&C.rc[i]), rB);
+        
+        /// axis of the capsule, normal.I()
+        __m256 ux = ny;
+        __m256 uy = _mm256_sub_ps(zero, nx);
+        
+        __m256 dx = _mm256_sub_ps(cx, px);
+        __m256 dy = _mm256_sub_ps(cy, py);
+        
+        __m256 t = _mm256_add_ps(_mm256_mul_ps(dx, ux), _mm256_mul_ps(dy, uy));
+        t = _mm256_min_ps(_mm256_max_ps(t, _mm256_sub_ps(zero, h)), h);
+        
+        __m256 qx = _mm256_add_ps(px, _mm256_mul_ps(t, ux));
+        __m256 qy = _mm256_add_ps(py, _mm256_mul_ps(t, uy));
+        
+        __m256 Dx = _mm256_sub_ps(qx, cx);
+        __m256 Dy = _mm256_sub_ps(qy, cy);
+        __m256 M = _mm256_add_ps(_mm256_mul_ps(Dx, Dx), _mm256_mul_ps(Dy, Dy));
+        __m256 hit = _mm256_cmp_ps(M, _mm256_mul_ps(r, r), _CMP_LT_OQ);
+        
+        __m256 length = _mm256_sqrt_ps(M);
+        __m256 far = _mm256_cmp_ps(length, epsilon, _CMP_GT_OQ);
+        
+        /// on the segment, push out the side the circle is on
+        __m256 side = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(dx, nx), _mm256_mul_ps(dy, ny)), zero, _CMP_GT_OQ);
+        __m256 sx = _mm256_blendv_ps(nx, _mm256_sub_ps(zero, nx), side);
+        __m256 sy = _mm256_blendv_ps(ny, _mm256_sub_ps(zero, ny), side);
+        
+        __m256 normalX = _mm256_blendv_ps(sx, _mm256_div_ps(Dx, length), far);
+        __m256 normalY = _mm256_blendv_ps(sy, _mm256_div_ps(Dy, length), far);
+        
+        _mm256_storeu_ps(&out->normalX[i], normalX);
+        _mm256_storeu_ps(&out->normalY[i], normalY);
+        _mm256_storeu_ps(&out->pointX[i], _mm256_sub_ps(qx, _mm256_mul_ps(rB, normalX)));
+        _mm256_storeu_ps(&out->pointY[i], _mm256_sub_ps(qy, _mm256_mul_ps(rB, normalY)));
+        _mm256_storeu_ps(&out->depth[i], _mm256_and_ps(hit, _mm256_sub_ps(r, length)));
+    }
+    
+    circleCapsulesScalar(i, end, out);
+}
+
+#else
+
+void Narrowphase::circlesVector(int begin, int end, ContactPoints* out) const {
+    circlesScalar(begin, end, out);
+}
+
+void Narrowphase::circleCapsulesVector(int begin, int end, ContactPoints* out) const {
+    circleCapsulesScalar(begin, end, out);
+}
+
+#endif
+
+void Narrowphase::collide(ThreadPool* pool) {
+    circles.pad();
+    circleCapsules.pad();
+    
+    int n1 = circles.size();
+    int n2 = circleCapsules.size();
+    int n3 = capsules.size();
+    
+    circles.out.resize(n1);
+    circleCapsules.out.resize(n2);
+    capsules.out.resize(max_contact_points * n3);
+    
+    /// blocks of 8 of every kind, one after another
+    int b1 = (n1 + 7) / 8;
+    int b2 = (n2 + 7) / 8;
+    int b3 = (n3 + 7) / 8;
+    
+    bool vector = vectorKernels && cpu_has_avx2();
+    
+    pool->parallel_for(b1 + b2 + b3, [&] (int begin, int end, int /* worker */) {
+        for(int b = begin; b != end; ++b) {
+            if(b < b1) {
+                if(vector)
+                    circlesVector(8 * b, std::min(n1, 8 * b + 8), &circles.out);
+                else
+                    circlesScalar(8 * b, std::min(n1, 8 * b + 8), &circles.out);
+            }else if(b < b1 + b2) {
+                int c = b - b1;
+                
+                if(vector)
+                    circleCapsulesVector(8 * c, std::min(n2, 8 * c + 8), &circleCapsules.out);
+                else
+                    circleCapsulesScalar(8 * c, std::min(n2, 8 * c + 8), &circleCapsules.out);
+            }else{
+                int c = b - b1 - b2;
+                capsulesScalar(8 * c, std::min(n3, 8 * c + 8), &capsules.out);
+            }
+        }
+    });
+}
+
+/// the same point within `tolerance`, or no point in both
+static bool matches(const ContactPoints& a, const ContactPoints& b, int n, float tolerance) {
+    for(int i = 0; i != n; ++i) {
+        bool hitA = a.depth[i] > 0.0f;
+        bool hitB = b.depth[i] > 0.0f;
+        
+        /// right at the edge one of them can miss
+        if(hitA != hitB) {
+            if(std::max(a.depth[i], b.depth[i]) > tolerance)
+                return false;
+            
+            continue;
+        }
+        
+        if(!hitA)
+            continue;
+        
+        if(fabs(a.depth[i] - b.depth[i]) > tolerance) return false;
+        if(fabs(a.normalX[i] - b.normalX[i]) > tolerance) return false;
+        if(fabs(a.normalY[i] - b.normalY[i]) > tolerance) return false;
+        if(fabs(a.pointX[i] - b.pointX[i]) > tolerance * std::max(1.0, fabs(b.pointX[i]))) return false;
+        if(fabs(a.pointY[i] - b.pointY[i]) > tolerance * std::max(1.0, fabs(b.pointY[i]))) return false;
+    }
+    
+    return true;
+}
+
+bool Narrowphase::validate(float tolerance) const {
+    ContactPoints reference;
+    
+    reference.resize(circles.size());
+    circlesScalar(0, circles.size(), &reference);
+    if(!matches(circles.out, reference, circles.size(), tolerance))
+        return false;
+    
+    reference.resize(circleCapsules.size());
+    circleCapsulesScalar(0, circleCapsules.size(), &reference);
+    if(!matches(circleCapsules.out, reference, circleCapsules.size(), tolerance))
+        return false;
+    
+    reference.resize(max_contact_points * capsules.size());
+    capsulesScalar(0, capsules.size(), &reference);
+    if(!matches(capsules.out, reference, max_contact_points * capsules.size(), tolerance))
+        return false;
+    
+    return true;
+}
@@ -0,0 +1,238 @@
+//
+//  Narrowphase.hpp
+//  Evolution
+//
+
+#ifndef Narrowphase_hpp
+#define Narrowphase_hpp
+
+#include "Collision.h"
+#include "ThreadPool.h"
+
+#include <cfloat>
+
+#ifdef avx2_kernels
+#include <immintrin.h>
+#endif
+
+/// sticks closer to parallel than this, as the sine of the angle between them, touch at two points
+#define parallel_tolerance 0.05f
+
+/// largest difference allowed between the vector kernels and the scalar reference
+#define narrowphase_tolerance 1e-4f
+
+/// at most two points a pair, two capsules side by side
+#define max_contact_points 2
+
+/// pushes two shapes apart along `normal`, which points from the first to the second
+/// `depth` is 0 if they don't touch
+struct ContactPoint
+{
+    vec2 normal;
+    vec2 point;
+    
+    float depth;
+};
+
+/**
+ ** Scalar kernels, also the reference of the vector ones.
+ ** A capsule is a segment of half length `h` centered at `p`, along normal.I(), grown by `r`.
+ **/
+
+void collide_circles(const vec2& a, float ra, const vec2& b, float rb, ContactPoint* out);
+
+void collide_circle_capsule(const vec2& c, float rc, const vec2& p, const vec2& normal, float h, float r, ContactPoint* out);
+
+/// writes `max_contact_points` points
+void collide_capsules(const vec2& pA, const vec2& nA, float hA, float rA, const vec2& pB, const vec2& nB, float hB, float rB, ContactPoint* out);
+
+/// points of many pairs, side by side
+struct ContactPoints
+{
+    std::vector<float> normalX;
+    std::vector<float> normalY;
+    std::vector<float> pointX;
+    std::vector<float> pointY;
+    std::vector<float> depth;
+    
+    void resize(int n) {
+        normalX.resize(n);
+        normalY.resize(n);
+        pointX.resize(n);
+        pointY.resize(n);
+        depth.resize(n);
+    }
+    
+    inline void set(int i, const ContactPoint& p) {
+        normalX[i] = p.normal.x;
+        normalY[i] = p.normal.y;
+        pointX[i] = p.point.x;
+        pointY[i] = p.point.y;
+        depth[i] = p.depth;
+    }
+    
+    inline ContactPoint operator [] (int i) const {
+        ContactPoint p;
+        p.normal = vec2(normalX[i], normalY[i]);
+        p.point = vec2(pointX[i], pointY[i]);
+        p.depth = depth[i];
+        return p;
+    }
+};
+
+/**
+ ** The narrowphase of a whole step at once.
+ ** Pairs are gathered by shape into arrays of each coordinate, then every kind runs
+ ** through its own kernel, 8 pairs at a time where the processor has AVX2.
+ ** Positions don't change while contacts are solved, so all of it can happen
+ ** before the solver starts.
+ **/
+
+class Narrowphase
+{
+    
+    /// circle vs circle
+    struct Circles
+    {
+        std::vector<float> ax, ay, bx, by, r;
+        
+        ContactPoints out;
+        
+        void clear() {
+            ax.clear(); ay.clear(); bx.clear(); by.clear(); r.clear();
+        }
+        
+        /// pairs of empty circles up to a whole block
+        void pad() {
+            while(size() % 8 != 0) {
+                ax.push_back(0.0f); ay.push_back(0.0f); bx.push_back(0.0f); by.push_back(0.0f); r.push_back(0.0f);
+            }
+        }
+        
+        inline int size() const {
+            return (int)ax.size();
+        }
+    };
+    
+    /// circle of radius `rc` vs capsule of radius `r`
+    struct CircleCapsules
+    {
+        std::vector<float> cx, cy, rc, px, py, nx, ny, h, r;
+        
+        ContactPoints out;
+        
+        void clear() {
+            cx.clear(); cy.clear(); rc.clear(); px.clear(); py.clear(); nx.clear(); ny.clear(); h.clear(); r.clear();
+        }
+        
+        void pad() {
+            while(size() % 8 != 0) {
+                cx.push_back(0.0f); cy.push_back(0.0f); rc.push_back(0.0f); px.push_back(0.0f); py.push_back(0.0f);
+                nx.push_back(1.0f); ny.push_back(0.0f); h.push_back(0.0f); r.push_back(0.0f);
+            }
+        }
+        
+        inline int size() const {
+            return (int)cx.size();
+        }
+    };
+    
+    /// capsule vs capsule, scalar only, `max_contact_points` points each
+    struct Capsules
+    {
+        std::vector<float> pAx, pAy, nAx, nAy, hA, rA;
+        std::vector<float> pBx, pBy, nBx, nBy, hB, rB;
+        
+        ContactPoints out;
+        
+        void clear() {
+            pAx.clear(); pAy.clear(); nAx.clear(); nAy.clear(); hA.clear(); rA.clear();
+            pBx.clear(); pBy.clear(); nBx.clear(); nBy.clear(); hB.clear(); rB.clear();
+        }
+        
+        inline int size() const {
+            return (int)pAx.size();
+        }
+    };
+    
+    Circles circles;
+    CircleCapsules circleCapsules;
+    Capsules capsules;
+    
+    /// kind and index of each pair
+    std::vector<int> kinds;
+    std::vector<int> entries;
+    
+    /// scalar kernels of entries [begin, end)
+    void circlesScalar(int begin, int end, ContactPoints* out) const;
+    void circleCapsulesScalar(int begin, int end, ContactPoints* out) const;
+    void capsulesScalar(int begin, int end, ContactPoints* out) const;
+    
+    /// vector kernels of entries [begin, end), 8 at a time, the rest scalar
+    void circlesVector(int begin, int end, ContactPoints* out) const;
+    void circleCapsulesVector(int begin, int end, ContactPoints* out) const;
+    
+public:
+    
+    enum kind
+    {
+        e_circles,
+        e_circleCapsule,
+        e_capsules
+    };
+    
+    /// run the vector kernels, only taken where the processor has AVX2
+    bool vectorKernels = true;
+    
+    Narrowphase() {}
+    
+    Narrowphase(const Narrowphase&) = delete;
+    
+    Narrowphase& operator = (const Narrowphase&) = delete;
+    
+    void clear();
+    
+    /// pairs must be added in order, pair i is the i-th one added
+    void addCircles(const vec2& a, float ra, const vec2& b, float rb);
+    
+    void addCircleCapsule(const vec2& c, float rc, const vec2& p, const vec2& normal, float h, float r);
+    
+    void addCapsules(const vec2& pA, const vec2& nA, float hA, float rA, const vec2& pB, const vec2& nB, float hB, float rB);
+    
+    inline int size() const {
+        return (int)kinds.size();
+    }
+    
+    /// runs every kernel, split between the workers of `pool`
+    /// the vector kernels get whole blocks of 8, so a pair comes out the same
+    /// no matter where it is in the arrays or how many workers there are
+    void collide(ThreadPool* pool);
+    
+    /// point `feature` of pair `i`, features past the points of the pair have no depth
+    inline ContactPoint getPoint(int i, int feature) const {
+        int entry = entries[i];
+        
+        switch(kinds[i]) {
+            case e_circles:
+                if(feature == 0) return circles.out[entry];
+                break;
+            case e_circleCapsule:
+                if(feature == 0) return circleCapsules.out[entry];
+                break;
+            default:
+                return capsules.out[max_contact_points * entry + feature];
+        }
+        
+        ContactPoint none;
+        none.normal = vec2(0.0f, 0.0f);
+        none.point = vec2(0.0f, 0.0f);
+        none.depth = 0.0f;
+        return none;
+    }
+    
+    /// runs the scalar reference and checks that every point of `collide` is within `tolerance`
+    bool validate(float tolerance) const;
+    
+};
+
+#endif /* Narrowphase_hpp */
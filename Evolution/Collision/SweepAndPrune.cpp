@@ -0,0 +1,138 @@
+//
+//  SweepAndPrune.cpp
+//  Evolution
+//
+
+#include "SweepAndPrune.hpp"
+
+int SweepAndPrune::createProxy(const AABB& aabb, void* data, const Filter& filter) {
+    int proxyId;
+    
+    if(next == null_proxy) {
+        proxyId = (int)proxies.size();
+        proxies.emplace_back();
+    }else{
+        /// the id may still be in `order` from before it was removed
+        if(removed)
+            compact();
+        
+        proxyId = next;
+        next = proxies[next].next;
+    }
+    
+    proxies[proxyId].aabb = aabb;
+    proxies[proxyId].data = data;
+    proxies[proxyId].filter = filter;
+    proxies[proxyId].next = used_proxy;
+    
+    /// goes to the end, the next sort moves it into place
+    order.push_back(proxyId);
+    lowers.push_back(aabb.lowerBound.x);
+    
+    ++count;
+    dirty = true;
+    
+    return proxyId;
+}
+
+void SweepAndPrune::destoryProxy(int proxyId) {
+    assert(proxies[proxyId].next == used_proxy);
+    
+    proxies[proxyId].next = next;
+    next = proxyId;
+    
+    --count;
+    removed = true;
+}
+
+void SweepAndPrune::compact() {
+    order.erase(std::remove_if(order.begin(), order.end(), [this] (int proxyId) {
+        return proxies[proxyId].next != used_proxy;
+    }), order.end());
+    
+    removed = false;
+}
+
+void SweepAndPrune::sort() {
+    if(removed)
+        compact();
+    
+    assert((int)order.size() == count);
+    
+    lowers.resize(count);
+    
+    maxWidth = 0.0f;
+    
+    for(int i = 0; i != count; ++i) {
+        const AABB& aabb = proxies[order[i]].aabb;
+        lowers[i] = aabb.lowerBound.x;
+        maxWidth = std::max(maxWidth, aabb.upperBound.x - aabb.lowerBound.x);
+    }
+    
+    /// insertion sort, almost sorted already
+    for(int i = 1; i < count; ++i) {
+        float key = lowers[i];
+        int proxyId = order[i];
+        
+        int j = i - 1;
+        while(j >= 0 && lowers[j] > key) {
+            lowers[j + 1] = lowers[j];
+            order[j + 1] = order[j];
+            --j;
+        }
+        
+        lowers[j + 1] = key;
+        order[j + 1] = proxyId;
+    }
+    
+    dirty = false;
+}
+
+void SweepAndPrune::sweep(int begin, int end, std::vector<Contact>* list) const {
+    for(int i = begin; i != end; ++i) {
+        const SweepProxy& A = proxies[order[i]];
+        
+        float upper = A.aabb.upperBound.x;
+        
+        for(int j = i + 1; j != count && lowers[j] <= upper; ++j) {
+            const SweepProxy& B = proxies[order[j]];
+            
+            if(B.aabb.lowerBound.y <= A.aabb.upperBound.y && A.aabb.lowerBound.y <= B.aabb.upperBound.y && should_collide(A.filter, B.filter)) {
+                Contact contact;
+                
+                /// same orientation as Collector
+                if(proxy_less(key, A.data, B.data)) {
+                    contact.obj1 = A.data;
+                    contact.obj2 = B.data;
+                }else{
+                    contact.obj1 = B.data;
+                    contact.obj2 = A.data;
+                }
+                
+                list->push_back(contact);
+            }
+        }
+    }
+}
+
+void SweepAndPrune::query(std::vector<Contact>* list) {
+    update();
+    sweep(0, count, list);
+}
+
+void SweepAndPrune::query(std::vector<Contact>* list, ThreadPool* pool) {
+    update();
+    
+    buffers.resize(pool->size());
+    
+    pool->parallel_for(count, [this] (int begin, int end, int worker) {
+        buffers[worker].clear();
+        sweep(begin, end, &buffers[worker]);
+    });
+    
+    /// chunks follow the sorted order, so the result does not depend on the worker count
+    for(std::vector<Contact>& buffer : buffers) {
+        list->insert(list->end(), buffer.begin(), buffer.end());
+        buffer.clear();
+    }
+}
@@ -0,0 +1,158 @@
+//
+//  SweepAndPrune.hpp
+//  Evolution
+//
+
+#ifndef SweepAndPrune_hpp
+#define SweepAndPrune_hpp
+
+#include "Collision.h"
+#include "ThreadPool.h"
+
+#include <cassert>
+#include <algorithm>
+
+struct SweepProxy
+{
+    AABB aabb;
+    
+    /// data to identify proxies for users
+    void* data;
+    
+    Filter filter;
+    
+    /// next free proxy, or `used_proxy` if the proxy is in use
+    int next;
+};
+
+/**
+ ** Sort and sweep on the x axis.
+ ** `order` keeps the proxies sorted by the lower bound of their boxes. Nothing moves
+ ** more than `max_translation` a step, so the order barely changes between steps and
+ ** an insertion sort puts it back in almost linear time.
+ **
+ ** The sweep walks forward from each proxy until the lower bounds pass its upper bound,
+ ** and checks y before reporting a pair.
+ **/
+
+class SweepAndPrune
+{
+    
+    std::vector<SweepProxy> proxies;
+    
+    /// free list
+    int next;
+    
+    /// proxies in use
+    int count;
+    
+    /// proxies in use, sorted by aabb.lowerBound.x
+    std::vector<int> order;
+    
+    /// lower x of `order`, kept next to each other for the sweep
+    std::vector<float> lowers;
+    
+    /// widest proxy on x, region queries start this far back
+    float maxWidth;
+    
+    /// moved or added since the last sort
+    bool dirty;
+    
+    /// removed since the last sort
+    bool removed;
+    
+    /// scratch space of each worker for parallel queries
+    std::vector<std::vector<Contact>> buffers;
+    
+    /// drops the removed proxies from `order`
+    void compact();
+    
+    /// pairs of order[begin] ... order[end - 1] with the proxies after them
+    void sweep(int begin, int end, std::vector<Contact>* list) const;
+    
+public:
+    
+    /// orders the data of a pair, see ProxyKey
+    ProxyKey key = NULL;
+    
+    static const int null_proxy = -1;
+    
+    static const int used_proxy = -2;
+    
+    SweepAndPrune() : next(null_proxy), count(0), maxWidth(0.0f), dirty(false), removed(false) {}
+    
+    SweepAndPrune(const SweepAndPrune&) = delete;
+    
+    SweepAndPrune& operator = (const SweepAndPrune&) = delete;
+    
+    int createProxy(const AABB& aabb, void* data, const Filter& filter = Filter());
+    
+    /// grown by the displacement, like the fat boxes in DynamicTree
+    inline bool moveProxy(int proxyId, const AABB& aabb, const vec2& displacement) {
+        assert(proxies[proxyId].next == used_proxy);
+        vec2 d = aabb_multipiler * vec2(fabs(displacement.x), fabs(displacement.y));
+        proxies[proxyId].aabb = AABB(aabb.lowerBound - d, aabb.upperBound + d);
+        dirty = true;
+        return true;
+    }
+    
+    void destoryProxy(int proxyId);
+    
+    /// insertion sort of the endpoints
+    void sort();
+    
+    inline void update() {
+        if(dirty || removed) sort();
+    }
+    
+    inline int getProxyCount() const {
+        return count;
+    }
+    
+    /// the box grown by the last displacement
+    inline const AABB& getFatAABB(int proxyId) const {
+        assert(proxies[proxyId].next == used_proxy);
+        return proxies[proxyId].aabb;
+    }
+    
+    inline void setProxyData(int proxyId, void* data) {
+        assert(proxies[proxyId].next == used_proxy);
+        proxies[proxyId].data = data;
+    }
+    
+    template <class T>
+    void query(T* callback, const AABB& aabb) {
+        update();
+        query(callback, aabb, NULL);
+    }
+    
+    /// the sweep needs no stack, the argument only matches DynamicTree
+    /// read-only, the proxies must be sorted
+    /// proxies that should not collide with `filter` are skipped, if it isn't NULL
+    template <class T>
+    void query(T* callback, const AABB& aabb, std::vector<int>* stack, const Filter* filter = NULL) const;
+    
+    void query(std::vector<Contact>* list);
+    
+    void query(std::vector<Contact>* list, ThreadPool* pool);
+    
+};
+
+template <class T>
+void SweepAndPrune::query(T* callback, const AABB& aabb, std::vector<int>* /* stack */, const Filter* filter) const {
+    assert(!dirty && !removed);
+    
+    /// first proxy that can reach the query
+    int i = (int)(std::lower_bound(lowers.begin(), lowers.end(), aabb.lowerBound.x - maxWidth) - lowers.begin());
+    
+    for(; i != count && lowers[i] <= aabb.upperBound.x; ++i) {
+        const SweepProxy& proxy = proxies[order[i]];
+        
+        if(touches(aabb, proxy.aabb) && (filter == NULL || should_collide(*filter, proxy.filter))) {
+            if(!callback->callback(proxy.data))
+                return;
+        }
+    }
+}
+
+#endif /* SweepAndPrune_hpp */
@@ -0,0 +1,211 @@
+//
+//  TiledBroadphase.cpp
+//  Evolution
+//
+
+#include "TiledBroadphase.hpp"
+
+TiledBroadphase::TiledBroadphase(const AABB& bounds, float tileSize) : next(null_proxy), count(0), bounds(bounds) {
+    vec2 size = bounds.upperBound - bounds.lowerBound;
+    
+    /// tiles are never smaller than `tileSize`
+    cols = std::max(1, (int)(size.x / tileSize));
+    rows = std::max(1, (int)(size.y / tileSize));
+    
+    tileWidth = size.x / cols;
+    tileHeight = size.y / rows;
+    
+    tiles = new Tile[cols * rows];
+}
+
+TiledBroadphase::~TiledBroadphase() {
+    delete[] tiles;
+}
+
+int TiledBroadphase::createProxy(const AABB& aabb, void* data, const Filter& filter) {
+    int proxyId;
+    
+    if(next == null_proxy) {
+        proxyId = (int)proxies.size();
+        proxies.emplace_back();
+    }else{
+        proxyId = next;
+        next = proxies[next].next;
+    }
+    
+    TiledProxy& proxy = proxies[proxyId];
+    proxy.aabb = aabb;
+    proxy.data = data;
+    proxy.filter = filter;
+    proxy.displacement = vec2(0.0f, 0.0f);
+    proxy.next = used_proxy;
+    
+    /// in no tile until the next update
+    proxy.x0 = proxy.y0 = 0;
+    proxy.x1 = proxy.y1 = -1;
+    proxy.owner = tileOf(0.5f * (aabb.lowerBound + aabb.upperBound));
+    
+    proxy.moved = true;
+    dirty.push_back(proxyId);
+    
+    ++count;
+    
+    return proxyId;
+}
+
+void TiledBroadphase::destoryProxy(int proxyId) {
+    TiledProxy& proxy = proxies[proxyId];
+    assert(proxy.next == used_proxy);
+    
+    int width = proxy.x1 - proxy.x0 + 1;
+    
+    for(int y = proxy.y0; y <= proxy.y1; ++y) {
+        for(int x = proxy.x0; x <= proxy.x1; ++x)
+            tiles[y * cols + x].removes.push_back(proxy.leaves[(y - proxy.y0) * width + x - proxy.x0]);
+    }
+    
+    /// an entry left in `dirty` is skipped, unless the proxy is made again
+    proxy.moved = false;
+    proxy.next = next;
+    next = proxyId;
+    
+    --count;
+}
+
+void TiledBroadphase::update(ThreadPool* pool) {
+    for(int proxyId : dirty) {
+        TiledProxy& proxy = proxies[proxyId];
+        
+        if(proxy.next != used_proxy || !proxy.moved)
+            continue;
+        
+        proxy.moved = false;
+        
+        int x0 = tileX(proxy.aabb.lowerBound.x);
+        int y0 = tileY(proxy.aabb.lowerBound.y);
+        int x1 = tileX(proxy.aabb.upperBound.x);
+        int y1 = tileY(proxy.aabb.upperBound.y);
+        
+        int width = x1 - x0 + 1;
+        int oldWidth = proxy.x1 - proxy.x0 + 1;
+        
+        assert(width * (y1 - y0 + 1) <= max_proxy_tiles);
+        
+        int leaves[max_proxy_tiles];
+        
+        /// tiles it left
+        for(int y = proxy.y0; y <= proxy.y1; ++y) {
+            for(int x = proxy.x0; x <= proxy.x1; ++x) {
+                int leaf = proxy.leaves[(y - proxy.y0) * oldWidth + x - proxy.x0];
+                
+                if(x < x0 || x > x1 || y < y0 || y > y1) {
+                    tiles[y * cols + x].removes.push_back(leaf);
+                }else{
+                    leaves[(y - y0) * width + x - x0] = leaf;
+                }
+            }
+        }
+        
+        /// tiles it stayed in or entered
+        for(int y = y0; y <= y1; ++y) {
+            for(int x = x0; x <= x1; ++x) {
+                int slot = (y - y0) * width + x - x0;
+                
+                if(x < proxy.x0 || x > proxy.x1 || y < proxy.y0 || y > proxy.y1) {
+                    tiles[y * cols + x].inserts.push_back(std::make_pair(proxyId, slot));
+                }else{
+                    tiles[y * cols + x].moves.push_back(std::make_pair(proxyId, slot));
+                }
+            }
+        }
+        
+        for(int i = 0; i != max_proxy_tiles; ++i)
+            proxy.leaves[i] = leaves[i];
+        
+        proxy.x0 = x0;
+        proxy.y0 = y0;
+        proxy.x1 = x1;
+        proxy.y1 = y1;
+        proxy.owner = tileOf(0.5f * (proxy.aabb.lowerBound + proxy.aabb.upperBound));
+    }
+    
+    dirty.clear();
+    
+    int n = getTileCount();
+    
+    if(pool == NULL) {
+        apply(0, n);
+    }else{
+        pool->parallel_for(n, [this] (int begin, int end, int /* worker */) {
+            apply(begin, end);
+        });
+    }
+}
+
+void TiledBroadphase::apply(int begin, int end) {
+    for(int i = begin; i != end; ++i) {
+        Tile& tile = tiles[i];
+        
+        for(int leaf : tile.removes)
+            tile.tree.destoryProxy(leaf);
+        
+        /// slots of a proxy belong to one tile each, so no two workers write the same one
+        for(const std::pair<int, int>& insert : tile.inserts) {
+            TiledProxy& proxy = proxies[insert.first];
+            proxy.leaves[insert.second] = tile.tree.createProxy(proxy.aabb, (void*)(intptr_t)insert.first, proxy.filter);
+        }
+        
+        for(const std::pair<int, int>& move : tile.moves) {
+            TiledProxy& proxy = proxies[move.first];
+            tile.tree.moveProxy(proxy.leaves[move.second], proxy.aabb, proxy.displacement);
+        }
+        
+        tile.removes.clear();
+        tile.inserts.clear();
+        tile.moves.clear();
+    }
+}
+
+void TiledBroadphase::queryTiles(int begin, int end) {
+    for(int i = begin; i != end; ++i) {
+        Tile& tile = tiles[i];
+        
+        tile.raw.clear();
+        tile.contacts.clear();
+        
+        tile.tree.query(&tile.raw);
+        
+        for(const Contact& c : tile.raw) {
+            const TiledProxy& A = proxies[(int)(intptr_t)c.obj1];
+            const TiledProxy& B = proxies[(int)(intptr_t)c.obj2];
+            
+            /// the trees pair grown boxes, only boxes that touch make it here
+            if(!touches(A.aabb, B.aabb) || reporter(A.aabb, B.aabb) != i)
+                continue;
+            
+            /// same orientation as Collector
+            Contact contact;
+            bool less = proxy_less(key, A.data, B.data);
+            contact.obj1 = less ? A.data : B.data;
+            contact.obj2 = less ? B.data : A.data;
+            tile.contacts.push_back(contact);
+        }
+    }
+}
+
+void TiledBroadphase::query(std::vector<Contact>* list, ThreadPool* pool) {
+    update(pool);
+    
+    int n = getTileCount();
+    
+    if(pool == NULL) {
+        queryTiles(0, n);
+    }else{
+        pool->parallel_for(n, [this] (int begin, int end, int /* worker */) {
+            queryTiles(begin, end);
+        });
+    }
+    
+    for(int i = 0; i != n; ++i)
+        list->insert(list->end(), tiles[i].contacts.begin(), tiles[i].contacts.end());
+}
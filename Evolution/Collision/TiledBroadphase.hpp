@@ -0,0 +1,249 @@
+//
+//  TiledBroadphase.hpp
+//  Evolution
+//
+
+#ifndef TiledBroadphase_hpp
+#define TiledBroadphase_hpp
+
+#include "DynamicTree.hpp"
+
+/// a box no wider than a tile reaches at most 2 by 2 tiles
+#define max_proxy_tiles 4
+
+struct TiledProxy
+{
+    /// the box given by the user, not grown
+    AABB aabb;
+    
+    /// data to identify proxies for users
+    void* data;
+    
+    Filter filter;
+    
+    /// tiles the box reached at the last update, x0 ... x1 by y0 ... y1
+    int x0, y0, x1, y1;
+    
+    /// leaf of the proxy in each of those tiles, row by row
+    int leaves[max_proxy_tiles];
+    
+    vec2 displacement;
+    
+    /// tile of the center of the box, at the last update
+    int owner;
+    
+    /// next free proxy, or `used_proxy` if the proxy is in use
+    int next;
+    
+    /// waiting in `dirty`
+    bool moved;
+};
+
+/**
+ ** The bounds split into tiles, each with its own tree.
+ ** A proxy is owned by the tile of its center, and mirrored as a ghost into every other
+ ** tile its box reaches. Tiles are updated and queried in parallel, one worker each.
+ **
+ ** Moves are only written down, `update` works out which proxies left or entered a tile
+ ** and lets every tile change its own tree.
+ **
+ ** A pair shows up in every tile both boxes reach, only the tile of the lower corner
+ ** of the overlap reports it. Region queries dedupe the same way.
+ **/
+
+class TiledBroadphase
+{
+    
+    struct Tile
+    {
+        DynamicTree tree;
+        
+        /// what `update` does to the tree, in this order
+        std::vector<int> removes;
+        std::vector<std::pair<int, int>> inserts;
+        std::vector<std::pair<int, int>> moves;
+        
+        /// pairs of the tree, and the ones this tile reports
+        std::vector<Contact> raw;
+        std::vector<Contact> contacts;
+    };
+    
+    std::vector<TiledProxy> proxies;
+    
+    /// free list
+    int next;
+    
+    /// proxies in use
+    int count;
+    
+    /// created or moved since the last update
+    std::vector<int> dirty;
+    
+    AABB bounds;
+    
+    int cols;
+    int rows;
+    
+    float tileWidth;
+    float tileHeight;
+    
+    Tile* tiles;
+    
+    inline int tileX(float x) const {
+        int i = (int)((x - bounds.lowerBound.x) / tileWidth);
+        return i < 0 ? 0 : (i >= cols ? cols - 1 : i);
+    }
+    
+    inline int tileY(float y) const {
+        int j = (int)((y - bounds.lowerBound.y) / tileHeight);
+        return j < 0 ? 0 : (j >= rows ? rows - 1 : j);
+    }
+    
+    inline int tileOf(const vec2& p) const {
+        return tileY(p.y) * cols + tileX(p.x);
+    }
+    
+    /// the tile that reports a pair of `a` and `b`, which must touch
+    inline int reporter(const AABB& a, const AABB& b) const {
+        return tileOf(max(a.lowerBound, b.lowerBound));
+    }
+    
+    /// changes the trees of tiles [begin, end)
+    void apply(int begin, int end);
+    
+    /// pairs of tiles [begin, end)
+    void queryTiles(int begin, int end);
+    
+    template <class T>
+    struct Forward
+    {
+        const TiledBroadphase* owner;
+        
+        T* target;
+        
+        AABB aabb;
+        
+        int tile;
+        
+        bool stopped;
+        
+        bool callback(void* data) {
+            const TiledProxy& proxy = owner->proxies[(int)(intptr_t)data];
+            
+            if(!touches(aabb, proxy.aabb) || owner->reporter(aabb, proxy.aabb) != tile)
+                return true;
+            
+            stopped = !target->callback(proxy.data);
+            return !stopped;
+        }
+    };
+    
+public:
+    
+    /// orders the data of a pair, see ProxyKey
+    ProxyKey key = NULL;
+    
+    static const int null_proxy = -1;
+    
+    static const int used_proxy = -2;
+    
+    TiledBroadphase(const AABB& bounds, float tileSize);
+    
+    ~TiledBroadphase();
+    
+    TiledBroadphase(const TiledBroadphase&) = delete;
+    
+    TiledBroadphase& operator = (const TiledBroadphase&) = delete;
+    
+    int createProxy(const AABB& aabb, void* data, const Filter& filter = Filter());
+    
+    inline bool moveProxy(int proxyId, const AABB& aabb, const vec2& displacement) {
+        TiledProxy& proxy = proxies[proxyId];
+        assert(proxy.next == used_proxy);
+        
+        proxy.aabb = aabb;
+        proxy.displacement = displacement;
+        
+        if(!proxy.moved) {
+            proxy.moved = true;
+            dirty.push_back(proxyId);
+        }
+        
+        return true;
+    }
+    
+    void destoryProxy(int proxyId);
+    
+    /// moves the proxies between the tiles, each tile is changed by one worker of `pool`
+    /// runs on the calling thread if `pool` is NULL
+    void update(ThreadPool* pool = NULL);
+    
+    inline int getProxyCount() const {
+        return count;
+    }
+    
+    inline int getTileCount() const {
+        return cols * rows;
+    }
+    
+    /// tile of the center of the proxy
+    inline int getOwner(int proxyId) const {
+        return proxies[proxyId].owner;
+    }
+    
+    inline const AABB& getFatAABB(int proxyId) const {
+        assert(proxies[proxyId].next == used_proxy);
+        return proxies[proxyId].aabb;
+    }
+    
+    inline void setProxyData(int proxyId, void* data) {
+        assert(proxies[proxyId].next == used_proxy);
+        proxies[proxyId].data = data;
+    }
+    
+    template <class T>
+    void query(T* callback, const AABB& aabb) {
+        update();
+        std::vector<int> stack;
+        query(callback, aabb, &stack);
+    }
+    
+    /// read-only, the tiles must be up to date
+    /// reports proxies whose own box touches `aabb`, each once
+    /// proxies that should not collide with `filter` are skipped, if it isn't NULL
+    template <class T>
+    void query(T* callback, const AABB& aabb, std::vector<int>* stack, const Filter* filter = NULL) const;
+    
+    /// pairs whose own boxes touch, in tile order
+    /// the result does not depend on the number of workers
+    void query(std::vector<Contact>* list, ThreadPool* pool = NULL);
+    
+};
+
+template <class T>
+void TiledBroadphase::query(T* callback, const AABB& aabb, std::vector<int>* stack, const Filter* filter) const {
+    assert(dirty.empty());
+    
+    Forward<T> forward;
+    forward.owner = this;
+    forward.target = callback;
+    forward.aabb = aabb;
+    forward.stopped = false;
+    
+    int x0 = tileX(aabb.lowerBound.x);
+    int y0 = tileY(aabb.lowerBound.y);
+    int x1 = tileX(aabb.upperBound.x);
+    int y1 = tileY(aabb.upperBound.y);
+    
+    for(int y = y0; y <= y1; ++y) {
+        for(int x = x0; x <= x1; ++x) {
+            forward.tile = y * cols + x;
+            tiles[forward.tile].tree.query(&forward, aabb, stack, filter);
+            
+            if(forward.stopped)
+                return;
+        }
+    }
+}
+
+#endif /* TiledBroadphase_hpp */
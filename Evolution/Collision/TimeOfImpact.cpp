@@ -0,0 +1,63 @@
+//
+//  TimeOfImpact.cpp
+//  Evolution
+//
+
+#include "TimeOfImpact.hpp"
+
+static inline float clampf(float x, float a, float b) {
+    return std::min(std::max(x, a), b);
+}
+
+/// same closest points as collide_capsules
+float segment_distance(const vec2& pA, const vec2& uA, float hA, const vec2& pB, const vec2& uB, float hB) {
+    vec2 d = pB - pA;
+    
+    float c = dot(uA, uB);
+    float dA = dot(uA, d);
+    float dB = dot(uB, d);
+    float denom = 1.0f - c * c;
+    
+    float s = denom > FLT_EPSILON ? clampf((dA - c * dB) / denom, -hA, hA) : 0.0f;
+    float t = s * c - dB;
+    
+    if(t < -hB || t > hB) {
+        t = clampf(t, -hB, hB);
+        s = clampf(t * c + dA, -hA, hA);
+    }
+    
+    return (pA + s * uA - pB - t * uB).length();
+}
+
+static inline float distance_at(const Sweep& A, const Sweep& B, float t) {
+    return segment_distance(A.positionAt(t), A.normalAt(t).I(), A.h, B.positionAt(t), B.normalAt(t).I(), B.h);
+}
+
+float time_of_impact(const Sweep& A, const Sweep& B, float tMax) {
+    float target = A.radius + B.radius;
+    float slop = toi_slop * target;
+    
+    float bound = (A.velocity - B.velocity).length() + fabs(A.angularVelocity) * A.h + fabs(B.angularVelocity) * B.h;
+    
+    float gap = distance_at(A, B, 0.0f) - target;
+    
+    if(gap <= slop || bound * tMax <= gap)
+        return tMax;
+    
+    float t = 0.0f;
+    
+    for(int i = 0; i != toi_iterations; ++i) {
+        t += gap / bound;
+        
+        if(t >= tMax)
+            return tMax;
+        
+        gap = distance_at(A, B, t) - target;
+        
+        if(gap <= slop)
+            return t;
+    }
+    
+    /// still closing in, the shapes are about to touch
+    return t;
+}
@@ -0,0 +1,57 @@
+//
+//  TimeOfImpact.hpp
+//  Evolution
+//
+
+#ifndef TimeOfImpact_hpp
+#define TimeOfImpact_hpp
+
+#include "Collision.h"
+
+/// two shapes closer than this over the sum of their radii count as touching
+#define toi_slop 0.01f
+
+/// most steps of the conservative advancement
+#define toi_iterations 32
+
+/// a circle or a capsule moving with a constant velocity and spin over a step
+/// a capsule is a segment of half length `h` centered at `position`, along normal.I(), grown by `radius`
+/// a circle is a capsule with `h` 0
+struct Sweep
+{
+    /// at the start of the step
+    vec2 position;
+    vec2 normal;
+    
+    vec2 velocity;
+    float angularVelocity;
+    
+    float h;
+    float radius;
+    
+    inline vec2 positionAt(float t) const {
+        return position + t * velocity;
+    }
+    
+    inline vec2 normalAt(float t) const {
+        float a = t * angularVelocity;
+        return normal * vec2(cosf(a), sinf(a));
+    }
+};
+
+/// distance between the segments of two capsules, along the unit axes `uA` and `uB`
+float segment_distance(const vec2& pA, const vec2& uA, float hA, const vec2& pB, const vec2& uB, float hB);
+
+/**
+ ** Conservative advancement, like Box2D's time of impact but for circles and capsules only.
+ ** No point of a segment moves faster than its velocity plus its spin times `h`, so the
+ ** gap can't close faster than the sum of those. Each step moves both shapes by the time
+ ** that bound needs to close the gap, which can never step past the first touch.
+ **
+ ** Returns the first time in [0, tMax) the shapes touch, or tMax if they don't.
+ ** Shapes that touch at the start are left to the solver and return tMax.
+ **/
+
+float time_of_impact(const Sweep& A, const Sweep& B, float tMax);
+
+#endif /* TimeOfImpact_hpp */
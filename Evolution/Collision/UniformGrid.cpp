@@ -0,0 +1,124 @@
+//
+//  UniformGrid.cpp
+//  Evolution
+//
+
+#include "UniformGrid.hpp"
+
+UniformGrid::UniformGrid(const AABB& bounds, float cellSize) : next(null_proxy), count(0), bounds(bounds), cellSize(cellSize), invCellSize(1.0f / cellSize), maxExtent(0.0f, 0.0f), dirty(false) {
+    cols = std::max(1, (int)ceilf((bounds.upperBound.x - bounds.lowerBound.x) * invCellSize));
+    rows = std::max(1, (int)ceilf((bounds.upperBound.y - bounds.lowerBound.y) * invCellSize));
+    
+    cellStart.assign(cols * rows + 1, 0);
+}
+
+int UniformGrid::createProxy(const AABB& aabb, void* data, const Filter& filter) {
+    int proxyId;
+    
+    if(next == null_proxy) {
+        proxyId = (int)proxies.size();
+        proxies.emplace_back();
+        proxyCell.push_back(-1);
+    }else{
+        proxyId = next;
+        next = proxies[next].next;
+    }
+    
+    proxies[proxyId].aabb = aabb;
+    proxies[proxyId].data = data;
+    proxies[proxyId].filter = filter;
+    proxies[proxyId].next = used_proxy;
+    
+    ++count;
+    dirty = true;
+    
+    return proxyId;
+}
+
+void UniformGrid::destoryProxy(int proxyId) {
+    assert(proxies[proxyId].next == used_proxy);
+    
+    proxies[proxyId].next = next;
+    proxyCell[proxyId] = -1;
+    next = proxyId;
+    
+    --count;
+    dirty = true;
+}
+
+void UniformGrid::rebuild() {
+    int size = (int)proxies.size();
+    int cells = cols * rows;
+    
+    std::fill(cellStart.begin(), cellStart.end(), 0);
+    
+    maxExtent = vec2(0.0f, 0.0f);
+    
+    /// count
+    for(int i = 0; i != size; ++i) {
+        const GridProxy& proxy = proxies[i];
+        
+        if(proxy.next != used_proxy) {
+            proxyCell[i] = -1;
+            continue;
+        }
+        
+        vec2 ext = 0.5f * (proxy.aabb.upperBound - proxy.aabb.lowerBound);
+        vec2 center = proxy.aabb.lowerBound + ext;
+        
+        maxExtent = max(maxExtent, ext);
+        
+        int cell = cellY(center.y) * cols + cellX(center.x);
+        proxyCell[i] = cell;
+        ++cellStart[cell + 1];
+    }
+    
+    /// prefix sum
+    for(int c = 0; c != cells; ++c)
+        cellStart[c + 1] += cellStart[c];
+    
+    /// scatter, in proxy order within each cell
+    cellProxies.resize(count);
+    
+    std::vector<int> offsets(cellStart.begin(), cellStart.end() - 1);
+    for(int i = 0; i != size; ++i) {
+        if(proxyCell[i] != -1)
+            cellProxies[offsets[proxyCell[i]]++] = i;
+    }
+    
+    dirty = false;
+}
+
+void UniformGrid::queryPairs(int begin, int end, std::vector<Contact>* list) const {
+    Collector collector;
+    collector.contacts = list;
+    collector.key = key;
+    
+    for(int i = begin; i != end; ++i) {
+        const GridProxy& proxy = proxies[cellProxies[i]];
+        collector.current = proxy.data;
+        query(&collector, proxy.aabb, NULL, &proxy.filter);
+    }
+}
+
+void UniformGrid::query(std::vector<Contact>* list) {
+    update();
+    queryPairs(0, count, list);
+}
+
+void UniformGrid::query(std::vector<Contact>* list, ThreadPool* pool) {
+    update();
+    
+    buffers.resize(pool->size());
+    
+    pool->parallel_for(count, [this] (int begin, int end, int worker) {
+        buffers[worker].clear();
+        queryPairs(begin, end, &buffers[worker]);
+    });
+    
+    /// chunks follow the cell order, so the result does not depend on the worker count
+    for(std::vector<Contact>& buffer : buffers) {
+        list->insert(list->end(), buffer.begin(), buffer.end());
+        buffer.clear();
+    }
+}
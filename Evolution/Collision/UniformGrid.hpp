@@ -0,0 +1,176 @@
+//
+//  UniformGrid.hpp
+//  Evolution
+//
+
+#ifndef UniformGrid_hpp
+#define UniformGrid_hpp
+
+#include "Collision.h"
+#include "ThreadPool.h"
+
+#include <cassert>
+
+struct GridProxy
+{
+    AABB aabb;
+    
+    /// data to identify proxies for users
+    void* data;
+    
+    Filter filter;
+    
+    /// next free proxy, or `used_proxy` if the proxy is in use
+    int next;
+};
+
+/**
+ ** A fixed grid over the bounds of the world.
+ ** Works best when every proxy is about the same size and no larger than a cell.
+ **
+ ** Proxies go into the cell of their center. The cells are rebuilt with a counting
+ ** sort every step, so proxies of the same cell sit next to each other in `cellProxies`.
+ **/
+
+class UniformGrid
+{
+    
+    std::vector<GridProxy> proxies;
+    
+    /// free list
+    int next;
+    
+    /// proxies in use
+    int count;
+    
+    AABB bounds;
+    
+    float cellSize;
+    float invCellSize;
+    
+    int cols;
+    int rows;
+    
+    /// proxies of cell i are cellProxies[cellStart[i]] ... cellProxies[cellStart[i + 1] - 1]
+    std::vector<int> cellStart;
+    std::vector<int> cellProxies;
+    
+    /// cell of each proxy, -1 for free proxies
+    std::vector<int> proxyCell;
+    
+    /// largest half size of a proxy, queries are grown by this much
+    vec2 maxExtent;
+    
+    /// moved since the last rebuild
+    bool dirty;
+    
+    /// scratch space of each worker for parallel queries
+    std::vector<std::vector<Contact>> buffers;
+    
+    inline int cellX(float x) const {
+        int i = (int)((x - bounds.lowerBound.x) * invCellSize);
+        return i < 0 ? 0 : (i >= cols ? cols - 1 : i);
+    }
+    
+    inline int cellY(float y) const {
+        int j = (int)((y - bounds.lowerBound.y) * invCellSize);
+        return j < 0 ? 0 : (j >= rows ? rows - 1 : j);
+    }
+    
+    void queryPairs(int begin, int end, std::vector<Contact>* list) const;
+    
+public:
+    
+    /// orders the data of a pair, see ProxyKey
+    ProxyKey key = NULL;
+    
+    static const int null_proxy = -1;
+    
+    static const int used_proxy = -2;
+    
+    UniformGrid(const AABB& bounds, float cellSize);
+    
+    UniformGrid(const UniformGrid&) = delete;
+    
+    UniformGrid& operator = (const UniformGrid&) = delete;
+    
+    int createProxy(const AABB& aabb, void* data, const Filter& filter = Filter());
+    
+    /// the proxy always takes the new box, grown by the displacement like in DynamicTree
+    /// so queries made before the next move still see where the proxy is going
+    inline bool moveProxy(int proxyId, const AABB& aabb, const vec2& displacement) {
+        assert(proxies[proxyId].next == used_proxy);
+        vec2 d = aabb_multipiler * vec2(fabs(displacement.x), fabs(displacement.y));
+        proxies[proxyId].aabb = AABB(aabb.lowerBound - d, aabb.upperBound + d);
+        dirty = true;
+        return true;
+    }
+    
+    void destoryProxy(int proxyId);
+    
+    /// counting sort of the proxies into the cells
+    void rebuild();
+    
+    inline void update() {
+        if(dirty) rebuild();
+    }
+    
+    inline int getProxyCount() const {
+        return count;
+    }
+    
+    /// the box grown by the last displacement
+    inline const AABB& getFatAABB(int proxyId) const {
+        assert(proxies[proxyId].next == used_proxy);
+        return proxies[proxyId].aabb;
+    }
+    
+    inline void setProxyData(int proxyId, void* data) {
+        assert(proxies[proxyId].next == used_proxy);
+        proxies[proxyId].data = data;
+    }
+    
+    template <class T>
+    void query(T* callback, const AABB& aabb) {
+        update();
+        query(callback, aabb, NULL);
+    }
+    
+    /// the grid needs no stack, the argument only matches DynamicTree
+    /// read-only, the grid must be up to date
+    /// proxies that should not collide with `filter` are skipped, if it isn't NULL
+    template <class T>
+    void query(T* callback, const AABB& aabb, std::vector<int>* stack, const Filter* filter = NULL) const;
+    
+    void query(std::vector<Contact>* list);
+    
+    void query(std::vector<Contact>* list, ThreadPool* pool);
+    
+};
+
+template <class T>
+void UniformGrid::query(T* callback, const AABB& aabb, std::vector<int>* /* stack */, const Filter* filter) const {
+    assert(!dirty);
+    
+    int x0 = cellX(aabb.lowerBound.x - maxExtent.x);
+    int y0 = cellY(aabb.lowerBound.y - maxExtent.y);
+    int x1 = cellX(aabb.upperBound.x + maxExtent.x);
+    int y1 = cellY(aabb.upperBound.y + maxExtent.y);
+    
+    for(int y = y0; y <= y1; ++y) {
+        /// cells of a row are contiguous
+        int begin = cellStart[y * cols + x0];
+        int end = cellStart[y * cols + x1 + 1];
+        
+        for(int i = begin; i != end; ++i) {
+            const GridProxy& proxy = proxies[cellProxies[i]];
+            
+            if(touches(aabb, proxy.aabb) && (filter == NULL || should_collide(*filter, proxy.filter))) {
+                if(!callback->callback(proxy.data))
+                    return;
+            }
+        }
+    }
+}
+
+#endif /* UniformGrid_hpp */
@@ -0,0 +1,124 @@
+//
+//  ContactCache.h
+//  Evolution
+//
+
+#ifndef ContactCache_h
+#define ContactCache_h
+
+#include "Collision.h"
+#include "Obj.h"
+#include <unordered_map>
+
+/// at most 2 features per pair (sticks side by side)
+#define max_contact_features 2
+
+/// impulses of a pair of objects that touched in the previous substep
+struct ContactImpulse
+{
+    uint64_t key;
+    
+    /// last substep this pair was reported by the broadphase
+    int stamp;
+    
+    /// one impulse per feature (contact point), the total the solver pushed with
+    float impulses[max_contact_features];
+    
+    /// where it pushed, the point relative to the first object of the pair
+    vec2 normals[max_contact_features];
+    vec2 offsets[max_contact_features];
+};
+
+/**
+ ** Remembers the impulses of each pair between substeps.
+ ** Pairs are keyed by the ids of the two objects, so the key does not change when
+ ** the broadphase reports the pair in a different order.
+ **/
+
+class ContactCache
+{
+    
+    std::unordered_map<uint64_t, int> map;
+    
+    std::vector<ContactImpulse> entries;
+    
+    /// free list of entries
+    std::vector<int> unused;
+    
+    int stamp;
+    
+public:
+    
+    ContactCache() : stamp(0) {}
+    
+    static inline uint64_t pair_key(uint id1, uint id2) {
+        if(id1 > id2) std::swap(id1, id2);
+        return ((uint64_t)id1 << 32) | (uint64_t)id2;
+    }
+    
+    /// finds or creates an entry for each contact, `slots` is aligned with `contacts`
+    /// pairs that are no longer reported are dropped
+    void update(const std::vector<Contact>& contacts, std::vector<int>* slots) {
+        ++stamp;
+        
+        slots->resize(contacts.size());
+        
+        for(size_t i = 0; i != contacts.size(); ++i) {
+            const Obj* obj1 = (const Obj*)contacts[i].obj1;
+            const Obj* obj2 = (const Obj*)contacts[i].obj2;
+            
+            uint64_t key = pair_key(obj1->id, obj2->id);
+            
+            auto it = map.find(key);
+            
+            int slot;
+            
+            if(it == map.end()) {
+                if(unused.empty()) {
+                    slot = (int)entries.size();
+                    entries.emplace_back();
+                }else{
+                    slot = unused.back();
+                    unused.pop_back();
+                }
+                
+                ContactImpulse& entry = entries[slot];
+                entry.key = key;
+                std::fill(entry.impulses, entry.impulses + max_contact_features, 0.0f);
+                
+                map.emplace(key, slot);
+            }else{
+                slot = it->second;
+            }
+            
+            entries[slot].stamp = stamp;
+            (*slots)[i] = slot;
+        }
+        
+        auto it = map.begin();
+        while(it != map.end()) {
+            if(entries[it->second].stamp != stamp) {
+                unused.push_back(it->second);
+                it = map.erase(it);
+            }else{
+                ++it;
+            }
+        }
+    }
+    
+    inline ContactImpulse& operator [] (int slot) {
+        return entries[slot];
+    }
+    
+    inline void clear() {
+        map.clear();
+        entries.clear();
+        unused.clear();
+    }
+    
+    inline size_t size() const {
+        return map.size();
+    }
+};
+
+#endif /* ContactCache_h */
@@ -17,6 +17,7 @@ BodyDef::BodyDef() {
     stick.length = 4.0f;
     stick.position = vec2(radius + 2.0f * stick.radius, 0.0f);
     stick.velocity = vec2(0.0f, 0.0f);
+    stick.updateMass();
     
     maxHealth = 100.0f;
     
@@ -55,12 +56,30 @@ Body::Body(const BodyDef* def) {
     type = e_body;
     density = def->density;
     
+    updateMass();
+    stick.updateMass();
+    
     maxForce = def->maxForce;
     maxStickForce = def->maxStickForce;
         
     armLength = def->armLength;
+    
+    filter = def->filter;
+    stick.filter = def->filter;
         
     target = NULL;
+    
+    awake = true;
+    stillSteps = 0;
+    touched = false;
+    collecting = false;
+    pinned = false;
+    
+    cache.valid = false;
+    cache.last = position;
+    
+    isolatedSteps = 0;
+    anchor = position;
 }
 
 void Body::setInputs(Neuron *in) const {
@@ -121,8 +140,8 @@ void Body::think(float dt) {
     this->stick.applyImpulse(position + local, dt * stick);
 }
 
-void Body::step(float dt) {
-    ::constrain(&velocity, max_translation_squared / (dt * dt));
+void Body::step(float dt, float maxTranslation) {
+    ::constrain(&velocity, maxTranslation * maxTranslation / (dt * dt));
     
     float arm = absArmLength();
     float c2 = arm * arm;
@@ -137,17 +156,51 @@ void Body::step(float dt) {
     stick.applyImpulse(position, ms * dt * body_arm_force * w * n);
     applyImpulse(position, -ms * dt * body_arm_force * w * n);
     
-    stick.step(dt);
+    stick.step(dt, maxTranslation);
+    
+    velocity *= powf(damping, dt);
+    position += dt * velocity;
+}
+
+void Body::predict(float dt, float maxTranslation) {
+    ::constrain(&velocity, maxTranslation * maxTranslation / (dt * dt));
+    
+    stick.step(dt, maxTranslation);
     
     velocity *= powf(damping, dt);
     position += dt * velocity;
 }
 
-void Body::applyImpulse(const vec2& world, const vec2& imp) {
-    float invMass = Obj::invMass();
-    vec2 d = (world - position).norm();
-    d = vec2(fabs(d.x), fabs(d.y));
-    vec2 accel = invMass * scl(d, imp);
-    velocity += accel;
-    health -= accel.length();
+/// how far something of speed 1 goes in `dt` while its speed is multiplied by `damping` every unit of time
+static inline float damped_distance(float damping, float dt) {
+    float k = logf(damping);
+    return fabs(k) > FLT_EPSILON ? (powf(damping, dt) - 1.0f) / k : dt;
+}
+
+void Body::drift(float dt, float maxTranslation) {
+    ::constrain(&velocity, maxTranslation * maxTranslation / (dt * dt));
+    ::constrain(&stick.velocity, maxTranslation * maxTranslation / (dt * dt));
+    
+    /// implicit Euler of the spring along the arm, with the stiffness of `armCompliance`
+    float arm = absArmLength();
+    
+    vec2 d = stick.position - position;
+    float m = d.length();
+    vec2 n = d / m;
+    
+    float k = 2.0f * body_arm_force * mass() / arm * stick.invMass();
+    float x = m - arm;
+    float v = dot(stick.velocity - velocity, n);
+    
+    stick.velocity -= (dt * k * (x + dt * v) / (1.0f + dt * dt * k)) * n;
+    
+    position += damped_distance(damping, dt) * velocity;
+    velocity *= powf(damping, dt);
+    
+    stick.position += damped_distance(stick.linearDamping, dt) * stick.velocity;
+    stick.velocity *= powf(stick.linearDamping, dt);
+    
+    float a = damped_distance(stick.angularDamping, dt) * stick.angularVelocity;
+    stick.normal = stick.normal * vec2(cosf(a), sinf(a));
+    stick.angularVelocity *= powf(stick.angularDamping, dt);
 }
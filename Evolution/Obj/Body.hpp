@@ -38,10 +38,36 @@ struct BodyDef
     float armLength;
     
     Colorf color;
+    
+    /// used by the body and its stick
+    /// a group of 0 is replaced by a group of their own, so they never collide with each other
+    Filter filter;
             
     BodyDef();
 };
 
+/// what the last sensing query of a body found, see World::targetCache
+struct TargetCache
+{
+    /// the body and its target when they were sensed
+    vec2 position;
+    vec2 targetPosition;
+    
+    /// distance to the target, or to the nearest body past the target radius if there was none
+    float distance;
+    
+    /// how far the bodies may move before the query could find something else
+    float gap;
+    
+    /// World::travel when they were sensed
+    float travel;
+    
+    /// position at the last step, to measure how far the bodies move
+    vec2 last;
+    
+    bool valid;
+};
+
 class Body : public Obj
 {
     
@@ -71,6 +97,30 @@ public:
     Stick stick;
     
     const Body* target;
+    
+    /// asleep bodies don't think, move or sense until the world wakes them
+    bool awake;
+    
+    /// steps in a row the body was still
+    int stillSteps;
+    
+    /// touched another body since the last step
+    bool touched;
+    
+    TargetCache cache;
+    
+    /// frames in a row with no other body near, see World::physicsLod
+    int isolatedSteps;
+    
+    /// where its proxies were last moved to while it drifted
+    vec2 anchor;
+    
+    /// in World::array while the world collects the pairs of a step, see World::PairCollector
+    bool collecting;
+    
+    /// held still while its neighbors step again in World::sweep, as if its mass were infinite
+    /// the solvers give it no impulse, no damage and no displacement
+    bool pinned;
 
     Body(const BodyDef* def);
     
@@ -92,9 +142,44 @@ public:
         return radius * (armLength + 1.0f);
     }
     
-    void step(float dt);
+    /// the body and its stick move at most `maxTranslation` in a step
+    void step(float dt, float maxTranslation = max_translation);
     
-    void applyImpulse(const vec2& world, const vec2& imp);
+    /// `step` without the spring of the arm, which the position solver keeps as a constraint
+    void predict(float dt, float maxTranslation = max_translation);
+    
+    /// a whole frame in one step, for a body with nothing near
+    /// velocities decay exactly as in `step`, the positions move by their integral, and
+    /// the spring of the arm is implicit, so it is stable for a `dt` of any length
+    void drift(float dt, float maxTranslation);
+    
+    /// inverse stiffness of the spring of `step` near its rest length
+    inline float armCompliance() const {
+        return absArmLength() / (2.0f * body_arm_force * mass());
+    }
+    
+    /// the change of velocity `imp` at `world` makes, which is also the damage it does
+    inline vec2 accelOf(const vec2& world, const vec2& imp) const {
+        vec2 d = (world - position).norm();
+        d = vec2(fabs(d.x), fabs(d.y));
+        return invMassValue * scl(d, imp);
+    }
+    
+    inline void applyImpulse(const vec2& world, const vec2& imp) {
+        vec2 accel = accelOf(world, imp);
+        velocity += accel;
+        health -= accel.length();
+    }
+    
+    /// applyImpulse without the damage, see World::warmStart
+    inline void push(const vec2& world, const vec2& imp) {
+        velocity += accelOf(world, imp);
+    }
+    
+    /// the damage of applyImpulse without the push
+    inline void hurt(const vec2& world, const vec2& imp) {
+        health -= accelOf(world, imp).length();
+    }
     
     inline AABB aabb() const {
         vec2 ext = vec2(radius, radius);
@@ -120,4 +205,34 @@ public:
     void setInputs(const AABB& aabb);
 };
 
+inline void Obj::applyImpulse(const vec2& world, const vec2& imp) {
+    if(type == e_body) {
+        ((Body*)this)->applyImpulse(world, imp);
+    }else{
+        ((Stick*)this)->applyImpulse(world, imp);
+    }
+}
+
+inline void Obj::push(const vec2& world, const vec2& imp) {
+    if(type == e_body) {
+        ((Body*)this)->push(world, imp);
+    }else{
+        ((Stick*)this)->applyImpulse(world, imp);
+    }
+}
+
+/// sticks take no damage
+inline void Obj::hurt(const vec2& world, const vec2& imp) {
+    if(type == e_body)
+        ((Body*)this)->hurt(world, imp);
+}
+
+inline AABB Obj::aabb() const {
+    return type == e_body ? ((const Body*)this)->aabb() : ((const Stick*)this)->aabb();
+}
+
+inline float Obj::area() const {
+    return type == e_body ? ((const Body*)this)->area() : ((const Stick*)this)->area();
+}
+
 #endif /* Body_hpp */
@@ -0,0 +1,99 @@
+//
+//  BodyPool.h
+//  Evolution
+//
+
+#ifndef BodyPool_h
+#define BodyPool_h
+
+#include "Body.hpp"
+
+/**
+ ** The bodies of a world, one after another in one block, so `World::reorder`
+ ** can put bodies near each other in space near each other in memory.
+ ** Once the block is full bodies go to the heap, and into the block at the next `permute`.
+ **/
+
+class BodyPool
+{
+    
+    /// room for `capacity` bodies
+    Body* block;
+    
+    uint capacity;
+    
+    /// places of `block` without a body, the last one is taken first
+    std::vector<uint> unused;
+    
+    inline uint placeOf(const Body* body) const {
+        return (uint)(((uintptr_t)body - (uintptr_t)block) / sizeof(Body));
+    }
+
+public:
+    
+    BodyPool(uint capacity) : block((Body*)Alloc(sizeof(Body) * std::max(capacity, 1u))), capacity(capacity) {
+        for(uint i = capacity; i != 0; --i)
+            unused.push_back(i - 1);
+    }
+    
+    BodyPool(const BodyPool&) = delete;
+    
+    BodyPool& operator = (const BodyPool&) = delete;
+    
+    /// the bodies must be freed first
+    ~BodyPool() {
+        Free(block);
+    }
+    
+    inline bool owns(const Body* body) const {
+        return (uintptr_t)body >= (uintptr_t)block && (uintptr_t)body < (uintptr_t)(block + capacity);
+    }
+    
+    Body* allocate(const BodyDef* def) {
+        if(unused.empty())
+            return new Body(def);
+        
+        Body* body = block + unused.back();
+        unused.pop_back();
+        
+        return new(body) Body(def);
+    }
+    
+    void free(Body* body) {
+        if(owns(body)) {
+            body->~Body();
+            unused.push_back(placeOf(body));
+        }else{
+            delete(body);
+        }
+    }
+    
+    /// moves the bodies of `order`, every body of the pool, to the front of a new block in that order
+    /// `order` then holds where they are now, anything pointing to the old places must be pointed to the new ones
+    void permute(std::vector<Body*>* order) {
+        Body* oldBlock = block;
+        block = (Body*)Alloc(sizeof(Body) * std::max(capacity, 1u));
+        
+        uint n = (uint)order->size();
+        
+        for(uint i = 0; i != n; ++i) {
+            Body* body = (*order)[i];
+            Body* copy = i < capacity ? new(block + i) Body(std::move(*body)) : new Body(std::move(*body));
+            
+            if((uintptr_t)body >= (uintptr_t)oldBlock && (uintptr_t)body < (uintptr_t)(oldBlock + capacity))
+                body->~Body();
+            else
+                delete(body);
+            
+            (*order)[i] = copy;
+        }
+        
+        Free(oldBlock);
+        
+        unused.clear();
+        for(uint i = capacity; i > n; --i)
+            unused.push_back(i - 1);
+    }
+};
+
+#endif /* BodyPool_h */
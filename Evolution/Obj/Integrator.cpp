@@ -0,0 +1,274 @@
+//
+//  Integrator.cpp
+//  Evolution
+//
+
+#include "Integrator.hpp"
+
+#include <cfloat>
+
+void Integrator::integrateScalar(int begin, int end) {
+    float V2 = maxTranslation * maxTranslation / (dt * dt);
+    float W2 = max_rotation_squared / (dt * dt);
+    
+    for(int i = begin; i != end; ++i) {
+        float v2 = vx[i] * vx[i] + vy[i] * vy[i];
+        if(v2 > V2) {
+            float s = sqrtf(V2/v2);
+            vx[i] *= s;
+            vy[i] *= s;
+        }
+        
+        /// the arm, pulls the stick back toward the body
+        float dx = spx[i] - px[i];
+        float dy = spy[i] - py[i];
+        
+        float m = dx * dx + dy * dy;
+        float l = sqrtf(m);
+        l = l < FLT_EPSILON ? FLT_EPSILON : l;
+        
+        float nx = dx / l;
+        float ny = dy / l;
+        
+        float w = 1.0f - m / arm2[i];
+        float c = mass[i] * dt * body_arm_force * w;
+        
+        float ix = c * nx;
+        float iy = c * ny;
+        
+        svx[i] += sInvMass[i] * (fabs(nx) * ix);
+        svy[i] += sInvMass[i] * (fabs(ny) * iy);
+        sw[i] -= sInvMass[i] * (ix * -ny + iy * nx);
+        
+        /// the stick
+        v2 = svx[i] * svx[i] + svy[i] * svy[i];
+        if(v2 > V2) {
+            float s = sqrtf(V2/v2);
+            svx[i] *= s;
+            svy[i] *= s;
+        }
+        
+        float a2 = sw[i] * sw[i];
+        if(a2 > W2) {
+            sw[i] *= sqrtf(W2/a2);
+        }
+        
+        sw[i] *= sAngular[i];
+        svx[i] *= sLinear[i];
+        svy[i] *= sLinear[i];
+        
+        float cs, sn;
+        small_rotation(dt * sw[i], &cs, &sn);
+        
+        float rx = snx[i] * cs - sny[i] * sn;
+        float ry = snx[i] * sn + sny[i] * cs;
+        float rl = sqrtf(rx * rx + ry * ry);
+        
+        snx[i] = rx / rl;
+        sny[i] = ry / rl;
+        
+        spx[i] += dt * svx[i];
+        spy[i] += dt * svy[i];
+        
+        /// the body
+        vx[i] *= damping[i];
+        vy[i] *= damping[i];
+        
+        px[i] += dt * vx[i];
+        py[i] += dt * vy[i];
+    }
+}
+
+#ifdef avx2_kernels
+
+/// |v|^2 > V2 ? v * sqrt(V2 / |v|^2) : v
+avx2_target static inline void constrain8(__m256* x, __m256* y, __m256 V2) {
+    __m256 v2 = _mm256_add_ps(_mm256_mul_ps(*x, *x), _mm256_mul_ps(*y, *y));
+    __m256 s = _mm256_sqrt_ps(_mm256_div_ps(V2, v2));
+    __m256 over = _mm256_cmp_ps(v2, V2, _CMP_GT_OQ);
+    *x = _mm256_blendv_ps(*x, _mm256_mul_ps(*x, s), over);
+    *y = _mm256_blendv_ps(*y, _mm256_mul_ps(*y, s), over);
+}
+
+avx2_target static inline __m256 poly8(__m256 a2, const float* k, int n) {
+    __m256 r = _mm256_set1_ps(k[n - 1]);
+    for(int j = n - 2; j >= 0; --j)
+        r = _mm256_add_ps(_mm256_set1_ps(k[j]), _mm256_mul_ps(a2, r));
+    return r;
+}
+
+avx2_target void Integrator::integrateVector(int begin, int end) {
+    static const float sinK[] = {1.0f, -1.0f/6.0f, 1.0f/120.0f, -1.0f/5040.0f, 1.0f/362880.0f, -1.0f/39916800.0f};
+    static const float cosK[] = {1.0f, -0.5f, 1.0f/24.0f, -1.0f/720.0f, 1.0f/40320.0f, -1.0f/3628800.0f, 1.0f/479001600.0f};
+    
+    __m256 t = _mm256_set1_ps(dt);
+    __m256 V2 = _mm256_set1_ps(maxTranslation * maxTranslation / (dt * dt));
+    __m256 W2 = _mm256_set1_ps(max_rotation_squared / (dt * dt));
+    __m256 force = _mm256_set1_ps(body_arm_force);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 eps = _mm256_set1_ps(FLT_EPSILON);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    
+    for(int i = begin; i != end; i += 8) {
+        __m256 bvx = _mm256_loadu_ps(&vx[i]);
+        __m256 bvy = _mm256_loadu_ps(&vy[i]);
+        __m256 bpx = _mm256_loadu_ps(&px[i]);
+        __m256 bpy = _mm256_loadu_ps(&py[i]);
+        
+        constrain8(&bvx, &bvy, V2);
+        
+        __m256 x = _mm256_loadu_ps(&spx[i]);
+        __m256 y = _mm256_loadu_ps(&spy[i]);
+        __m256 vxs = _mm256_loadu_ps(&svx[i]);
+        __m256 vys = _mm256_loadu_ps(&svy[i]);
+        __m256 w = _mm256_loadu_ps(&sw[i]);
+        __m256 inv = _mm256_loadu_ps(&sInvMass[i]);
+        
+        /// the arm
+        __m256 dx = _mm256_sub_ps(x, bpx);
+        __m256 dy = _mm256_sub_ps(y, bpy);
+        __m256 m = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 l = _mm256_max_ps(_mm256_sqrt_ps(m), eps);
+        __m256 nx = _mm256_div_ps(dx, l);
+        __m256 ny = _mm256_div_ps(dy, l);
+        
+        __m256 k = _mm256_sub_ps(one, _mm256_div_ps(m, _mm256_loadu_ps(&arm2[i])));
+        __m256 c = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(&mass[i]), t), force), k);
+        
+        __m256 ix = _mm256_mul_ps(c, nx);
+        __m256 iy = _mm256_mul_ps(c, ny);
+        
+        vxs = _mm256_add_ps(vxs, _mm256_mul_ps(inv, _mm256_mul_ps(_mm256_andnot_ps(sign, nx), ix)));
+        vys = _mm256_add_ps(vys, _mm256_mul_ps(inv, _mm256_mul_ps(_mm256_andnot_ps(sign, ny), iy)));
+        __m256 q = _mm256_add_ps(_mm256_mul_ps(ix, _mm256_xor_ps(ny, sign)), _mm256_mul_ps(iy, nx));
+        w = _mm256_sub_ps(w, _mm256_mul_ps(inv, q));
+        
+        /// the stick
+        constrain8(&vxs, &vys, V2);
+        
+        __m256 a2 = _mm256_mul_ps(w, w);
+        __m256 over = _mm256_cmp_ps(a2, W2, _CMP_GT_OQ);
+        w = _mm256_blendv_ps(w, _mm256_mul_ps(w, _mm256_sqrt_ps(_mm256_div_ps(W2, a2))), over);
+        
+        w = _mm256_mul_ps(w, _mm256_loadu_ps(&sAngular[i]));
+        __m256 linear = _mm256_loadu_ps(&sLinear[i]);
+        vxs = _mm256_mul_ps(vxs, linear);
+        vys = _mm256_mul_ps(vys, linear);
+        
+        __m256 a = _mm256_mul_ps(t, w);
+        a2 = _mm256_mul_ps(a, a);
+        __m256 sn = _mm256_mul_ps(a, poly8(a2, sinK, 6));
+        __m256 cs = poly8(a2, cosK, 7);
+        
+        __m256 ox = _mm256_loadu_ps(&snx[i]);
+        __m256 oy = _mm256_loadu_ps(&sny[i]);
+        __m256 rx = _mm256_sub_ps(_mm256_mul_ps(ox, cs), _mm256_mul_ps(oy, sn));
+        __m256 ry = _mm256_add_ps(_mm256_mul_ps(ox, sn), _mm256_mul_ps(oy, cs));
+        __m256 rl = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(rx, rx), _mm256_mul_ps(ry, ry)));
+        
+        _mm256_storeu_ps(&snx[i], _mm256_div_ps(rx, rl));
+        _mm256_storeu_ps(&sny[i], _mm256_div_ps(ry, rl));
+        
+        _mm256_storeu_ps(&spx[i], _mm256_add_ps(x, _mm256_mul_ps(t, vxs)));
+        _mm256_storeu_ps(&spy[i], _mm256_add_ps(y, _mm256_mul_ps(t, vys)));
+        _mm256_storeu_ps(&svx[i], vxs);
+        _mm256_storeu_ps(&svy[i], vys);
+        _mm256_storeu_ps(&sw[i], w);
+        
+        /// the body
+        __m256 d = _mm256_loadu_ps(&damping[i]);
+        bvx = _mm256_mul_ps(bvx, d);
+        bvy = _mm256_mul_ps(bvy, d);
+        
+        _mm256_storeu_ps(&px[i], _mm256_add_ps(bpx, _mm256_mul_ps(t, bvx)));
+        _mm256_storeu_ps(&py[i], _mm256_add_ps(bpy, _mm256_mul_ps(t, bvy)));
+        _mm256_storeu_ps(&vx[i], bvx);
+        _mm256_storeu_ps(&vy[i], bvy);
+    }
+}
+
+#else
+
+void Integrator::integrateVector(int begin, int end) {
+    integrateScalar(begin, end);
+}
+
+#endif
+
+void Integrator::integrate(ThreadPool* pool) {
+    int blocks = size() / 8;
+    
+    /// the work of a body is small, so each worker takes whole blocks
+    bool vector = vectorKernels && cpu_has_avx2();
+    
+    pool->parallel_for(blocks, [this, vector] (int begin, int end, int /* worker */) {
+        if(vector)
+            integrateVector(8 * begin, 8 * end);
+        else
+            integrateScalar(8 * begin, 8 * end);
+    });
+}
+
+void Integrator::scatter() {
+    for(int i = 0; i != size(); ++i) {
+        Body* body = objects[i];
+        
+        if(body == NULL)
+            break;
+        
+        Stick& stick = body->stick;
+        
+        body->position = vec2(px[i], py[i]);
+        body->velocity = vec2(vx[i], vy[i]);
+        
+        stick.position = vec2(spx[i], spy[i]);
+        stick.velocity = vec2(svx[i], svy[i]);
+        stick.normal = vec2(snx[i], sny[i]);
+        stick.angularVelocity = sw[i];
+    }
+}
+
+static inline bool close(float a, float b, float tolerance) {
+    return fabs(a - b) <= tolerance * std::max(1.0, fabs(b));
+}
+
+bool Integrator::validate(float tolerance) {
+    for(int i = 0; i != size(); ++i) {
+        Body* body = objects[i];
+        
+        if(body == NULL)
+            break;
+        
+        Stick& stick = body->stick;
+        
+        vec2 position = body->position;
+        vec2 velocity = body->velocity;
+        vec2 stickPosition = stick.position;
+        vec2 stickVelocity = stick.velocity;
+        vec2 normal = stick.normal;
+        float angularVelocity = stick.angularVelocity;
+        float health = body->health;
+        
+        body->step(dt, maxTranslation);
+        
+        bool same = close(px[i], body->position.x, tolerance) && close(py[i], body->position.y, tolerance) &&
+                    close(vx[i], body->velocity.x, tolerance) && close(vy[i], body->velocity.y, tolerance) &&
+                    close(spx[i], stick.position.x, tolerance) && close(spy[i], stick.position.y, tolerance) &&
+                    close(svx[i], stick.velocity.x, tolerance) && close(svy[i], stick.velocity.y, tolerance) &&
+                    close(snx[i], stick.normal.x, tolerance) && close(sny[i], stick.normal.y, tolerance) &&
+                    close(sw[i], stick.angularVelocity, tolerance);
+        
+        body->position = position;
+        body->velocity = velocity;
+        stick.position = stickPosition;
+        stick.velocity = stickVelocity;
+        stick.normal = normal;
+        stick.angularVelocity = angularVelocity;
+        body->health = health;
+        
+        if(!same)
+            return false;
+    }
+    
+    return true;
+}
@@ -0,0 +1,181 @@
+//
+//  Integrator.hpp
+//  Evolution
+//
+
+#ifndef Integrator_hpp
+#define Integrator_hpp
+
+#include "Body.hpp"
+#include "ThreadPool.h"
+
+#ifdef avx2_kernels
+#include <immintrin.h>
+#endif
+
+/// largest difference allowed between the integrator and Body::step
+#define integrator_tolerance 1e-4f
+
+/// cosine and sine of `a`, for |a| <= max_rotation
+/// the series is good to about 1e-7 over that range, the integrator normalizes after rotating anyway
+inline void small_rotation(float a, float* c, float* s) {
+    float a2 = a * a;
+    *s = a * (1.0f + a2 * (-1.0f/6.0f + a2 * (1.0f/120.0f + a2 * (-1.0f/5040.0f + a2 * (1.0f/362880.0f + a2 * (-1.0f/39916800.0f))))));
+    *c = 1.0f + a2 * (-0.5f + a2 * (1.0f/24.0f + a2 * (-1.0f/720.0f + a2 * (1.0f/40320.0f + a2 * (-1.0f/3628800.0f + a2 * (1.0f/479001600.0f))))));
+}
+
+/**
+ ** Body::step of every body at once.
+ ** Bodies and their sticks are gathered into arrays of each coordinate, stepped
+ ** 8 at a time where the processor has AVX2, and written back.
+ **
+ ** Damping only depends on the damping of an object and dt, so `powf` runs once for
+ ** every different value instead of once an object. The stick turns by a series
+ ** instead of `cosf` and `sinf`, and its normal is normalized after every turn.
+ **
+ ** The arm pulls the body at its own center, where Body::applyImpulse does nothing,
+ ** so only the stick is pulled here.
+ **/
+
+class Integrator
+{
+    
+    /// bodies being stepped, NULL past the end up to a whole block
+    std::vector<Body*> objects;
+    
+    /// bodies
+    std::vector<float> px, py, vx, vy;
+    
+    /// mass, square of the arm length, powf(damping, dt)
+    std::vector<float> mass, arm2, damping;
+    
+    /// sticks
+    std::vector<float> spx, spy, svx, svy, snx, sny, sw;
+    
+    /// inverse mass, powf(linearDamping, dt), powf(angularDamping, dt)
+    std::vector<float> sInvMass, sLinear, sAngular;
+    
+    float dt;
+    
+    /// powf(d, dt) of the last `d` it was given
+    struct Factor
+    {
+        float d;
+        float value;
+        
+        inline float operator () (float d, float dt) {
+            if(d != this->d) {
+                this->d = d;
+                value = powf(d, dt);
+            }
+            
+            return value;
+        }
+    };
+    
+    /// one for each kind of damping, they are almost always the same for every body
+    Factor bodyFactor;
+    Factor linearFactor;
+    Factor angularFactor;
+    
+    /// steps entries [begin, end)
+    void integrateScalar(int begin, int end);
+    
+    /// steps entries [begin, end), 8 at a time
+    void integrateVector(int begin, int end);
+    
+public:
+    
+    /// see Body::step
+    float maxTranslation = max_translation;
+    
+    /// run the vector kernel, only taken where the processor has AVX2
+    bool vectorKernels = true;
+    
+    Integrator() : dt(0.0f) {}
+    
+    Integrator(const Integrator&) = delete;
+    
+    Integrator& operator = (const Integrator&) = delete;
+    
+    /// reads the bodies, nothing changes until `scatter`
+    template <class Iterator>
+    void gather(Iterator begin, Iterator end, float dt);
+    
+    void integrate(ThreadPool* pool);
+    
+    /// writes the result back to the bodies
+    void scatter();
+    
+    /// runs Body::step of every body and compares it to the result, between `integrate` and `scatter`
+    /// the bodies are left as they were
+    bool validate(float tolerance);
+    
+    inline int size() const {
+        return (int)objects.size();
+    }
+};
+
+template <class Iterator>
+void Integrator::gather(Iterator begin, Iterator end, float dt) {
+    this->dt = dt;
+    
+    /// no damping is negative
+    bodyFactor.d = linearFactor.d = angularFactor.d = -1.0f;
+    
+    objects.clear();
+    for(; begin != end; ++begin)
+        objects.push_back(*begin);
+    
+    int n = (int)objects.size();
+    
+    while(objects.size() % 8 != 0)
+        objects.push_back(NULL);
+    
+    int size = (int)objects.size();
+    
+    px.resize(size); py.resize(size); vx.resize(size); vy.resize(size);
+    mass.resize(size); arm2.resize(size); damping.resize(size);
+    spx.resize(size); spy.resize(size); svx.resize(size); svy.resize(size); snx.resize(size); sny.resize(size); sw.resize(size);
+    sInvMass.resize(size); sLinear.resize(size); sAngular.resize(size);
+    
+    for(int i = 0; i != n; ++i) {
+        const Body* body = objects[i];
+        const Stick& stick = body->stick;
+        
+        px[i] = body->position.x;
+        py[i] = body->position.y;
+        vx[i] = body->velocity.x;
+        vy[i] = body->velocity.y;
+        
+        float arm = body->absArmLength();
+        
+        mass[i] = body->mass();
+        arm2[i] = arm * arm;
+        damping[i] = bodyFactor(body->damping, dt);
+        
+        spx[i] = stick.position.x;
+        spy[i] = stick.position.y;
+        svx[i] = stick.velocity.x;
+        svy[i] = stick.velocity.y;
+        snx[i] = stick.normal.x;
+        sny[i] = stick.normal.y;
+        sw[i] = stick.angularVelocity;
+        
+        sInvMass[i] = stick.invMass();
+        sLinear[i] = linearFactor(stick.linearDamping, dt);
+        sAngular[i] = angularFactor(stick.angularDamping, dt);
+    }
+    
+    /// still bodies with a stick one unit away
+    for(int i = n; i != size; ++i) {
+        px[i] = py[i] = vx[i] = vy[i] = 0.0f;
+        mass[i] = arm2[i] = damping[i] = 1.0f;
+        spx[i] = 1.0f;
+        spy[i] = svx[i] = svy[i] = sny[i] = sw[i] = 0.0f;
+        snx[i] = 1.0f;
+        sInvMass[i] = sLinear[i] = sAngular[i] = 1.0f;
+    }
+}
+
+#endif /* Integrator_hpp */
@@ -29,6 +29,9 @@ public:
     
     int type;
     
+    /// unique id given by the world
+    uint id;
+    
     vec2 position;
     vec2 velocity;
     
@@ -38,25 +41,46 @@ public:
     
     int node;
     
+    /// which pairs the broadphase reports
+    Filter filter;
+    
     enum type
     {
         e_body,
         e_stick
     };
     
-    virtual void applyImpulse(const vec2&, const vec2&) = 0;
+    /// not virtual, these forward to Body or Stick by `type`
+    /// defined in Body.hpp, where both are complete
+    inline void applyImpulse(const vec2& world, const vec2& imp);
+    
+    inline void push(const vec2& world, const vec2& imp);
+    
+    inline void hurt(const vec2& world, const vec2& imp);
     
-    virtual AABB aabb() const = 0;
+    inline AABB aabb() const;
     
-    virtual float area() const = 0;
+    inline float area() const;
+    
+    /// area() * density, kept in `massValue` and `invMassValue`
+    /// call after changing radius, length or density
+    inline void updateMass() {
+        massValue = area() * density;
+        invMassValue = 1.0f / massValue;
+    }
     
     inline float mass() const {
-        return area() * density;
+        return massValue;
     }
     
     inline float invMass() const {
-        return 1.0f / mass();
+        return invMassValue;
     }
+    
+protected:
+    
+    float massValue;
+    float invMassValue;
 };
 
 inline void constrain(vec2* A, float V2) {
@@ -44,10 +44,10 @@ public:
         density = 5.0f;
     }
     
-    void step(float dt) {
+    void step(float dt, float maxTranslation = max_translation) {
         float ca2 = max_rotation_squared / (dt * dt);
         
-        constrain(&velocity, max_translation_squared / (dt * dt));
+        constrain(&velocity, maxTranslation * maxTranslation / (dt * dt));
         
         float a2 = angularVelocity * angularVelocity;
         if(a2 > ca2) {
@@ -62,7 +62,7 @@ public:
         position += dt * velocity;
     }
     
-    AABB aabb() const {
+    inline AABB aabb() const {
         vec2 p1 = vec2(0.0f, length * 0.5f) * normal;
         vec2 p2 = -p1;
         vec2 ext = vec2(radius, radius);
@@ -75,8 +75,13 @@ public:
         return radius * (2.0f * length + radius * M_PI);
     }
     
-    void applyImpulse(const vec2& world, const vec2& imp) {
-        float invMass = Obj::invMass();
+    /// of a rod of its length, for the position solver
+    inline float invInertia() const {
+        return 12.0f * invMassValue / (length * length + 3.0f * radius * radius);
+    }
+    
+    inline void applyImpulse(const vec2& world, const vec2& imp) {
+        float invMass = invMassValue;
         vec2 q = (world - position).norm();
         velocity += invMass * scl(vec2(fabs(q.x), fabs(q.y)), imp);
         angularVelocity -= (invMass * dot(imp, q.I()));
@@ -0,0 +1,320 @@
+//
+//  Shard.cpp
+//  Evolution
+//
+
+#include "Shard.hpp"
+
+Shard::Shard(Transport* transport, float width, float height, uint md, float cellSize, float tileSize) : World(width, height, md, cellSize, tileSize), transport(transport) {
+    float slab = width / transport->getShards();
+    
+    lower = aabb.lowerBound.x + slab * transport->getRank();
+    upper = transport->getRank() == transport->getShards() - 1 ? aabb.upperBound.x : lower + slab;
+    
+    /// taken from the back, so bodies get the brains in the order of `bs`
+    for(uint i = bs.size(); i != 0; --i)
+        freeBrains.push_back(bs[i - 1]);
+}
+
+Shard::~Shard() {
+    clearGhosts();
+    
+    for(Brain* brain : spareBrains)
+        delete brain;
+}
+
+void Shard::generate(BodyDef def) {
+    std::vector<Body*> list;
+    float stride = 2.0f * def.radius * targetRadius;
+    for(float x = aabb.lowerBound.x + stride; x < aabb.upperBound.x; x += stride) {
+        if(sideOf(x) >= 0)
+            continue;
+        
+        for(float y = aabb.lowerBound.y + stride; y < aabb.upperBound.y; y += stride) {
+            if(bodies.size() >= maxBodies) break;
+            def.position = vec2(x, y);
+            Body* body = allocateBody(&def);
+            body->brain = takeBrain();
+            bodies.push_back(body);
+            list.push_back(body);
+        }
+    }
+    
+    createProxies(list.data(), (int)list.size());
+}
+
+Brain* Shard::takeBrain() {
+    if(freeBrains.empty())
+        collectBrains();
+    
+    if(freeBrains.empty()) {
+        Brain* brain = new Brain(Body::input_size, Body::output_size);
+        spareBrains.push_back(brain);
+        return brain;
+    }
+    
+    Brain* brain = freeBrains.back();
+    freeBrains.pop_back();
+    return brain;
+}
+
+void Shard::collectBrains() {
+    std::vector<Brain*> used;
+    for(Body* body : bodies)
+        used.push_back(body->brain);
+    
+    std::sort(used.begin(), used.end());
+    
+    for(uint i = bs.size(); i != 0; --i) {
+        if(!std::binary_search(used.begin(), used.end(), bs[i - 1]))
+            freeBrains.push_back(bs[i - 1]);
+    }
+    
+    for(Brain* brain : spareBrains) {
+        if(!std::binary_search(used.begin(), used.end(), brain))
+            freeBrains.push_back(brain);
+    }
+}
+
+void Shard::pack(const Body* body, bool brain, std::vector<char>* message) {
+    const Stick& stick = body->stick;
+    
+    ShardBody record;
+    
+    record.id = body->id;
+    record.position = body->position;
+    record.velocity = body->velocity;
+    record.damping = body->damping;
+    record.radius = body->radius;
+    record.density = body->density;
+    record.maxHealth = body->maxHealth;
+    record.health = body->health;
+    record.maxStickForce = body->maxStickForce;
+    record.maxForce = body->maxForce;
+    record.armLength = body->armLength;
+    record.color = body->color;
+    record.filter = body->filter;
+    
+    record.stickPosition = stick.position;
+    record.stickVelocity = stick.velocity;
+    record.stickNormal = stick.normal;
+    record.stickAngularVelocity = stick.angularVelocity;
+    record.stickLength = stick.length;
+    record.stickRadius = stick.radius;
+    record.stickDensity = stick.density;
+    record.stickLinearDamping = stick.linearDamping;
+    record.stickAngularDamping = stick.angularDamping;
+    
+    record.reward = 0.0f;
+    record.brainSize = 0;
+    
+    char* bytes = NULL;
+    size_t size = 0;
+    
+    if(brain) {
+        record.reward = body->brain->reward;
+        
+        FILE* os = open_memstream(&bytes, &size);
+        body->brain->write(os);
+        fclose(os);
+        
+        record.brainSize = (uint)size;
+    }
+    
+    const char* p = (const char*)&record;
+    message->insert(message->end(), p, p + sizeof(record));
+    
+    if(bytes != NULL) {
+        message->insert(message->end(), bytes, bytes + size);
+        free(bytes);
+    }
+}
+
+Body* Shard::unpack(const char** p, int side, bool ghost) {
+    ShardBody record;
+    memcpy(&record, *p, sizeof(record));
+    *p += sizeof(record);
+    
+    BodyDef def;
+    def.position = record.position;
+    def.velocity = record.velocity;
+    def.damping = record.damping;
+    def.radius = record.radius;
+    def.density = record.density;
+    def.maxHealth = record.maxHealth;
+    def.maxStickForce = record.maxStickForce;
+    def.maxForce = record.maxForce;
+    def.armLength = record.armLength;
+    def.color = record.color;
+    def.filter = record.filter;
+    
+    /// a negative group belongs to the old shard, the body gets its own again
+    if(def.filter.group < 0)
+        def.filter.group = 0;
+    
+    def.stick.length = record.stickLength;
+    def.stick.radius = record.stickRadius;
+    def.stick.density = record.stickDensity;
+    def.stick.linearDamping = record.stickLinearDamping;
+    def.stick.angularDamping = record.stickAngularDamping;
+    
+    Body* body;
+    
+    if(ghost) {
+        body = new Body(&def);
+        body->brain = NULL;
+        
+        /// stays the same from step to step, so the contact cache keeps working
+        body->id = shard_ghost_ids + 4 * (record.id / 2) + 2 * side;
+        body->stick.id = body->id + 1;
+        
+        if(body->filter.group == 0) {
+            body->filter.group = -(int)(body->id / 2) - 1;
+            body->stick.filter.group = body->filter.group;
+        }
+    }else{
+        body = allocateBody(&def);
+    }
+    
+    Stick& stick = body->stick;
+    
+    body->health = record.health;
+    stick.position = record.stickPosition;
+    stick.velocity = record.stickVelocity;
+    stick.normal = record.stickNormal;
+    stick.angularVelocity = record.stickAngularVelocity;
+    
+    if(!ghost) {
+        body->brain = takeBrain();
+        
+        FILE* is = fmemopen((void*)*p, record.brainSize, "rb");
+        body->brain->read(is);
+        fclose(is);
+        
+        body->brain->reward = record.reward;
+    }
+    
+    *p += record.brainSize;
+    
+    return body;
+}
+
+void Shard::clearGhosts() {
+    for(Body* ghost : ghosts) {
+        broadphase.destoryProxy(ghost->node);
+        broadphase.destoryProxy(ghost->stick.node);
+        delete ghost;
+    }
+    
+    ghosts.clear();
+}
+
+void Shard::exchangeGhosts() {
+    clearGhosts();
+    
+    outputs[0].clear();
+    outputs[1].clear();
+    
+    bool left = transport->hasNeighbor(Transport::e_left);
+    bool right = transport->hasNeighbor(Transport::e_right);
+    
+    for(Body* body : bodies) {
+        float x = body->position.x;
+        
+        if(left && x < lower + ghostWidth) {
+            pack(body, false, &outputs[Transport::e_left]);
+            
+            /// its target may be a ghost or a body that moved away
+            body->cache.valid = false;
+        }
+        
+        if(right && x >= upper - ghostWidth) {
+            pack(body, false, &outputs[Transport::e_right]);
+            body->cache.valid = false;
+        }
+    }
+    
+    transport->exchange(outputs, inputs);
+    
+    for(int side = 0; side != 2; ++side) {
+        if(!transport->hasNeighbor(side))
+            continue;
+        
+        const char* p = inputs[side].data();
+        const char* end = p + inputs[side].size();
+        
+        while(p != end) {
+            Body* ghost = unpack(&p, side, true);
+            ghost->node = broadphase.createProxy(ghost->aabb(), ghost, ghost->filter);
+            ghost->stick.node = broadphase.createProxy(ghost->stick.aabb(), &ghost->stick, ghost->stick.filter);
+            ghosts.push_back(ghost);
+        }
+    }
+}
+
+void Shard::migrate() {
+    outputs[0].clear();
+    outputs[1].clear();
+    
+    bool leaving = false;
+    
+    for(Body* body : bodies) {
+        int side = sideOf(body->position.x);
+        
+        if(side < 0)
+            continue;
+        
+        pack(body, true, &outputs[side]);
+        freeBrains.push_back(body->brain);
+        
+        if(!body->awake)
+            --sleeping;
+        
+        /// gone from this shard as if it died, so no target points to it
+        body->health = 0.0f;
+        leaving = true;
+        
+        ++sent;
+    }
+    
+    if(leaving)
+        removeDead();
+    
+    transport->exchange(outputs, inputs);
+    
+    for(int side = 0; side != 2; ++side) {
+        if(!transport->hasNeighbor(side))
+            continue;
+        
+        const char* p = inputs[side].data();
+        const char* end = p + inputs[side].size();
+        
+        while(p != end) {
+            Body* body = unpack(&p, side, false);
+            body->node = broadphase.createProxy(body->aabb(), body, body->filter);
+            body->stick.node = broadphase.createProxy(body->stick.aabb(), &body->stick, body->stick.filter);
+            bodies.push_back(body);
+            
+            ++received;
+        }
+    }
+}
+
+void Shard::setBroadphase(int type) {
+    clearGhosts();
+    World::setBroadphase(type);
+}
+
+void Shard::step(float dt, int its) {
+    /// a reorder lays out every proxy of the tree, the ghosts go first
+    clearGhosts();
+    reorderIfDue();
+    
+    exchangeGhosts();
+    
+    World::step(dt, its);
+    
+    migrate();
+    
+    transport->barrier();
+}
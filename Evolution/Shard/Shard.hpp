@@ -0,0 +1,182 @@
+//
+//  Shard.hpp
+//  Evolution
+//
+
+#ifndef Shard_hpp
+#define Shard_hpp
+
+#include "World.hpp"
+#include "Transport.hpp"
+
+/// bodies this close to the edge of a slab are sent to the neighbor as ghosts
+/// covers `targetRadius` with `targetMargin`, and the reach of a stick
+#define shard_ghost_width 12.0f
+
+/// ids of ghosts start here, ids of the bodies of a shard stay below it
+#define shard_ghost_ids (1u << 31)
+
+/// a body as it is sent to another shard
+/// the bytes of its brain follow it when it moves, ghosts have none
+struct ShardBody
+{
+    /// id in the shard that sent it
+    uint id;
+    
+    vec2 position;
+    vec2 velocity;
+    
+    float damping;
+    
+    float radius;
+    float density;
+    
+    float maxHealth;
+    float health;
+    
+    float maxStickForce;
+    float maxForce;
+    
+    float armLength;
+    
+    Colorf color;
+    
+    Filter filter;
+    
+    vec2 stickPosition;
+    vec2 stickVelocity;
+    vec2 stickNormal;
+    
+    float stickAngularVelocity;
+    
+    float stickLength;
+    float stickRadius;
+    float stickDensity;
+    
+    float stickLinearDamping;
+    float stickAngularDamping;
+    
+    float reward;
+    
+    uint brainSize;
+};
+
+/**
+ ** A World that owns one slab of the arena, x in [lower, upper) of rank `rank` out of
+ ** `shards` slabs from left to right. The first and the last slab own everything past
+ ** their outer edge too.
+ **
+ ** Each step:
+ **     bodies within `ghostWidth` of an edge are sent to the neighbor, which puts them in
+ **     its broadphase as ghosts. Ghosts are sensed and collided with, but not stepped,
+ **     so each side pushes its own bodies away from the other's.
+ **     the world steps its own bodies.
+ **     bodies that left the slab are sent with their brain to the neighbor, which owns
+ **     them from then on.
+ **     every rank waits at the barrier.
+ **
+ ** Every shard only holds its own bodies and brains, so the population can grow with
+ ** the number of processes. The messages are raw structs, every rank has to run the
+ ** same build.
+ **/
+
+class Shard : public World
+{
+    
+protected:
+    
+    Transport* transport;
+    
+    float lower;
+    float upper;
+    
+    /// bodies of the neighbors near the edges, remade every step
+    std::vector<Body*> ghosts;
+    
+    /// brains no body of this shard uses
+    std::vector<Brain*> freeBrains;
+    
+    /// brains made once every brain of `bs` was taken, deleted with the shard
+    std::vector<Brain*> spareBrains;
+    
+    /// messages to and from the left and the right neighbor
+    std::vector<char> outputs[2];
+    std::vector<char> inputs[2];
+    
+    /// bodies sent to a neighbor so far
+    int sent = 0;
+    
+    /// bodies a neighbor sent so far
+    int received = 0;
+    
+    /// -1 if the shard owns `x`, otherwise the side of the neighbor that does
+    inline int sideOf(float x) const {
+        if(x < lower && transport->hasNeighbor(Transport::e_left))
+            return Transport::e_left;
+        
+        if(x >= upper && transport->hasNeighbor(Transport::e_right))
+            return Transport::e_right;
+        
+        return -1;
+    }
+    
+    /// finds the brains of bodies that died or were cleared
+    void collectBrains();
+    
+    static void pack(const Body* body, bool brain, std::vector<char>* message);
+    
+    /// the body of the record at `*p` from the neighbor on `side`, moves `*p` past it
+    /// ghosts get an id from the id in their old shard, the others a new one
+    Body* unpack(const char** p, int side, bool ghost);
+    
+    void clearGhosts();
+    
+    void exchangeGhosts();
+    
+    void migrate();
+    
+public:
+    
+    float ghostWidth = shard_ghost_width;
+    
+    /// `md` bodies at most, more only when neighbors send them
+    Shard(Transport* transport, float width, float height, uint md, float cellSize = default_cell_size, float tileSize = default_tile_size);
+    
+    ~Shard();
+    
+    /// the bodies of World::generate that are in this slab
+    void generate(BodyDef def);
+    
+    /// a brain for a new body of this shard
+    Brain* takeBrain();
+    
+    void setBroadphase(int type);
+    
+    inline int getRank() const {
+        return transport->getRank();
+    }
+    
+    inline float getLower() const {
+        return lower;
+    }
+    
+    inline float getUpper() const {
+        return upper;
+    }
+    
+    inline int getGhostCount() const {
+        return (int)ghosts.size();
+    }
+    
+    inline int getSent() const {
+        return sent;
+    }
+    
+    inline int getReceived() const {
+        return received;
+    }
+    
+    void step(float dt, int its);
+};
+
+#endif /* Shard_hpp */
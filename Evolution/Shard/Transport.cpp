@@ -0,0 +1,343 @@
+//
+//  Transport.cpp
+//  Evolution
+//
+
+#include "Transport.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+static void fail(const char* what) {
+    throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+}
+
+static inline uint64_t align64(uint64_t size) {
+    return (size + 63) & ~(uint64_t)63;
+}
+
+/// the ring from `rank` to its right neighbor is 2 * rank, the one back is 2 * rank + 1
+static inline ShardRing* ringOf(ShardSegment* segment, int index) {
+    char* base = (char*)segment + align64(sizeof(ShardSegment));
+    return (ShardRing*)(base + index * (sizeof(ShardRing) + segment->ringSize));
+}
+
+static inline size_t segmentLength(int shards, uint64_t ringSize) {
+    int rings = 2 * (shards - 1);
+    return (size_t)(align64(sizeof(ShardSegment)) + rings * (sizeof(ShardRing) + ringSize));
+}
+
+void Channel::send(const void* bytes, size_t size) {
+    const char* p = (const char*)bytes;
+    
+    if(type == e_socket) {
+        while(size != 0) {
+            ssize_t n = ::send(fd, p, size, 0);
+            
+            if(n < 0) {
+                if(errno == EINTR) continue;
+                fail("shard send");
+            }
+            
+            p += n;
+            size -= n;
+        }
+        
+        return;
+    }
+    
+    assert(type == e_ring);
+    
+    while(size != 0) {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t space = capacity - (head - ring->tail.load(std::memory_order_acquire));
+        
+        if(space == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        
+        uint64_t offset = head % capacity;
+        size_t n = (size_t)std::min((uint64_t)size, std::min(space, capacity - offset));
+        
+        memcpy(data + offset, p, n);
+        ring->head.store(head + n, std::memory_order_release);
+        
+        p += n;
+        size -= n;
+    }
+}
+
+void Channel::recv(void* bytes, size_t size) {
+    char* p = (char*)bytes;
+    
+    if(type == e_socket) {
+        while(size != 0) {
+            ssize_t n = ::recv(fd, p, size, 0);
+            
+            if(n < 0) {
+                if(errno == EINTR) continue;
+                fail("shard recv");
+            }
+            
+            if(n == 0)
+                throw std::runtime_error("shard recv: neighbor closed");
+            
+            p += n;
+            size -= n;
+        }
+        
+        return;
+    }
+    
+    assert(type == e_ring);
+    
+    while(size != 0) {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t available = ring->head.load(std::memory_order_acquire) - tail;
+        
+        if(available == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        
+        uint64_t offset = tail % capacity;
+        size_t n = (size_t)std::min((uint64_t)size, std::min(available, capacity - offset));
+        
+        memcpy(p, data + offset, n);
+        ring->tail.store(tail + n, std::memory_order_release);
+        
+        p += n;
+        size -= n;
+    }
+}
+
+void Transport::create(const char* name, int shards, uint64_t ringSize) {
+    ringSize = align64(ringSize);
+    size_t length = segmentLength(shards, ringSize);
+    
+    int fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if(fd < 0) fail("shm_open");
+    
+    if(ftruncate(fd, length) != 0) {
+        close(fd);
+        fail("ftruncate");
+    }
+    
+    void* memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if(memory == MAP_FAILED) fail("mmap");
+    
+    ShardSegment* segment = (ShardSegment*)memory;
+    new (&segment->barrier.count) std::atomic<int>(0);
+    new (&segment->barrier.sense) std::atomic<int>(0);
+    segment->shards = shards;
+    segment->ringSize = ringSize;
+    
+    for(int i = 0; i != 2 * (shards - 1); ++i) {
+        ShardRing* ring = ringOf(segment, i);
+        new (&ring->head) std::atomic<uint64_t>(0);
+        new (&ring->tail) std::atomic<uint64_t>(0);
+    }
+    
+    munmap(memory, length);
+}
+
+void Transport::unlink(const char* name) {
+    shm_unlink(name);
+}
+
+Transport::Transport(const char* name, int rank) : type(e_shm), rank(rank), sense(0) {
+    sockets[0] = sockets[1] = -1;
+    
+    int fd = shm_open(name, O_RDWR, 0600);
+    if(fd < 0) fail("shm_open");
+    
+    struct stat info;
+    if(fstat(fd, &info) != 0) {
+        close(fd);
+        fail("fstat");
+    }
+    
+    length = (size_t)info.st_size;
+    
+    void* memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if(memory == MAP_FAILED) fail("mmap");
+    
+    segment = (ShardSegment*)memory;
+    shards = segment->shards;
+    
+    assert(0 <= rank && rank < shards);
+    
+    if(hasNeighbor(e_left)) {
+        outputs[e_left] = Channel::makeRing(ringOf(segment, 2 * (rank - 1) + 1), segment->ringSize);
+        inputs[e_left] = Channel::makeRing(ringOf(segment, 2 * (rank - 1)), segment->ringSize);
+    }
+    
+    if(hasNeighbor(e_right)) {
+        outputs[e_right] = Channel::makeRing(ringOf(segment, 2 * rank), segment->ringSize);
+        inputs[e_right] = Channel::makeRing(ringOf(segment, 2 * rank + 1), segment->ringSize);
+    }
+}
+
+Transport::Transport(int rank, int shards, int left, int right) : type(e_socket), rank(rank), shards(shards), segment(NULL), length(0), sense(0) {
+    assert(0 <= rank && rank < shards);
+    
+    sockets[e_left] = hasNeighbor(e_left) ? left : -1;
+    sockets[e_right] = hasNeighbor(e_right) ? right : -1;
+    
+    for(int side = 0; side != 2; ++side) {
+        if(sockets[side] >= 0)
+            outputs[side] = inputs[side] = Channel::makeSocket(sockets[side]);
+    }
+}
+
+Transport::~Transport() {
+    if(type == e_shm) {
+        munmap(segment, length);
+    }else{
+        for(int side = 0; side != 2; ++side) {
+            if(sockets[side] >= 0)
+                close(sockets[side]);
+        }
+    }
+}
+
+void Transport::send(int side, const std::vector<char>& message) {
+    uint64_t size = message.size();
+    outputs[side].send(&size, sizeof(size));
+    outputs[side].send(message.data(), message.size());
+}
+
+void Transport::recv(int side, std::vector<char>* message) {
+    uint64_t size;
+    inputs[side].recv(&size, sizeof(size));
+    message->resize(size);
+    inputs[side].recv(message->data(), size);
+}
+
+void Transport::exchange(const std::vector<char>* outputs, std::vector<char>* inputs) {
+    for(int phase = 0; phase != 2; ++phase) {
+        int side = sideOf(phase);
+        
+        if(side < 0)
+            continue;
+        
+        /// the left one of the pair sends first
+        if(side == e_right) {
+            send(side, outputs[side]);
+            recv(side, &inputs[side]);
+        }else{
+            recv(side, &inputs[side]);
+            send(side, outputs[side]);
+        }
+    }
+}
+
+void Transport::barrier() {
+    if(type == e_socket) {
+        std::vector<char> empty[2];
+        std::vector<char> received[2];
+        exchange(empty, received);
+        return;
+    }
+    
+    ShardBarrier& shared = segment->barrier;
+    
+    sense ^= 1;
+    
+    if(shared.count.fetch_add(1, std::memory_order_acq_rel) == shards - 1) {
+        shared.count.store(0, std::memory_order_relaxed);
+        shared.sense.store(sense, std::memory_order_release);
+    }else{
+        while(shared.sense.load(std::memory_order_acquire) != sense)
+            std::this_thread::yield();
+    }
+}
+
+int run_shards(int shards, int type, const std::function<void(Transport*)>& fn) {
+    char name[32];
+    snprintf(name, sizeof(name), "/evolution.%d", (int)getpid());
+    
+    /// both ends of the socket between rank i and rank i + 1
+    std::vector<int> ends(2 * std::max(shards - 1, 0), -1);
+    
+    if(type == Transport::e_shm) {
+        Transport::create(name, shards);
+    }else{
+        for(int i = 0; i < shards - 1; ++i) {
+            if(socketpair(AF_UNIX, SOCK_STREAM, 0, &ends[2 * i]) != 0)
+                fail("socketpair");
+        }
+    }
+    
+    /// buffered output would be written by every child
+    fflush(NULL);
+    
+    std::vector<pid_t> children;
+    
+    for(int rank = 0; rank != shards; ++rank) {
+        pid_t pid = fork();
+        
+        if(pid < 0)
+            fail("fork");
+        
+        if(pid != 0) {
+            children.push_back(pid);
+            continue;
+        }
+        
+        int status = 0;
+        
+        try {
+            if(type == Transport::e_shm) {
+                Transport transport(name, rank);
+                fn(&transport);
+            }else{
+                int left = rank > 0 ? ends[2 * (rank - 1) + 1] : -1;
+                int right = rank < shards - 1 ? ends[2 * rank] : -1;
+                
+                for(int fd : ends) {
+                    if(fd != left && fd != right)
+                        close(fd);
+                }
+                
+                Transport transport(rank, shards, left, right);
+                fn(&transport);
+            }
+        } catch(const std::exception& e) {
+            fprintf(stderr, "shard %d: %s\n", rank, e.what());
+            status = 1;
+        }
+        
+        fflush(NULL);
+        _exit(status);
+    }
+    
+    for(int fd : ends)
+        close(fd);
+    
+    int failed = 0;
+    
+    for(pid_t pid : children) {
+        int status;
+        
+        if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ++failed;
+    }
+    
+    if(type == Transport::e_shm)
+        Transport::unlink(name);
+    
+    return failed;
+}
@@ -0,0 +1,210 @@
+//
+//  Transport.hpp
+//  Evolution
+//
+
+#ifndef Transport_hpp
+#define Transport_hpp
+
+#include "common.h"
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+/// bytes of each ring of the shared memory transport
+#define shard_ring_size (1 << 22)
+
+/// one direction between two neighbors, a single writer and a single reader
+/// `capacity` bytes of data follow it
+struct ShardRing
+{
+    /// bytes written so far, only the writer changes it
+    std::atomic<uint64_t> head;
+    char pad0[64 - sizeof(std::atomic<uint64_t>)];
+    
+    /// bytes read so far, only the reader changes it
+    std::atomic<uint64_t> tail;
+    char pad1[64 - sizeof(std::atomic<uint64_t>)];
+};
+
+/// sense reversing barrier of every rank
+struct ShardBarrier
+{
+    std::atomic<int> count;
+    std::atomic<int> sense;
+};
+
+/// start of the shared memory, the rings follow it
+struct ShardSegment
+{
+    ShardBarrier barrier;
+    
+    int shards;
+    
+    uint64_t ringSize;
+};
+
+/**
+ ** One direction to a neighbor, picked by `type`.
+ ** A ring in shared memory, or a connected stream socket.
+ ** Both block until every byte went through.
+ **/
+
+class Channel
+{
+    
+    int type;
+    
+    ShardRing* ring;
+    char* data;
+    uint64_t capacity;
+    
+    int fd;
+    
+public:
+    
+    enum type
+    {
+        e_none,
+        e_ring,
+        e_socket
+    };
+    
+    Channel() : type(e_none), ring(NULL), data(NULL), capacity(0), fd(-1) {}
+    
+    static inline Channel makeRing(ShardRing* ring, uint64_t capacity) {
+        Channel channel;
+        channel.type = e_ring;
+        channel.ring = ring;
+        channel.data = (char*)(ring + 1);
+        channel.capacity = capacity;
+        return channel;
+    }
+    
+    static inline Channel makeSocket(int fd) {
+        Channel channel;
+        channel.type = e_socket;
+        channel.fd = fd;
+        return channel;
+    }
+    
+    inline int getType() const {
+        return type;
+    }
+    
+    void send(const void* bytes, size_t size);
+    
+    void recv(void* bytes, size_t size);
+    
+};
+
+/**
+ ** The link of a shard to its neighbors, ranks are slabs from left to right.
+ ** Every step is an `exchange` of one message with each neighbor, and a `barrier`.
+ **
+ ** `e_shm` maps a segment made by `create`, with a ring for each direction between
+ ** neighbors and a barrier of every rank.
+ ** `e_socket` sends the same messages over connected stream sockets, so the ranks can be
+ ** on other machines. It has no shared barrier, `barrier` is an empty message to each
+ ** neighbor, which keeps neighbors in lockstep.
+ **
+ ** A message is its size followed by its bytes. Neighbors pair up in two phases, first
+ ** the pairs with an even left rank and then the others. The left one of a pair sends
+ ** first, the right one receives first, so no ring or socket buffer has to hold a whole
+ ** message.
+ **/
+
+class Transport
+{
+    
+    int type;
+    
+    int rank;
+    int shards;
+    
+    ShardSegment* segment;
+    size_t length;
+    
+    /// to and from the left and the right neighbor
+    Channel outputs[2];
+    Channel inputs[2];
+    
+    /// sockets of `e_socket`, -1 for a missing neighbor
+    int sockets[2];
+    
+    /// sense of the last barrier this rank passed
+    int sense;
+    
+    void send(int side, const std::vector<char>& message);
+    
+    void recv(int side, std::vector<char>* message);
+    
+    /// the neighbor this rank pairs with in `phase`, or -1
+    inline int sideOf(int phase) const {
+        int side = (rank & 1) == phase ? 1 : 0;
+        return hasNeighbor(side) ? side : -1;
+    }
+    
+public:
+    
+    enum type
+    {
+        e_shm,
+        e_socket
+    };
+    
+    enum side
+    {
+        e_left,
+        e_right
+    };
+    
+    /// makes the segment of `shards` ranks, before any of them is made
+    static void create(const char* name, int shards, uint64_t ringSize = shard_ring_size);
+    
+    /// removes the name of the segment, ranks that mapped it keep it
+    static void unlink(const char* name);
+    
+    /// rank `rank` of the segment made by `create`
+    Transport(const char* name, int rank);
+    
+    /// rank `rank` of `shards`, with sockets to the left and right neighbor, -1 if there is none
+    /// the sockets are closed with the transport
+    Transport(int rank, int shards, int left, int right);
+    
+    ~Transport();
+    
+    Transport(const Transport&) = delete;
+    
+    Transport& operator = (const Transport&) = delete;
+    
+    inline int getType() const {
+        return type;
+    }
+    
+    inline int getRank() const {
+        return rank;
+    }
+    
+    inline int getShards() const {
+        return shards;
+    }
+    
+    inline bool hasNeighbor(int side) const {
+        return side == e_left ? rank > 0 : rank < shards - 1;
+    }
+    
+    /// sends `outputs[side]` to each neighbor and receives `inputs[side]` from it
+    /// the messages of a missing neighbor are left alone
+    void exchange(const std::vector<char>* outputs, std::vector<char>* inputs);
+    
+    void barrier();
+    
+};
+
+/// forks `shards` processes, each runs `fn` with its own transport of type `type`
+/// make it before anything starts threads, returns the number of processes that failed
+int run_shards(int shards, int type, const std::function<void(Transport*)>& fn);
+
+#endif /* Transport_hpp */
@@ -0,0 +1,140 @@
+//
+//  DeterminismTest.cpp
+//  Evolution
+//
+//  Checks that a seeded, deterministic World repeats itself with any number of workers,
+//  with every broadphase, wherever its bodies were allocated and however often they are reordered,
+//  and that a seeded Builder repeats.
+//  Built on its own, from Evolution/:
+//
+//  g++ -std=gnu++14 -O2 -pthread $(for d in $(find . -type d -not -path '*/glsl*'); do echo -n "-I$d "; done) Tests/DeterminismTest.cpp $(find . -name '*.cpp' -not -name main.cpp -not -path '*/Tests/*') -o DeterminismTest -lrt
+//
+
+#include <cstdio>
+#include "World.hpp"
+#include "Builder.h"
+
+#define test_bodies 300
+
+#define test_steps 150
+
+#define test_dt 0.016f
+
+/// reaches the brains of the world
+struct TestWorld : World
+{
+    using World::World;
+    
+    void populate() {
+        for(int i = 0; i != test_bodies; ++i) {
+            BodyDef def;
+            def.position = vec2(randomf(aabb.lowerBound.x, aabb.upperBound.x), randomf(aabb.lowerBound.y, aabb.upperBound.y));
+            
+            Brain* brain = bs[i];
+            for(int k = 0; k != 20; ++k)
+                brain->mutate();
+            
+            createBody(&def)->brain = brain;
+        }
+    }
+};
+
+/// the checksum after every step, `junk` allocations first so the bodies land elsewhere
+static std::vector<uint64_t> run_world(int threads, int type, bool parallelSolver, int junk, int reorderInterval = 0) {
+    std::vector<void*> waste;
+    for(int i = 0; i != junk; ++i)
+        waste.push_back(malloc(16 + i % 200));
+    
+    seed_random(42);
+    
+    std::vector<uint64_t> sums;
+    
+    TestWorld world(120.0f, 120.0f, test_bodies);
+    world.deterministic = true;
+    world.parallelSolver = parallelSolver;
+    world.reorderInterval = reorderInterval;
+    world.setThreads(threads);
+    world.setBroadphase(type);
+    world.checksumHook = [&sums] (uint64_t sum) {
+        sums.push_back(sum);
+    };
+    
+    world.populate();
+    
+    for(int i = 0; i != test_steps; ++i)
+        world.step(test_dt, 4);
+    
+    for(void* p : waste)
+        free(p);
+    
+    return sums;
+}
+
+static std::vector<uint64_t> run_builder() {
+    seed_random(7);
+    
+    std::vector<uint64_t> sums;
+    
+    Builder builder(4, 4, 60.0f, 60.0f, BodyDef());
+    builder.checksumHook = [&sums] (uint64_t sum) {
+        sums.push_back(sum);
+    };
+    
+    for(int i = 0; i != test_steps; ++i)
+        builder.step(0.8f, 4, 1);
+    
+    return sums;
+}
+
+/// the first step the two runs differ at, -1 if they don't
+static int first_difference(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b) {
+    if(a.size() != b.size())
+        return 0;
+    
+    for(size_t i = 0; i != a.size(); ++i) {
+        if(a[i] != b[i])
+            return (int)i;
+    }
+    
+    return -1;
+}
+
+int main() {
+    static const char* names[] = {"tree", "grid", "sap", "tiles"};
+    
+    int wrong = 0;
+    
+    for(int type = 0; type != 4; ++type) {
+        for(int parallelSolver = 0; parallelSolver != 2; ++parallelSolver) {
+            std::vector<uint64_t> expected = run_world(1, type, parallelSolver, 0);
+            
+            for(int threads : {2, 8}) {
+                int step = first_difference(run_world(threads, type, parallelSolver, 777), expected);
+                
+                if(step >= 0) {
+                    printf("%s, parallel solver %d, %d threads: differs at step %d\n", names[type], parallelSolver, threads, step);
+                    ++wrong;
+                }
+            }
+            
+            /// bodies and brains moved in memory every 10 steps
+            int step = first_difference(run_world(8, type, parallelSolver, 0, 10), expected);
+            
+            if(step >= 0) {
+                printf("%s, parallel solver %d, reordered: differs at step %d\n", names[type], parallelSolver, step);
+                ++wrong;
+            }
+        }
+    }
+    
+    int step = first_difference(run_builder(), run_builder());
+    
+    if(step >= 0) {
+        printf("builder differs at step %d\n", step);
+        ++wrong;
+    }
+    
+    printf("%d differences\n", wrong);
+    
+    return wrong == 0 ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+//
+//  IntegratorTest.cpp
+//  Evolution
+//
+//  Checks the scalar and vector kernels of Integrator against Body::step.
+//  Built on its own, from Evolution/:
+//
+//  g++ -std=gnu++14 -O2 -pthread $(for d in $(find . -type d -not -path '*/glsl*'); do echo -n "-I$d "; done) Tests/IntegratorTest.cpp Obj/Body.cpp Obj/Integrator.cpp -o IntegratorTest
+//
+
+#include <cstdio>
+#include "Integrator.hpp"
+
+/// not a multiple of 8, so the padding of the last block is stepped too
+#define test_bodies 203
+
+#define test_steps 50
+
+#define test_dt (1.0f / 60.0f)
+
+static std::mt19937 engine(11);
+
+static float uniform(float a, float b) {
+    return std::uniform_real_distribution<float>(a, b)(engine);
+}
+
+/// a few of them too fast, so the limits of Body::step and Stick::step are hit too
+static BodyDef random_def() {
+    static const float dampings[] = {0.01f, 0.1f, 0.5f};
+    
+    BodyDef def;
+    def.position = vec2(uniform(-50.0f, 50.0f), uniform(-50.0f, 50.0f));
+    def.velocity = vec2(uniform(-10.0f, 10.0f), uniform(-10.0f, 10.0f));
+    def.damping = dampings[engine() % 3];
+    def.radius = uniform(0.5f, 1.5f);
+    def.armLength = uniform(1.0f, 3.0f);
+    
+    float a = uniform(0.0f, 2.0f * M_PI);
+    def.stick.normal = vec2(cosf(a), sinf(a));
+    def.stick.position = uniform(0.5f, 4.0f) * def.stick.normal.I();
+    def.stick.velocity = vec2(uniform(-10.0f, 10.0f), uniform(-10.0f, 10.0f));
+    def.stick.angularVelocity = uniform(-200.0f, 200.0f);
+    def.stick.linearDamping = dampings[engine() % 3];
+    
+    if(engine() % 8 == 0)
+        def.velocity = 100.0f * def.velocity;
+    
+    return def;
+}
+
+static std::vector<Body*> create(const std::vector<BodyDef>& defs) {
+    std::vector<Body*> bodies;
+    
+    for(const BodyDef& def : defs)
+        bodies.push_back(new Body(&def));
+    
+    return bodies;
+}
+
+static void destory(std::vector<Body*>* bodies) {
+    for(Body* body : *bodies)
+        delete body;
+    
+    bodies->clear();
+}
+
+static inline bool close(float a, float b) {
+    return fabsf(a - b) <= integrator_tolerance * std::max(1.0f, fabsf(b));
+}
+
+static inline bool close(const vec2& a, const vec2& b) {
+    return close(a.x, b.x) && close(a.y, b.y);
+}
+
+static bool same(const Body* a, const Body* b) {
+    return close(a->position, b->position) && close(a->velocity, b->velocity) &&
+           close(a->stick.position, b->stick.position) && close(a->stick.velocity, b->stick.velocity) &&
+           close(a->stick.normal, b->stick.normal) && close(a->stick.angularVelocity, b->stick.angularVelocity);
+}
+
+/// copies the state Integrator steps, so every step starts from the same place
+static void copy(const Body* from, Body* to) {
+    to->position = from->position;
+    to->velocity = from->velocity;
+    to->stick.position = from->stick.position;
+    to->stick.velocity = from->stick.velocity;
+    to->stick.normal = from->stick.normal;
+    to->stick.angularVelocity = from->stick.angularVelocity;
+}
+
+/// steps the bodies with the integrator and with Body::step side by side, returns how many times they differ
+static int check(const std::vector<BodyDef>& defs, bool vectorKernels, int workers) {
+    ThreadPool pool(workers);
+    
+    Integrator integrator;
+    integrator.vectorKernels = vectorKernels;
+    
+    std::vector<Body*> actual = create(defs);
+    std::vector<Body*> expected = create(defs);
+    
+    int wrong = 0;
+    
+    for(int step = 0; step != test_steps; ++step) {
+        integrator.gather(actual.begin(), actual.end(), test_dt);
+        integrator.integrate(&pool);
+        
+        if(!integrator.validate(integrator_tolerance)) {
+            printf("step %d: validate failed\n", step);
+            ++wrong;
+        }
+        
+        integrator.scatter();
+        
+        for(int i = 0; i != test_bodies; ++i) {
+            expected[i]->step(test_dt, integrator.maxTranslation);
+            
+            if(!same(actual[i], expected[i])) {
+                printf("step %d, body %d: position (%f %f), expected (%f %f)\n", step, i, actual[i]->position.x, actual[i]->position.y, expected[i]->position.x, expected[i]->position.y);
+                ++wrong;
+            }
+            
+            /// the error of one step is checked, not how it grows
+            copy(expected[i], actual[i]);
+        }
+    }
+    
+    destory(&actual);
+    destory(&expected);
+    
+    return wrong;
+}
+
+/// the same bodies come out bit for bit the same no matter how many workers there are
+static bool repeats(const std::vector<BodyDef>& defs, bool vectorKernels) {
+    std::vector<Body*> bodies[2] = {create(defs), create(defs)};
+    
+    for(int k = 0; k != 2; ++k) {
+        ThreadPool pool(k == 0 ? 1 : 4);
+        
+        Integrator integrator;
+        integrator.vectorKernels = vectorKernels;
+        
+        for(int step = 0; step != test_steps; ++step) {
+            integrator.gather(bodies[k].begin(), bodies[k].end(), test_dt);
+            integrator.integrate(&pool);
+            integrator.scatter();
+        }
+    }
+    
+    bool same = true;
+    
+    for(int i = 0; i != test_bodies; ++i) {
+        const Body* a = bodies[0][i];
+        const Body* b = bodies[1][i];
+        
+        same = same && a->position == b->position && a->velocity == b->velocity &&
+               a->stick.position == b->stick.position && a->stick.velocity == b->stick.velocity &&
+               a->stick.normal == b->stick.normal && a->stick.angularVelocity == b->stick.angularVelocity;
+    }
+    
+    destory(&bodies[0]);
+    destory(&bodies[1]);
+    
+    return same;
+}
+
+int main() {
+    std::vector<BodyDef> defs;
+    
+    for(int i = 0; i != test_bodies; ++i)
+        defs.push_back(random_def());
+    
+    int wrong = 0;
+    
+    wrong += check(defs, false, 1);
+    wrong += check(defs, true, 1);
+    wrong += check(defs, true, 4);
+    
+    if(!repeats(defs, false) || !repeats(defs, true)) {
+        printf("results depend on the number of workers\n");
+        ++wrong;
+    }
+    
+    printf("avx2 %s, %d differences\n", cpu_has_avx2() ? "on" : "off", wrong);
+    
+    return wrong == 0 ? 0 : 1;
+}
@@ -0,0 +1,195 @@
+//
+//  NarrowphaseTest.cpp
+//  Evolution
+//
+//  Checks every kernel of Narrowphase against the scalar collide_* functions.
+//  Built on its own, from Evolution/:
+//
+//  g++ -std=gnu++14 -O2 -pthread -ICollision -Icommon Tests/NarrowphaseTest.cpp Collision/Narrowphase.cpp -o NarrowphaseTest
+//
+
+#include <cassert>
+#include <cstdio>
+#include "Narrowphase.hpp"
+#include "ThreadPool.h"
+
+/// pairs of each kind, not a multiple of 8 so the scalar tails run too
+#define test_pairs 1021
+
+struct Pair
+{
+    int kind;
+    
+    vec2 pA, nA;
+    float hA, rA;
+    
+    vec2 pB, nB;
+    float hB, rB;
+};
+
+static std::mt19937 engine(7);
+
+static float uniform(float a, float b) {
+    return std::uniform_real_distribution<float>(a, b)(engine);
+}
+
+static vec2 direction() {
+    float a = uniform(0.0f, 2.0f * M_PI);
+    return vec2(cosf(a), sinf(a));
+}
+
+static Pair random_pair(int kind) {
+    Pair p;
+    p.kind = kind;
+    p.pA = vec2(uniform(-4.0f, 4.0f), uniform(-4.0f, 4.0f));
+    p.pB = p.pA + vec2(uniform(-3.0f, 3.0f), uniform(-3.0f, 3.0f));
+    p.nA = direction();
+    p.nB = direction();
+    p.hA = kind == Narrowphase::e_capsules ? uniform(0.1f, 1.5f) : 0.0f;
+    p.hB = kind != Narrowphase::e_circles ? uniform(0.1f, 1.5f) : 0.0f;
+    p.rA = uniform(0.1f, 1.0f);
+    p.rB = uniform(0.1f, 1.0f);
+    return p;
+}
+
+/// shapes on top of each other, parallel sticks and pairs right at the edge
+static std::vector<Pair> edge_pairs() {
+    std::vector<Pair> pairs;
+    
+    for(int kind = 0; kind != 3; ++kind) {
+        Pair p = random_pair(kind);
+        p.pB = p.pA;
+        pairs.push_back(p);
+        
+        p = random_pair(kind);
+        p.nB = p.nA;
+        p.pB = p.pA + 0.5f * p.nA;
+        pairs.push_back(p);
+        
+        p = random_pair(kind);
+        p.nB = -p.nA;
+        p.pB = p.pA + 0.3f * p.nA.I();
+        pairs.push_back(p);
+        
+        p = random_pair(kind);
+        p.pB = p.pA + (p.rA + p.rB + p.hA + p.hB) * direction();
+        pairs.push_back(p);
+    }
+    
+    /// a circle sitting right on the segment of a capsule
+    Pair p = random_pair(Narrowphase::e_circleCapsule);
+    p.pA = p.pB + 0.5f * p.hB * p.nB.I();
+    pairs.push_back(p);
+    
+    return pairs;
+}
+
+static void add(Narrowphase* narrowphase, const Pair& p) {
+    switch(p.kind) {
+        case Narrowphase::e_circles:
+            narrowphase->addCircles(p.pA, p.rA, p.pB, p.rB);
+            break;
+        case Narrowphase::e_circleCapsule:
+            narrowphase->addCircleCapsule(p.pA, p.rA, p.pB, p.nB, p.hB, p.rB);
+            break;
+        default:
+            narrowphase->addCapsules(p.pA, p.nA, p.hA, p.rA, p.pB, p.nB, p.hB, p.rB);
+    }
+}
+
+/// what the collide_* functions give for `p`, `max_contact_points` points
+static void reference(const Pair& p, ContactPoint* out) {
+    out[1].depth = 0.0f;
+    
+    switch(p.kind) {
+        case Narrowphase::e_circles:
+            collide_circles(p.pA, p.rA, p.pB, p.rB, out);
+            break;
+        case Narrowphase::e_circleCapsule:
+            collide_circle_capsule(p.pA, p.rA, p.pB, p.nB, p.hB, p.rB, out);
+            break;
+        default:
+            collide_capsules(p.pA, p.nA, p.hA, p.rA, p.pB, p.nB, p.hB, p.rB, out);
+    }
+}
+
+/// the same point within `narrowphase_tolerance`, or no point in both
+static bool same(const ContactPoint& a, const ContactPoint& b) {
+    float tolerance = narrowphase_tolerance;
+    
+    if((a.depth > 0.0f) != (b.depth > 0.0f))
+        return std::max(a.depth, b.depth) <= tolerance;
+    
+    if(a.depth <= 0.0f)
+        return true;
+    
+    return fabsf(a.depth - b.depth) <= tolerance &&
+           fabsf(a.normal.x - b.normal.x) <= tolerance &&
+           fabsf(a.normal.y - b.normal.y) <= tolerance &&
+           fabsf(a.point.x - b.point.x) <= tolerance * std::max(1.0f, fabsf(b.point.x)) &&
+           fabsf(a.point.y - b.point.y) <= tolerance * std::max(1.0f, fabsf(b.point.y));
+}
+
+/// runs `pairs` through `collide` and returns how many points differ from the reference
+static int check(const std::vector<Pair>& pairs, bool vectorKernels, int workers) {
+    ThreadPool pool(workers);
+    
+    Narrowphase narrowphase;
+    narrowphase.vectorKernels = vectorKernels;
+    
+    for(const Pair& p : pairs)
+        add(&narrowphase, p);
+    
+    narrowphase.collide(&pool);
+    
+    assert(narrowphase.size() == (int)pairs.size());
+    
+    if(!narrowphase.validate(narrowphase_tolerance)) {
+        printf("validate failed\n");
+        return 1;
+    }
+    
+    int wrong = 0;
+    int hits = 0;
+    
+    ContactPoint expected[max_contact_points];
+    
+    for(int i = 0; i != narrowphase.size(); ++i) {
+        reference(pairs[i], expected);
+        
+        for(int k = 0; k != max_contact_points; ++k) {
+            ContactPoint point = narrowphase.getPoint(i, k);
+            
+            if(expected[k].depth > 0.0f)
+                ++hits;
+            
+            if(!same(point, expected[k])) {
+                printf("pair %d, kind %d, point %d: depth %f normal (%f %f), expected depth %f normal (%f %f)\n", i, pairs[i].kind, k, point.depth, point.normal.x, point.normal.y, expected[k].depth, expected[k].normal.x, expected[k].normal.y);
+                ++wrong;
+            }
+        }
+    }
+    
+    /// random pairs that all miss would check nothing
+    assert(hits > (int)pairs.size() / 8);
+    
+    return wrong;
+}
+
+int main() {
+    std::vector<Pair> pairs = edge_pairs();
+    
+    /// kinds mixed, so entries and pair indices differ
+    for(int i = 0; i != 3 * test_pairs; ++i)
+        pairs.push_back(random_pair(i % 3));
+    
+    int wrong = 0;
+    
+    wrong += check(pairs, false, 1);
+    wrong += check(pairs, true, 1);
+    wrong += check(pairs, true, 4);
+    
+    printf("avx2 %s, %d points differ\n", cpu_has_avx2() ? "on" : "off", wrong);
+    
+    return wrong == 0 ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+//
+//  ShardTest.cpp
+//  Evolution
+//
+//  Runs three shards in their own processes, over shared memory and over sockets,
+//  and checks that bodies move between them and stay in their own slab, while they are reordered in memory.
+//  Built on its own, from Evolution/:
+//
+//  g++ -std=gnu++14 -O2 -pthread $(for d in $(find . -type d -not -path '*/glsl*'); do echo -n "-I$d "; done) Tests/ShardTest.cpp $(find . -name '*.cpp' -not -name main.cpp -not -path '*/Tests/*') -o ShardTest -lrt
+//
+
+#include <cstdio>
+#include <stdexcept>
+#include <sys/mman.h>
+#include "Shard.hpp"
+
+#define test_shards 3
+
+#define test_bodies 150
+
+#define test_steps 200
+
+#define test_dt 0.016f
+
+/// reaches the ghosts, which bodies may target too
+struct TestShard : Shard
+{
+    using Shard::Shard;
+    
+    /// a body of this shard or a ghost, not one that moved away
+    bool holds(const Body* target) const {
+        return std::find(bodies.begin(), bodies.end(), target) != bodies.end() ||
+               std::find(ghosts.begin(), ghosts.end(), target) != ghosts.end();
+    }
+};
+
+/// what each rank reports back, in memory shared with the parent
+struct Report
+{
+    int sent;
+    int received;
+    int bodies;
+};
+
+/// prints the first failure of a rank, which keeps stepping so its neighbors don't wait for it
+static void fail(int rank, int step, const char* what, int* failures) {
+    if(*failures == 0)
+        fprintf(stderr, "rank %d, step %d: %s\n", rank, step, what);
+    
+    ++*failures;
+}
+
+static void run(Transport* transport, Report* reports) {
+    int rank = transport->getRank();
+    
+    seed_random(17 + rank);
+    
+    TestShard shard(transport, 240.0f, 60.0f, 512);
+    shard.targetCache = true;
+    shard.reorderInterval = 10;
+    
+    /// fast along x, so many bodies cross an edge
+    std::mt19937 engine(rank + 1);
+    std::uniform_real_distribution<float> x(shard.getLower(), shard.getUpper());
+    std::uniform_real_distribution<float> y(-30.0f, 30.0f);
+    std::uniform_real_distribution<float> speed(-60.0f, 60.0f);
+    
+    for(int i = 0; i != test_bodies; ++i) {
+        BodyDef def;
+        def.position = vec2(x(engine), y(engine));
+        def.velocity = vec2(speed(engine), 0.0f);
+        shard.createBody(&def)->brain = shard.takeBrain();
+    }
+    
+    int failures = 0;
+    
+    if(shard.size() == 0)
+        fail(rank, 0, "no bodies", &failures);
+    
+    for(int step = 0; step != test_steps; ++step) {
+        shard.step(test_dt, 4);
+        
+        for(auto it = shard.begin(); it != shard.end(); ++it) {
+            const Body* body = *it;
+            
+            bool outside = (transport->hasNeighbor(Transport::e_left) && body->position.x < shard.getLower()) ||
+                           (transport->hasNeighbor(Transport::e_right) && body->position.x >= shard.getUpper());
+            
+            if(outside)
+                fail(rank, step, "a body outside of the slab", &failures);
+            
+            if(body->health <= 0.0f)
+                fail(rank, step, "a dead body", &failures);
+            
+            if(body->brain == NULL)
+                fail(rank, step, "a body without a brain", &failures);
+            
+            if(body->target != NULL && !shard.holds(body->target))
+                fail(rank, step, "a target that left the shard", &failures);
+        }
+    }
+    
+    reports[rank].sent = shard.getSent();
+    reports[rank].received = shard.getReceived();
+    reports[rank].bodies = (int)shard.size();
+    
+    if(failures != 0)
+        throw std::runtime_error("failed");
+}
+
+static int check(int type) {
+    Report* reports = (Report*)mmap(NULL, test_shards * sizeof(Report), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(reports != MAP_FAILED);
+    memset(reports, 0, test_shards * sizeof(Report));
+    
+    int failed = run_shards(test_shards, type, [reports] (Transport* transport) {
+        run(transport, reports);
+    });
+    
+    int sent = 0;
+    int received = 0;
+    
+    for(int rank = 0; rank != test_shards; ++rank) {
+        printf("%s rank %d: %d bodies, sent %d, received %d\n", type == Transport::e_shm ? "shm" : "socket", rank, reports[rank].bodies, reports[rank].sent, reports[rank].received);
+        sent += reports[rank].sent;
+        received += reports[rank].received;
+    }
+    
+    munmap(reports, test_shards * sizeof(Report));
+    
+    int wrong = failed;
+    
+    /// every body sent arrived once, and some were sent at all
+    if(sent != received || sent == 0) {
+        printf("sent %d, received %d\n", sent, received);
+        ++wrong;
+    }
+    
+    return wrong;
+}
+
+int main() {
+    int wrong = 0;
+    
+    wrong += check(Transport::e_shm);
+    wrong += check(Transport::e_socket);
+    
+    printf("%d failures\n", wrong);
+    
+    return wrong == 0 ? 0 : 1;
+}
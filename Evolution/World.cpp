@@ -8,177 +8,1292 @@
 
 #include "World.hpp"
 
+Body* World::allocateBody(const BodyDef* def) {
+    Body* body = bodyPool.allocate(def);
+    body->id = nextId++;
+    body->stick.id = nextId++;
+    
+    created.push_back(body->position);
+    
+    /// a negative group per body drops the pairs of a body and its own stick
+    if(body->filter.group == 0) {
+        body->filter.group = -(int)(body->id / 2) - 1;
+        body->stick.filter.group = body->filter.group;
+    }
+    
+    return body;
+}
+
+void World::createProxies(Body* const* list, int n) {
+    std::vector<AABB> aabbs(2 * n);
+    std::vector<void*> data(2 * n);
+    std::vector<Filter> filters(2 * n);
+    std::vector<int> proxyIds(2 * n);
+    
+    for(int i = 0; i != n; ++i) {
+        aabbs[2 * i] = list[i]->aabb();
+        aabbs[2 * i + 1] = list[i]->stick.aabb();
+        data[2 * i] = list[i];
+        data[2 * i + 1] = &list[i]->stick;
+        filters[2 * i] = list[i]->filter;
+        filters[2 * i + 1] = list[i]->stick.filter;
+    }
+    
+    broadphase.createProxies(2 * n, aabbs.data(), data.data(), filters.data(), proxyIds.data(), &pool);
+    
+    for(int i = 0; i != n; ++i) {
+        list[i]->node = proxyIds[2 * i];
+        list[i]->stick.node = proxyIds[2 * i + 1];
+    }
+}
+
 Body* World::createBody(const BodyDef* def) {
-    Body* body = new Body(def);
-    body->node = tree.createProxy(body->aabb(), body);
-    body->stick.node = tree.createProxy(body->stick.aabb(), &body->stick);
+    Body* body = allocateBody(def);
+    body->node = broadphase.createProxy(body->aabb(), body, body->filter);
+    body->stick.node = broadphase.createProxy(body->stick.aabb(), &body->stick, body->stick.filter);
     bodies.push_back(body);
     return body;
 }
 
+void World::setBroadphase(int type) {
+    if(type == broadphase.getType())
+        return;
+    
+    for(Body* body : bodies) {
+        broadphase.destoryProxy(body->node);
+        broadphase.destoryProxy(body->stick.node);
+    }
+    
+    broadphase.setType(type);
+    
+    array.assign(bodies.begin(), bodies.end());
+    createProxies(array.data(), (int)array.size());
+    
+    /// proxy ids changed
+    used.clear();
+}
+
+/// place of `body` in `places`, sorted by address, or -1 for a body that isn't there
+static int place_of(const std::vector<std::pair<const Body*, int>>& places, const Body* body) {
+    std::vector<std::pair<const Body*, int>>::const_iterator it = std::lower_bound(places.begin(), places.end(), std::make_pair(body, -1));
+    return it != places.end() && it->first == body ? it->second : -1;
+}
+
+/// bytes between two bodies, or two brains
+static inline float bytes_between(const void* a, const void* b) {
+    return fabsf((float)((intptr_t)a - (intptr_t)b));
+}
+
+void World::reorder() {
+    reordered = steps;
+    
+    int n = (int)bodies.size();
+    
+    if(n == 0)
+        return;
+    
+    /// the bodies in z-order, ties stay in list order
+    std::vector<uint32_t> keys(n), tempKeys(n);
+    std::vector<Body*> order(bodies.begin(), bodies.end()), tempOrder(n);
+    
+    for(int i = 0; i != n; ++i)
+        keys[i] = morton_code(order[i]->position, aabb);
+    
+    radix_sort(keys.data(), order.data(), n, tempKeys.data(), tempOrder.data());
+    
+    /// place of every body in the new order, by its old address
+    std::vector<std::pair<const Body*, int>> places(n);
+    
+    for(int i = 0; i != n; ++i)
+        places[i] = std::make_pair(order[i], i);
+    
+    std::sort(places.begin(), places.end());
+    
+    locality.pairs = 0;
+    locality.bodiesBefore = locality.bodiesAfter = 0.0f;
+    locality.brainsBefore = locality.brainsAfter = 0.0f;
+    locality.leavesBefore = locality.leavesAfter = 0.0f;
+    
+    /// the place of the target of each body, -1 for none, a ghost of a shard, or a body of another world
+    std::vector<int> targets(n);
+    
+    for(int i = 0; i != n; ++i) {
+        const Body* body = order[i];
+        const Body* target = body->target;
+        
+        targets[i] = target != NULL ? place_of(places, target) : -1;
+        
+        if(targets[i] < 0)
+            continue;
+        
+        ++locality.pairs;
+        locality.bodiesBefore += bytes_between(target, body);
+        locality.brainsBefore += bytes_between(target->brain, body->brain);
+        locality.leavesBefore += abs(target->node - body->node);
+    }
+    
+    bodyPool.permute(&order);
+    
+    std::vector<Brain*> brains(n);
+    
+    for(int i = 0; i != n; ++i)
+        brains[i] = order[i]->brain;
+    
+    bs.relocate(&brains);
+    
+    for(int i = 0; i != n; ++i) {
+        Body* body = order[i];
+        
+        body->brain = brains[i];
+        body->stick.owner = body;
+        
+        if(targets[i] >= 0)
+            body->target = order[targets[i]];
+        
+        broadphase.setProxyData(body->node, body);
+        broadphase.setProxyData(body->stick.node, &body->stick);
+    }
+    
+    int index = 0;
+    for(Body*& body : bodies)
+        body = order[index++];
+    
+    std::vector<int> proxyIds(2 * n);
+    for(int i = 0; i != n; ++i) {
+        proxyIds[2 * i] = order[i]->node;
+        proxyIds[2 * i + 1] = order[i]->stick.node;
+    }
+    
+    if(broadphase.reorderProxies(proxyIds.data(), 2 * n, &pool)) {
+        for(int i = 0; i != n; ++i) {
+            order[i]->node = 2 * i;
+            order[i]->stick.node = 2 * i + 1;
+        }
+    }
+    
+    for(int i = 0; i != n; ++i) {
+        if(targets[i] < 0)
+            continue;
+        
+        const Body* body = order[i];
+        const Body* target = body->target;
+        
+        locality.bodiesAfter += bytes_between(target, body);
+        locality.brainsAfter += bytes_between(target->brain, body->brain);
+        locality.leavesAfter += abs(target->node - body->node);
+    }
+    
+    if(locality.pairs != 0) {
+        float k = 1.0f / locality.pairs;
+        locality.bodiesBefore *= k;
+        locality.bodiesAfter *= k;
+        locality.brainsBefore *= k;
+        locality.brainsAfter *= k;
+        locality.leavesBefore *= k;
+        locality.leavesAfter *= k;
+    }
+    
+    ++locality.reorders;
+}
+
 void World::destoryBody(Body* body) {
     iterator_type begin = bodies.begin();
     iterator_type end = bodies.end();
     while(begin != end) {
         if((*begin) == body) {
+            if(!body->awake)
+                --sleeping;
+            
+            /// other bodies may still point to it
+            removed = true;
+            
             destoryBody(begin);
             return;
         }
+        
+        ++begin;
     }
 }
 
-void World::solveContacts(float dt) {
-    for(Contact& contact : contacts) {
-        Obj* obj1 = (Obj*)contact.obj1;
-        Obj* obj2 = (Obj*)contact.obj2;
-        
-        int type1 = obj1->type;
-        int type2 = obj2->type;
-        
-        if(type1 == Obj::e_body) {
-            if(type2 == Obj::e_body) {
-                solveBodyBody((Body*)obj1, (Body*)obj2, dt);
-            }else{
-                solveBodyStick((Body*)obj1, (Stick*)obj2, dt);
+void World::activate() {
+    array.clear();
+    
+    float moved = 0.0f;
+    
+    for(Body* body : bodies) {
+        moved = std::max(moved, (body->position - body->cache.last).lengthSq());
+        body->cache.last = body->position;
+        
+        if(!allowSleep) {
+            if(!body->awake) {
+                body->awake = true;
+                --sleeping;
             }
-        }else{
-            if(type2 == Obj::e_body) {
-                solveBodyStick((Body*)obj2, (Stick*)obj1, dt);
-            }else{
-                solveStickStick((Stick*)obj1, (Stick*)obj2, dt);
+            
+            body->stillSteps = 0;
+        }else if(body->awake) {
+            const Stick& stick = body->stick;
+            
+            float v2 = sleepVelocity * sleepVelocity;
+            
+            bool still = body->target == NULL && !body->touched && body->velocity.lengthSq() < v2 && stick.velocity.lengthSq() < v2 && fabs(stick.angularVelocity) < sleepAngularVelocity;
+            
+            body->stillSteps = still ? body->stillSteps + 1 : 0;
+            
+            if(body->stillSteps >= sleepSteps)
+                sleep(body);
+        }
+        
+        body->touched = false;
+        
+        if(body->awake)
+            array.push_back(body);
+    }
+    
+    travel += sqrtf(moved);
+}
+
+void World::senseTarget(Body* body, int worker) {
+    TargetFilter filter;
+    filter.self = body;
+    
+    void* nearest[2];
+    float lengthSqs[2];
+    
+    float reach = targetRadius + targetMargin;
+    int found = broadphase.queryNearest(&filter, body->position, reach, 2, nearest, lengthSqs, &heaps[worker], &stacks[worker]);
+    
+    TargetCache& cache = body->cache;
+    cache.position = body->position;
+    cache.travel = travel;
+    cache.valid = true;
+    cache.distance = found != 0 ? sqrtf(lengthSqs[0]) : reach;
+    
+    if(found != 0 && lengthSqs[0] < targetRadius * targetRadius) {
+        body->target = (Body*)nearest[0];
+        cache.targetPosition = body->target->position;
+        cache.gap = (found > 1 ? sqrtf(lengthSqs[1]) : reach) - cache.distance;
+    }else{
+        body->target = NULL;
+        cache.gap = cache.distance - targetRadius;
+    }
+}
+
+void World::cachedInputs() {
+    ++frame;
+    
+    if(removed) {
+        for(Body* body : bodies)
+            body->cache.valid = false;
+        
+        removed = false;
+    }
+    
+    /// a new body could be nearer than the target of anything around it
+    /// a body only keeps its target while it moved less than half of `targetMargin`
+    CacheEraser eraser;
+    vec2 ext = vec2(targetRadius + 2.0f * targetMargin, targetRadius + 2.0f * targetMargin);
+    
+    for(const vec2& p : created)
+        broadphase.query(&eraser, AABB(p - ext, p + ext), &stacks[0]);
+    
+    created.clear();
+    
+    queries.assign(pool.size(), 0);
+    
+    pool.parallel_for((int)array.size(), [this] (int begin, int end, int worker) {
+        for(int i = begin; i != end; ++i) {
+            Body* body = array[i];
+            
+            if(!keepTarget(body)) {
+                senseTarget(body, worker);
+                ++queries[worker];
             }
+            
+            body->setInputs(aabb);
         }
+    });
+}
+
+void World::activeContacts() {
+    int n = (int)array.size();
+    
+    pairs.resize(pool.size());
+    stacks.resize(pool.size());
+    
+    for(Body* body : array)
+        body->collecting = true;
+    
+    pool.parallel_for(n, [this] (int begin, int end, int worker) {
+        pairs[worker].clear();
+        
+        PairCollector collector;
+        collector.list = &pairs[worker];
+        
+        for(int i = begin; i != end; ++i) {
+            Body* body = array[i];
+            
+            collector.self = body;
+            broadphase.query(&collector, broadphase.getFatAABB(body->node), &stacks[worker]);
+            
+            collector.self = &body->stick;
+            broadphase.query(&collector, broadphase.getFatAABB(body->stick.node), &stacks[worker]);
+        }
+    });
+    
+    for(Body* body : array)
+        body->collecting = false;
+    
+    /// chunks follow `array`, so the result does not depend on the worker count
+    for(std::vector<Contact>& list : pairs)
+        contacts.insert(contacts.end(), list.begin(), list.end());
+}
+
+void World::dropSleepingContacts() {
+    int size = (int)contacts.size();
+    int count = 0;
+    
+    for(int i = 0; i != size; ++i) {
+        if(bodyOf(contacts[i].obj1)->awake || bodyOf(contacts[i].obj2)->awake)
+            contacts[count++] = contacts[i];
     }
+    
+    contacts.resize(count);
 }
 
-void World::solveBodyBody(Body *A, Body *B, float dt) {    
-    solveCircleCircle(A, B, A->position, B->position, dt);
+void World::wakeContacts() {
+    int size = (int)contacts.size();
+    
+    for(int i = 0; i != size; ++i) {
+        if(depths[i] <= 0.0f)
+            continue;
+        
+        Body* A = bodyOf(contacts[i].obj1);
+        Body* B = bodyOf(contacts[i].obj2);
+        
+        if(!A->awake) wake(A);
+        if(!B->awake) wake(B);
+        
+        if(A != B)
+            A->touched = B->touched = true;
+    }
 }
 
-void World::solveBodyStick(Body *A, Stick *B, float dt) {
-    vec2 j = B->normal.I();
-    vec2 _l = vec2(B->length * 0.5f, 0.0f);
-    vec2 p1 = _l * j;
-    vec2 p2 = B->position - p1;
-    p1 += B->position;
+void World::wakeSensed() {
+    int n = (int)array.size();
+    
+    woken.resize(pool.size());
+    
+    vec2 ext = vec2(targetRadius, targetRadius);
+    
+    /// the boxes have the same size, so a body is in the box of a sleeping one when the sleeping one is in its box
+    pool.parallel_for(n, [this, &ext] (int begin, int end, int worker) {
+        woken[worker].clear();
+        
+        SleeperCollector collector;
+        collector.list = &woken[worker];
+        
+        for(int i = begin; i != end; ++i) {
+            vec2 p = array[i]->position;
+            collector.box = AABB(p - ext, p + ext);
+            broadphase.query(&collector, collector.box, &stacks[worker]);
+        }
+    });
+    
+    for(std::vector<Body*>& list : woken) {
+        for(Body* body : list) {
+            if(!body->awake)
+                wake(body);
+        }
+    }
+}
 
-    solveCircleLine(A, B, A->position, dt);
+void World::orderContact(int index) {
+    Contact& contact = contacts[index];
     
-    solveCircleCircle(A, B, A->position, p1, dt);
-    solveCircleCircle(A, B, A->position, p2, dt);
+    /// features are numbered from the object with the smaller id
+    if(((Obj*)contact.obj1)->id > ((Obj*)contact.obj2)->id)
+        std::swap(contact.obj1, contact.obj2);
+    
+    /// and bodies come before sticks
+    if(((Obj*)contact.obj1)->type == Obj::e_stick && ((Obj*)contact.obj2)->type == Obj::e_body)
+        std::swap(contact.obj1, contact.obj2);
 }
 
-void World::solveStickStick(Stick *A, Stick *B, float dt) {
-    vec2 j, _l;
+void World::collide() {
+    int size = (int)contacts.size();
+    
+    narrowphase.clear();
+    
+    for(int i = 0; i != size; ++i) {
+        orderContact(i);
+        
+        Obj* obj1 = (Obj*)contacts[i].obj1;
+        Obj* obj2 = (Obj*)contacts[i].obj2;
+        
+        if(obj2->type == Obj::e_body) {
+            narrowphase.addCircles(obj1->position, obj1->radius, obj2->position, obj2->radius);
+        }else if(obj1->type == Obj::e_body) {
+            Stick* B = (Stick*)obj2;
+            narrowphase.addCircleCapsule(obj1->position, obj1->radius, B->position, B->normal, 0.5f * B->length, B->radius);
+        }else{
+            Stick* A = (Stick*)obj1;
+            Stick* B = (Stick*)obj2;
+            narrowphase.addCapsules(A->position, A->normal, 0.5f * A->length, A->radius, B->position, B->normal, 0.5f * B->length, B->radius);
+        }
+    }
     
-    j = A->normal.I();
-    _l = vec2(A->length * 0.5f, 0.0f);
-    vec2 p1 = _l * j;
-    vec2 p2 = A->position - p1;
-    p1 += A->position;
+    narrowphase.collide(&pool);
     
-    j = B->normal.I();
-    _l = vec2(B->length * 0.5f, 0.0f);
-    vec2 p3 = _l * j;
-    vec2 p4 = B->position - p3;
-    p3 += B->position;
+    if(checkNarrowphase)
+        assert(narrowphase.validate(narrowphase_tolerance));
+}
 
-    solveCircleLine(A, B, p1, dt);
-    solveCircleLine(A, B, p2, dt);
+void World::solveContact(int index, float dt) {
+    if(positionBased) {
+        correctContact(index, dt);
+        return;
+    }
     
-    solveCircleLine(B, A, p3, dt);
-    solveCircleLine(B, A, p4, dt);
+    ContactImpulse* cached = warmStart ? &cache[slots[index]] : NULL;
     
-    solveCircleCircle(A, B, p1, p3, dt);
-    solveCircleCircle(A, B, p1, p4, dt);
+    if(batchedNarrowphase) {
+        /// ordered and collided already
+        ContactPoint points[max_contact_points];
+        
+        for(int k = 0; k != max_contact_points; ++k)
+            points[k] = narrowphase.getPoint(index, k);
+        
+        Obj* obj1 = (Obj*)contacts[index].obj1;
+        Obj* obj2 = (Obj*)contacts[index].obj2;
+        
+        depths[index] = depth_ratio(obj1, obj2, solvePoints(obj1, obj2, points, max_contact_points, dt, cached));
+        return;
+    }
+    
+    orderContact(index);
+    
+    Obj* obj1 = (Obj*)contacts[index].obj1;
+    Obj* obj2 = (Obj*)contacts[index].obj2;
+    
+    float depth;
+    
+    if(obj2->type == Obj::e_body) {
+        depth = solveBodyBody((Body*)obj1, (Body*)obj2, dt, cached);
+    }else if(obj1->type == Obj::e_body) {
+        depth = solveBodyStick((Body*)obj1, (Stick*)obj2, dt, cached);
+    }else{
+        depth = solveStickStick((Stick*)obj1, (Stick*)obj2, dt, cached);
+    }
     
-    solveCircleCircle(A, B, p2, p3, dt);
-    solveCircleCircle(A, B, p2, p4, dt);
+    depths[index] = depth_ratio(obj1, obj2, depth);
 }
 
-void World::solveCircleCircle(Obj *A, Obj *B, const vec2 &p1, const vec2 &p2, float dt) {
-    vec2 D = p2 - p1;
-    float M = D.lengthSq();
-    float t = A->radius + B->radius;
+void World::correctContact(int index, float dt) {
+    orderContact(index);
     
-    if(M < (t * t)) {
-        float total = A->mass() + B->mass();
+    Obj* obj1 = (Obj*)contacts[index].obj1;
+    Obj* obj2 = (Obj*)contacts[index].obj2;
+    
+    float depth;
+    
+    if(obj2->type == Obj::e_body) {
+        depth = correctBodyBody((Body*)obj1, (Body*)obj2, dt);
+    }else if(obj1->type == Obj::e_body) {
+        depth = correctBodyStick((Body*)obj1, (Stick*)obj2, dt);
+    }else{
+        depth = correctStickStick((Stick*)obj1, (Stick*)obj2, dt);
+    }
+    
+    /// the overlap before the first iteration, the later ones only see what is left of it
+    depths[index] = std::max(depths[index], depth_ratio(obj1, obj2, depth));
+}
+
+void World::solveTiles(float dt) {
+    const TiledBroadphase& tiles = broadphase.tiles;
+    
+    int size = (int)contacts.size();
+    int n = tiles.getTileCount();
+    
+    /// contacts of two objects of the same tile go to it, the others to `n`
+    colors.resize(size);
+    batchStart.assign(n + 2, 0);
+    
+    for(int i = 0; i != size; ++i) {
+        int a = tiles.getOwner(((Obj*)contacts[i].obj1)->node);
+        int b = tiles.getOwner(((Obj*)contacts[i].obj2)->node);
+        colors[i] = a == b ? a : n;
+        ++batchStart[colors[i] + 1];
+    }
+    
+    for(int t = 0; t != n + 1; ++t)
+        batchStart[t + 1] += batchStart[t];
+    
+    /// stable, contacts keep their order within a tile
+    batches.resize(size);
+    std::vector<int> fill(batchStart.begin(), batchStart.end() - 1);
+    for(int i = 0; i != size; ++i)
+        batches[fill[colors[i]]++] = i;
+    
+    /// an object is owned by one tile, so the tiles touch different objects
+    pool.parallel_for(n, [this, dt] (int begin, int end, int /* worker */) {
+        for(int i = batchStart[begin]; i != batchStart[end]; ++i)
+            solveContact(batches[i], dt);
+    });
+    
+    /// the boundary, in contact order
+    for(int i = batchStart[n]; i != batchStart[n + 1]; ++i)
+        solveContact(batches[i], dt);
+}
+
+float World::penetration() const {
+    float depth = 0.0f;
+    
+    for(float d : depths)
+        depth = std::max(depth, d);
+    
+    return depth;
+}
+
+void World::colorContacts() {
+    int size = (int)contacts.size();
+    
+    colors.resize(size);
+    
+    std::fill(used.begin(), used.end(), 0);
+    
+    int counts[overflow_color + 2] = {0};
+    
+    /// greedy coloring, each contact takes the lowest color neither object has
+    for(int i = 0; i != size; ++i) {
+        int node1 = ((Obj*)contacts[i].obj1)->node;
+        int node2 = ((Obj*)contacts[i].obj2)->node;
         
-        Manifold m(total, dt);
+        int top = std::max(node1, node2);
+        if(top >= (int)used.size())
+            used.resize(top + 1, 0);
         
-        M = D.length();
-        vec2 normal = D / M;
+        uint64_t mask = used[node1] | used[node2];
         
-        m.force = t - M;
+        int color = overflow_color;
+        if(mask != ~(uint64_t)0) {
+            color = __builtin_ctzll(~mask);
+            used[node1] |= (uint64_t)1 << color;
+            used[node2] |= (uint64_t)1 << color;
+        }
         
-        m.obj1 = A;
-        m.obj2 = B;
+        colors[i] = color;
+        ++counts[color + 1];
+    }
+    
+    /// counting sort by color keeps the contact order inside each color
+    batchStart.resize(overflow_color + 2);
+    batchStart[0] = 0;
+    for(int c = 1; c != overflow_color + 2; ++c)
+        batchStart[c] = batchStart[c - 1] + counts[c];
+    
+    std::vector<int> offsets(batchStart.begin(), batchStart.end() - 1);
+    
+    batches.resize(size);
+    for(int i = 0; i != size; ++i)
+        batches[offsets[colors[i]]++] = i;
+}
+
+void World::warmStartContacts() {
+    int size = (int)contacts.size();
+    
+    for(int i = 0; i != size; ++i) {
+        /// the features were numbered in this order
+        orderContact(i);
+        
+        Obj* obj1 = (Obj*)contacts[i].obj1;
+        Obj* obj2 = (Obj*)contacts[i].obj2;
         
-        m.normal = normal;
-        m.point = 0.5f * (p1 + p2);
+        const ContactImpulse& cached = cache[slots[i]];
         
-        m.solve();
+        for(int k = 0; k != max_contact_features; ++k) {
+            float I = cached.impulses[k];
+            
+            if(I <= 0.0f)
+                continue;
+            
+            vec2 point = obj1->position + cached.offsets[k];
+            obj1->push(point, -I * cached.normals[k]);
+            obj2->push(point, I * cached.normals[k]);
+        }
     }
 }
 
-void World::solveCircleLine(Obj* A, Stick* B, const vec2& p1, float dt) {
-    vec2 normal = B->normal;
+void World::solveContacts(float dt) {
+    int size = (int)contacts.size();
     
-    vec2 Q = normal.T().I();
+    depths.resize(size);
     
-    vec2 pT = p1 * Q;
-    vec2 bT = B->position * Q;
+    if(broadphase.getType() == Broadphase::e_tiles) {
+        solveTiles(dt);
+        return;
+    }
     
-    float r = A->radius + B->radius;
+    if(!parallelSolver) {
+        for(int i = 0; i != size; ++i)
+            solveContact(i, dt);
+        return;
+    }
     
-    float dy = fabs(bT.y - pT.y);
+    colorContacts();
     
-    if(dy < r) {
-        if(fabs(bT.x - pT.x) < B->length * 0.5f) {
-            float total = A->mass() + B->mass();
+    for(int c = 0; c != overflow_color; ++c) {
+        int begin = batchStart[c];
+        int count = batchStart[c + 1] - begin;
+        
+        if(count < min_parallel_batch) {
+            for(int i = 0; i != count; ++i)
+                solveContact(batches[begin + i], dt);
+        }else{
+            pool.parallel_for(count, [this, begin, dt] (int b, int e, int /* worker */) {
+                for(int i = b; i != e; ++i)
+                    solveContact(batches[begin + i], dt);
+            });
+        }
+    }
+    
+    /// the contacts left over are solved in order
+    for(int i = batchStart[overflow_color]; i != size; ++i)
+        solveContact(batches[i], dt);
+}
+
+/// the features of a pair are its contact points
+/// body vs body: 0
+/// body vs stick: 0
+/// stick vs stick: 0, and 1 when the sticks lie side by side
+float World::solvePoints(Obj* A, Obj* B, const ContactPoint* points, int n, float dt, ContactImpulse* cached) {
+    /// a pinned body has no part in the mass, the other one takes the whole push
+    bool pinnedA = bodyOf(A)->pinned;
+    bool pinnedB = bodyOf(B)->pinned;
+    
+    float totalMass = (pinnedA ? 0.0f : A->mass()) + (pinnedB ? 0.0f : B->mass());
+    float depth = 0.0f;
+    
+    for(int k = 0; k != n; ++k) {
+        if(points[k].depth > 0.0f) {
+            depth = std::max(depth, points[k].depth);
+            solvePoint(A, B, points[k].normal, points[k].point, points[k].depth, totalMass, dt, cached, k);
+        }else if(cached != NULL && cached->impulses[k] > 0.0f) {
+            /// the point no longer touches, the push of `warmStartContacts` is taken back
+            float I = cached->impulses[k];
+            vec2 point = A->position + cached->offsets[k];
             
-            Manifold m(total, dt);
+            if(!pinnedA) A->push(point, I * cached->normals[k]);
+            if(!pinnedB) B->push(point, -I * cached->normals[k]);
+            
+            cached->impulses[k] = 0.0f;
+        }
+    }
+    
+    return depth;
+}
+
+void World::solvePoint(Obj* A, Obj* B, const vec2& normal, const vec2& point, float depth, float totalMass, float dt, ContactImpulse* cached, int feature) {
+    Manifold m(totalMass, dt, cached, feature);
+    
+    m.obj1 = A;
+    m.obj2 = B;
+    
+    m.normal = normal;
+    m.point = point;
+    m.force = depth;
+    
+    m.pinned1 = bodyOf(A)->pinned;
+    m.pinned2 = bodyOf(B)->pinned;
+    
+    m.solve();
+}
+
+float World::solveBodyBody(Body *A, Body *B, float dt, ContactImpulse* cached) {
+    ContactPoint point;
+    collide_circles(A->position, A->radius, B->position, B->radius, &point);
+    return solvePoints(A, B, &point, 1, dt, cached);
+}
+
+float World::solveBodyStick(Body *A, Stick *B, float dt, ContactImpulse* cached) {
+    ContactPoint point;
+    collide_circle_capsule(A->position, A->radius, B->position, B->normal, 0.5f * B->length, B->radius, &point);
+    return solvePoints(A, B, &point, 1, dt, cached);
+}
+
+float World::solveStickStick(Stick *A, Stick *B, float dt, ContactImpulse* cached) {
+    ContactPoint points[max_contact_points];
+    collide_capsules(A->position, A->normal, 0.5f * A->length, A->radius, B->position, B->normal, 0.5f * B->length, B->radius, points);
+    return solvePoints(A, B, points, max_contact_points, dt, cached);
+}
+
+float World::solveBodies(Body* A, Body* B, float dt) {
+    Stick* As = &A->stick;
+    Stick* Bs = &B->stick;
+    
+    AABB bA = A->aabb();
+    AABB bB = B->aabb();
+    AABB bAs = As->aabb();
+    AABB bBs = Bs->aabb();
+    
+    float depth = 0.0f;
+    
+    if(touches(bA, bB) && should_collide(A->filter, B->filter)) depth = std::max(depth, depth_ratio(A, B, solveBodyBody(A, B, dt)));
+    if(touches(bA, bBs) && should_collide(A->filter, Bs->filter)) depth = std::max(depth, depth_ratio(A, Bs, solveBodyStick(A, Bs, dt)));
+    if(touches(bB, bAs) && should_collide(B->filter, As->filter)) depth = std::max(depth, depth_ratio(B, As, solveBodyStick(B, As, dt)));
+    if(touches(bAs, bBs) && should_collide(As->filter, Bs->filter)) depth = std::max(depth, depth_ratio(As, Bs, solveStickStick(As, Bs, dt)));
+    
+    return depth;
+}
+
+/// inverse mass of `obj` pushed at `point` along `normal`, a stick turns too
+/// sleeping and pinned bodies can't be pushed
+static inline float weight_of(const Obj* obj, const vec2& point, const vec2& normal) {
+    const Body* body = World::bodyOf((void*)obj);
+    
+    if(!body->awake || body->pinned)
+        return 0.0f;
+    
+    if(obj->type == Obj::e_body)
+        return obj->invMass();
+    
+    const Stick* stick = (const Stick*)obj;
+    vec2 r = point - stick->position;
+    float c = r.x * normal.y - r.y * normal.x;
+    return stick->invMass() + stick->invInertia() * c * c;
+}
+
+/// moves `obj` by `p` over its mass, pushed at `point`
+static inline void displace(Obj* obj, const vec2& point, const vec2& p, float dt) {
+    const Body* owner = World::bodyOf(obj);
+    
+    if(!owner->awake || owner->pinned)
+        return;
+    
+    if(obj->type == Obj::e_body) {
+        Body* body = (Body*)obj;
+        vec2 dx = body->invMass() * p;
+        body->position += dx;
+        body->health -= dx.length() / dt;
+        return;
+    }
+    
+    Stick* stick = (Stick*)obj;
+    vec2 r = point - stick->position;
+    float a = stick->invInertia() * (r.x * p.y - r.y * p.x);
+    stick->position += stick->invMass() * p;
+    stick->normal = stick->normal * vec2(cosf(a), sinf(a));
+}
+
+void World::correctPoint(Obj* A, Obj* B, const vec2& normal, const vec2& point, float depth, float dt) {
+    float w = weight_of(A, point, normal) + weight_of(B, point, normal);
+    
+    if(w <= 0.0f)
+        return;
+    
+    vec2 p = (depth / w) * normal;
+    displace(A, point, -p, dt);
+    displace(B, point, p, dt);
+}
+
+float World::correctBodyBody(Body* A, Body* B, float dt) {
+    ContactPoint point;
+    collide_circles(A->position, A->radius, B->position, B->radius, &point);
+    
+    if(point.depth > 0.0f)
+        correctPoint(A, B, point.normal, point.point, point.depth, dt);
+    
+    return point.depth;
+}
+
+float World::correctBodyStick(Body* A, Stick* B, float dt) {
+    ContactPoint point;
+    collide_circle_capsule(A->position, A->radius, B->position, B->normal, 0.5f * B->length, B->radius, &point);
+    
+    if(point.depth > 0.0f)
+        correctPoint(A, B, point.normal, point.point, point.depth, dt);
+    
+    return point.depth;
+}
+
+float World::correctStickStick(Stick* A, Stick* B, float dt) {
+    float depth = 0.0f;
+    
+    /// sticks side by side touch at two points, moving one end moves the other,
+    /// so they are collided again before each point
+    for(int k = 0; k != max_contact_points; ++k) {
+        ContactPoint points[max_contact_points];
+        collide_capsules(A->position, A->normal, 0.5f * A->length, A->radius, B->position, B->normal, 0.5f * B->length, B->radius, points);
+        
+        if(k == 0)
+            depth = std::max(points[0].depth, points[1].depth);
+        
+        if(points[k].depth > 0.0f)
+            correctPoint(A, B, points[k].normal, points[k].point, points[k].depth, dt);
+    }
+    
+    return depth;
+}
+
+float World::correctBodies(Body* A, Body* B, float dt) {
+    Stick* As = &A->stick;
+    Stick* Bs = &B->stick;
+    
+    float depth = 0.0f;
+    
+    if(touches(A->aabb(), B->aabb()) && should_collide(A->filter, B->filter)) depth = std::max(depth, depth_ratio(A, B, correctBodyBody(A, B, dt)));
+    if(touches(A->aabb(), Bs->aabb()) && should_collide(A->filter, Bs->filter)) depth = std::max(depth, depth_ratio(A, Bs, correctBodyStick(A, Bs, dt)));
+    if(touches(B->aabb(), As->aabb()) && should_collide(B->filter, As->filter)) depth = std::max(depth, depth_ratio(B, As, correctBodyStick(B, As, dt)));
+    if(touches(As->aabb(), Bs->aabb()) && should_collide(As->filter, Bs->filter)) depth = std::max(depth, depth_ratio(As, Bs, correctStickStick(As, Bs, dt)));
+    
+    return depth;
+}
+
+void World::correctArm(Body* body, float compliance, float* lambda, float dt) {
+    Stick& stick = body->stick;
+    
+    vec2 d = stick.position - body->position;
+    float length = d.length();
+    
+    float C = length - body->absArmLength();
+    float alpha = compliance * body->armCompliance() / (dt * dt);
+    
+    float dl = (-C - alpha * (*lambda)) / (stick.invMass() + alpha);
+    *lambda += dl;
+    
+    stick.position += (stick.invMass() * dl / length) * d;
+}
+
+Sweep World::sweepOf(const Obj* obj, const BodyState& state, float dt) {
+    Sweep sweep;
+    sweep.radius = obj->radius;
+    
+    if(obj->type == Obj::e_body) {
+        sweep.position = state.position;
+        sweep.normal = vec2(1.0f, 0.0f);
+        sweep.velocity = (obj->position - state.position) / dt;
+        sweep.angularVelocity = 0.0f;
+        sweep.h = 0.0f;
+        return sweep;
+    }
+    
+    const Stick* stick = (const Stick*)obj;
+    const vec2& n0 = state.stickNormal;
+    const vec2& n1 = stick->normal;
+    
+    sweep.position = state.stickPosition;
+    sweep.normal = n0;
+    sweep.velocity = (stick->position - state.stickPosition) / dt;
+    
+    /// a stick turns less than `max_rotation` in a step, so the angle between the normals is the turn
+    sweep.angularVelocity = atan2f(n0.x * n1.y - n0.y * n1.x, dot(n0, n1)) / dt;
+    sweep.h = 0.5f * stick->length;
+    
+    return sweep;
+}
+
+float World::impactTime(const Body* A, const BodyState& a, const Body* B, const BodyState& b, float dt) {
+    const Obj* objectsA[2] = {A, &A->stick};
+    const Obj* objectsB[2] = {B, &B->stick};
+    
+    float t = dt;
+    
+    for(const Obj* objA : objectsA) {
+        Sweep sweepA = sweepOf(objA, a, dt);
+        
+        for(const Obj* objB : objectsB) {
+            if(should_collide(objA->filter, objB->filter))
+                t = std::min(t, time_of_impact(sweepA, sweepOf(objB, b, dt), t));
+        }
+    }
+    
+    return t;
+}
+
+void World::sweep(float dt) {
+    int n = (int)array.size();
+    
+    std::vector<int> fast;
+    
+    for(int i = 0; i != n; ++i) {
+        Body* body = array[i];
+        Sweep stick = sweepOf(&body->stick, states[i], dt);
+        
+        float moved = (body->position - states[i].position).length() / body->radius;
+        float stickMoved = dt * (stick.velocity.length() + fabs(stick.angularVelocity) * stick.h) / stick.radius;
+        
+        if(std::max(moved, stickMoved) > ccd.threshold)
+            fast.push_back(i);
+    }
+    
+    if(fast.empty())
+        return;
+    
+    sweptBodies += (int)fast.size();
+    
+    places.resize(n);
+    for(int i = 0; i != n; ++i)
+        places[i] = std::make_pair(array[i], i);
+    
+    std::sort(places.begin(), places.end());
+    
+    swept.clear();
+    
+    std::vector<Body*> found;
+    std::vector<int>& stack = stacks[0];
+    
+    for(int i : fast) {
+        Body* body = array[i];
+        
+        found.clear();
+        
+        BodyCollector collector;
+        collector.self = body;
+        collector.list = &found;
+        
+        /// everything the body or its stick passed, turning included
+        for(const Obj* obj : {(const Obj*)body, (const Obj*)&body->stick}) {
+            Sweep s = sweepOf(obj, states[i], dt);
+            vec2 end = s.positionAt(dt);
+            vec2 ext = vec2(s.h + s.radius, s.h + s.radius);
+            broadphase.query(&collector, AABB(min(s.position, end) - ext, max(s.position, end) + ext), &stack);
+        }
+        
+        for(Body* other : found)
+            swept.push_back(body->id < other->id ? std::make_pair(body, other) : std::make_pair(other, body));
+    }
+    
+    std::sort(swept.begin(), swept.end(), [] (const std::pair<Body*, Body*>& a, const std::pair<Body*, Body*>& b) {
+        return a.first->id < b.first->id || (a.first->id == b.first->id && a.second->id < b.second->id);
+    });
+    
+    swept.erase(std::unique(swept.begin(), swept.end()), swept.end());
+    
+    /// bodies that step again, by id
+    std::vector<Body*> hit;
+    
+    for(const std::pair<Body*, Body*>& pair : swept) {
+        Body* A = pair.first;
+        Body* B = pair.second;
+        
+        int a = placeOf(A);
+        int b = placeOf(B);
+        
+        /// a body that isn't in `array` stays where it is, a sleeping one or a ghost
+        BodyState stillA, stillB;
+        if(a < 0) stillA.save(A);
+        if(b < 0) stillB.save(B);
+        
+        if(impactTime(A, a < 0 ? stillA : states[a], B, b < 0 ? stillB : states[b], dt) >= dt)
+            continue;
+        
+        ++impacts;
+        
+        for(Body* body : {A, B}) {
+            /// sleeping bodies wake up, ghosts don't move
+            if(placeOf(body) < 0) {
+                if(body->awake) continue;
+                wake(body);
+                
+                BodyState state;
+                state.save(body);
+                states.push_back(state);
+                places.insert(std::lower_bound(places.begin(), places.end(), std::make_pair(body, -1)), std::make_pair(body, (int)array.size() - 1));
+            }
             
-            m.obj1 = A;
-            m.obj2 = B;
+            hit.push_back(body);
+        }
+    }
+    
+    if(hit.empty())
+        return;
+    
+    std::sort(hit.begin(), hit.end(), [] (const Body* a, const Body* b) {
+        return a->id < b->id;
+    });
+    
+    hit.erase(std::unique(hit.begin(), hit.end()), hit.end());
+    
+    std::vector<char> stepping(array.size(), 0);
+    
+    float rate = 0.0f;
+    
+    for(Body* body : hit) {
+        int i = placeOf(body);
+        states[i].restore(body);
+        stepping[i] = 1;
+        body->touched = true;
+        rate = std::max(rate, SubstepScheduler::rate(body));
+    }
+    
+    /// the swept pairs of the bodies that step again, still in id order
+    /// their contacts were solved before they moved, and the states they go back to hold that
+    std::vector<std::pair<Body*, Body*>> pairs;
+    
+    /// the other body of a pair that doesn't step again is pinned while the others do
+    std::vector<Body*> pinned;
+    
+    auto steps = [&] (Body* body) {
+        int i = placeOf(body);
+        return i >= 0 && stepping[i] != 0;
+    };
+    
+    for(const std::pair<Body*, Body*>& pair : swept) {
+        bool first = steps(pair.first);
+        bool second = steps(pair.second);
+        
+        if(!first && !second)
+            continue;
+        
+        pairs.push_back(pair);
+        
+        if(!first) pinned.push_back(pair.first);
+        if(!second) pinned.push_back(pair.second);
+    }
+    
+    for(Body* body : pinned)
+        body->pinned = true;
+    
+    int k = std::max(2, ccd.count(dt, rate));
+    toiSubsteps = std::max(toiSubsteps, k);
+    
+    float h = dt / k;
+    
+    /// with the position solver, each piece is a substep of it over the bodies that step again
+    int m = (int)hit.size();
+    
+    std::vector<BodyState> pieces(m);
+    std::vector<float> arms(m);
+    
+    for(int j = 0; j != k; ++j) {
+        if(!positionBased) {
+            for(const std::pair<Body*, Body*>& pair : pairs)
+                solveBodies(pair.first, pair.second, h);
             
-            vec2 n, p;
-            vec2 QT = Q.T();
+            for(Body* body : hit)
+                body->step(h, maxTranslation());
             
-            float depth = r - dy;
+            continue;
+        }
+        
+        for(int i = 0; i != m; ++i) {
+            pieces[i].save(hit[i]);
+            hit[i]->predict(h, maxTranslation());
+            arms[i] = 0.0f;
+        }
+        
+        for(int it = 0; it != xpbd.iterations; ++it) {
+            for(int i = 0; i != m; ++i)
+                correctArm(hit[i], xpbd.armCompliance, &arms[i], h);
             
-            if(pT.y > bT.y) {
-                n = vec2(0.0f, -1.0f);
-                p = vec2(pT.x, bT.y + B->radius);
-            }else{
-                n = vec2(0.0f, 1.0f);
-                p = vec2(pT.x, bT.y - B->radius);
-            }
+            for(const std::pair<Body*, Body*>& pair : pairs)
+                correctBodies(pair.first, pair.second, h);
+        }
+        
+        for(int i = 0; i != m; ++i)
+            pieces[i].derive(hit[i], h);
+    }
+    
+    for(Body* body : pinned)
+        body->pinned = false;
+}
+
+void World::relax(float dt) {
+    int n = (int)array.size();
+    
+    pool.parallel_for(n, [this, dt] (int begin, int end, int /* worker */) {
+        for(int i = begin; i != end; ++i)
+            array[i]->predict(dt, maxTranslation());
+    });
+    
+    lambdas.assign(n, 0.0f);
+    depths.assign(contacts.size(), 0.0f);
+    
+    for(int it = 0; it != xpbd.iterations; ++it) {
+        /// an arm moves only the stick of its own body
+        pool.parallel_for(n, [this, dt] (int begin, int end, int /* worker */) {
+            for(int i = begin; i != end; ++i)
+                correctArm(array[i], xpbd.armCompliance, &lambdas[i], dt);
+        });
+        
+        /// colored or tiled like the impulses, a contact moves only its own two objects
+        solveContacts(dt);
+    }
+    
+    pool.parallel_for(n, [this, dt] (int begin, int end, int /* worker */) {
+        for(int i = begin; i != end; ++i)
+            states[i].derive(array[i], dt);
+    });
+}
+
+void World::splitLod(float dt) {
+    int n = (int)array.size();
+    
+    float speed = 0.0f;
+    for(Body* body : array)
+        speed = std::max(speed, std::max(body->velocity.length(), body->stick.velocity.length()));
+    
+    /// proxies of coarse bodies can be `lodSlack` behind
+    float reach = lodRadius * targetRadius + 2.0f * dt * speed + lodSlack;
+    vec2 ext = vec2(reach, reach);
+    
+    /// bodies that drifted last frame and step fully again from this one
+    std::vector<char> promoted(n);
+    
+    pool.parallel_for(n, [this, &ext, &promoted] (int begin, int end, int worker) {
+        for(int i = begin; i != end; ++i) {
+            Body* body = array[i];
             
-            m.normal = n * QT;
-            m.point = p * QT;
-            m.force = depth;
+            NeighborFinder finder;
+            finder.self = body;
+            broadphase.query(&finder, AABB(body->position - ext, body->position + ext), &stacks[worker]);
             
-            m.solve();
+            promoted[i] = finder.found && body->isolatedSteps > lodSteps;
+            body->isolatedSteps = finder.found ? 0 : body->isolatedSteps + 1;
         }
+    });
+    
+    int count = 0;
+    
+    for(int i = 0; i != n; ++i) {
+        Body* body = array[i];
+        
+        /// its proxies are still where it last moved them while drifting
+        if(promoted[i]) {
+            vec2 moved = body->position - body->anchor;
+            broadphase.moveProxy(body->node, body->aabb(), moved);
+            broadphase.moveProxy(body->stick.node, body->stick.aabb(), moved);
+            body->anchor = body->position;
+        }
+        
+        if(body->isolatedSteps <= lodSteps) {
+            array[count++] = body;
+            continue;
+        }
+        
+        /// its proxies were moved in the last substep
+        if(body->isolatedSteps == lodSteps + 1)
+            body->anchor = body->position;
+        
+        coarse.push_back(body);
+    }
+    
+    array.resize(count);
+}
+
+void World::drift(float dt) {
+    /// as fast as a body of `array` may go over the substeps of the frame
+    float limit = substeps * maxTranslation();
+    
+    pool.parallel_for((int)coarse.size(), [this, dt, limit] (int begin, int end, int /* worker */) {
+        for(int i = begin; i != end; ++i) {
+            coarse[i]->drift(dt, limit);
+            coarse[i]->constrain(aabb);
+        }
+    });
+    
+    for(Body* body : coarse) {
+        vec2 moved = body->position - body->anchor;
+        
+        if(moved.lengthSq() <= lodSlack * lodSlack)
+            continue;
+        
+        broadphase.moveProxy(body->node, body->aabb(), moved);
+        broadphase.moveProxy(body->stick.node, body->stick.aabb(), moved);
+        body->anchor = body->position;
     }
 }
 
+void World::integrate(float dt) {
+    if(!batchedIntegrator) {
+        for(Body* body : array)
+            body->step(dt, maxTranslation());
+        
+        return;
+    }
+    
+    integrator.maxTranslation = maxTranslation();
+    integrator.gather(array.begin(), array.end(), dt);
+    integrator.integrate(&pool);
+    
+    if(checkIntegrator)
+        assert(integrator.validate(integrator_tolerance));
+    
+    integrator.scatter();
+}
+
 void World::step(float dt) {
     moveProxies(dt);
     
     getContacts();
     
-    solveContacts(dt);
-    
-    iterator_type begin = bodies.begin();
-    while(begin != bodies.end()) {
-        Body* body = *begin;
+    if(!positionBased) {
+        if(warmStart)
+            warmStartContacts();
+        
+        if(batchedNarrowphase)
+            collide();
         
-        body->step(dt);
+        solveContacts(dt);
+        
+        if(allowSleep)
+            wakeContacts();
+    }
+    
+    if(continuous || positionBased) {
+        states.resize(array.size());
+        for(int i = 0; i != (int)array.size(); ++i)
+            states[i].save(array[i]);
+    }
+    
+    if(positionBased) {
+        relax(dt);
+    }else{
+        integrate(dt);
+    }
+    
+    if(continuous)
+        sweep(dt);
+    
+    /// sleeping bodies are held still by the position solver, they wake once it is done
+    if(positionBased && allowSleep)
+        wakeContacts();
+    
+    bool dead = false;
+    
+    /// sleeping bodies don't move, and lose no health
+    for(Body* body : array) {
         body->constrain(aabb);
         
-        if(body->health <= 0.0f) {
+        if(body->health <= 0.0f)
+            dead = true;
+    }
+    
+    if(dead)
+        removeDead();
+}
+    
+void World::removeDead() {
+    /// nothing may point to the dead once they are gone, sleeping and coarse bodies neither
+    for(Body* body : bodies) {
+        if(body->target != NULL && body->target->health <= 0.0f) {
+            body->target = NULL;
+            body->cache.valid = false;
+        }
+    }
+    
+    array.erase(std::remove_if(array.begin(), array.end(), [] (Body* body) {
+        return body->health <= 0.0f;
+    }), array.end());
+    
+    /// a coarse body hit by a body of `array` is not drifted after it is gone
+    coarse.erase(std::remove_if(coarse.begin(), coarse.end(), [] (Body* body) {
+        return body->health <= 0.0f;
+    }), coarse.end());
+    
+    iterator_type begin = bodies.begin();
+    while(begin != bodies.end()) {
+        if((*begin)->health <= 0.0f) {
             iterator_type it = begin;
             ++begin;
             destoryBody(it);
@@ -10,9 +10,222 @@
 #define World_hpp
 
 #include "BodySystem.h"
+#include "ContactCache.h"
+#include "Broadphase.h"
+#include "Narrowphase.hpp"
+#include "Integrator.hpp"
+#include "BodyPool.h"
+#include "TimeOfImpact.hpp"
 
 #define impulse_pressure 0.2f
 
+#define world_threads 8
+
+/// cell size of the grid broadphase
+#define default_cell_size 4.0f
+
+/// smallest tile of the tiled broadphase, no box may be wider
+#define default_tile_size 32.0f
+
+/// color batches smaller than this are solved on the calling thread
+#define min_parallel_batch 64
+
+/// contacts that could not get one of the 64 colors
+#define overflow_color 64
+
+/// the tree is rebuilt once its area ratio grows this much since the last rebuild
+#define tree_rebuild_factor 1.5f
+
+/// adaptive substeps move nothing further than this fraction of its radius
+#define substep_courant 0.5f
+
+/// adaptive substeps are added while objects overlap by more than this fraction of their radius
+#define substep_penetration 0.1f
+
+/**
+ ** Picks the number of substeps of a frame, like a CFL condition.
+ ** Every object should move less than `courant` of its radius in a substep, and
+ ** a deep overlap means the last frame was too coarse.
+ **/
+
+struct SubstepScheduler
+{
+    int minSubsteps = 1;
+    int maxSubsteps = 16;
+    
+    float courant = substep_courant;
+    float penetration = substep_penetration;
+    
+    /// gets every count picked, if set
+    std::function<void(int)> hook;
+    
+    /// fastest speed of the body or its stick over their radius
+    /// the ends of the stick move with its spin too
+    static inline float rate(const Body* body) {
+        const Stick& stick = body->stick;
+        float v = body->velocity.length() / body->radius;
+        float s = (stick.velocity.length() + 0.5f * stick.length * fabs(stick.angularVelocity)) / stick.radius;
+        return std::max(v, s);
+    }
+    
+    /// `rate` of the fastest object, `depth` of the deepest overlap over the radius of the smaller object
+    inline int count(float dt, float rate, float depth) const {
+        float n = std::max(dt * rate / courant, depth / penetration);
+        int k = n < (float)maxSubsteps ? (int)ceilf(n) : maxSubsteps;
+        return std::max(minSubsteps, k);
+    }
+    
+    inline void report(int substeps) const {
+        if(hook) hook(substeps);
+    }
+};
+
+/// bodies slower than this are still
+/// a body drifting to the center under `body_center_force` alone stays under it
+#define sleep_velocity 2.0f
+
+/// sticks spinning slower than this are still
+#define sleep_angular_velocity 0.5f
+
+/// steps a body has to be still, without a target or a touch, before it sleeps
+#define sleep_steps 60
+
+/// sensing queries look this much past the target radius, so a cached target knows how far the next body is
+#define target_margin 2.0f
+
+/// steps between full sensing queries of a body with a cached target
+#define target_refresh 32
+
+/// objects moving more than this fraction of their own radius in a substep are swept, see `World::continuous`
+/// a body against its radius, a stick against the radius of its capsule, the ends of the stick turning included
+#define ccd_threshold 0.5f
+
+/// farthest anything moves in a substep with continuous collision, instead of `max_translation`
+#define ccd_max_translation 4.0f
+
+/// most pieces a substep of the pairs that would meet in it is split into
+#define max_toi_substeps 16
+
+/// bodies with nothing within this many `targetRadius` are stepped coarsely, see `World::physicsLod`
+/// past 1, so no body senses a coarse one
+#define lod_radius 2.0f
+
+/// frames a body has to be alone before it is stepped coarsely
+#define lod_steps 8
+
+/// a coarse body moves its proxies once it drifted this far from where they were
+#define lod_slack 1.0f
+
+/**
+ ** Settings of continuous collision.
+ ** Objects that move fast are swept against their neighbors with `time_of_impact`, and
+ ** the bodies of a pair that would meet within a substep step it again in smaller pieces,
+ ** so they can move much further than `max_translation` in one substep without tunneling.
+ **/
+
+struct ContinuousCollision
+{
+    float threshold = ccd_threshold;
+    
+    float maxTranslation = ccd_max_translation;
+    
+    int maxSubsteps = max_toi_substeps;
+    
+    /// pieces of a substep of `dt` in which nothing moves more than `threshold` of its radius
+    /// `rate` is SubstepScheduler::rate of the fastest body
+    inline int count(float dt, float rate) const {
+        float n = dt * rate / threshold;
+        int k = n < (float)maxSubsteps ? (int)ceilf(n) : maxSubsteps;
+        return std::max(1, k);
+    }
+};
+
+/// solver iterations of a substep with `World::positionBased`
+#define xpbd_iterations 4
+
+/**
+ ** Settings of the position based solver, in the style of XPBD.
+ ** Bodies move first, then every overlap and the arm of every body are corrected as
+ ** positions, and the velocities are how far the bodies went. A correction never takes
+ ** out more than the overlap, unlike an impulse of `impulse_pressure/dt`, so large
+ ** substeps with few iterations stay stable.
+ **/
+
+struct PositionSolver
+{
+    int iterations = xpbd_iterations;
+    
+    /// scales Body::armCompliance, 1 is as stiff as the spring of Body::step
+    float armCompliance = 1.0f;
+};
+
+/// a body and its stick at the start of a substep, after the solver
+struct BodyState
+{
+    vec2 position;
+    vec2 velocity;
+    
+    vec2 stickPosition;
+    vec2 stickVelocity;
+    vec2 stickNormal;
+    
+    float stickAngularVelocity;
+    
+    inline void save(const Body* body) {
+        position = body->position;
+        velocity = body->velocity;
+        stickPosition = body->stick.position;
+        stickVelocity = body->stick.velocity;
+        stickNormal = body->stick.normal;
+        stickAngularVelocity = body->stick.angularVelocity;
+    }
+    
+    inline void restore(Body* body) const {
+        body->position = position;
+        body->velocity = velocity;
+        body->stick.position = stickPosition;
+        body->stick.velocity = stickVelocity;
+        body->stick.normal = stickNormal;
+        body->stick.angularVelocity = stickAngularVelocity;
+    }
+    
+    /// velocities of `body` from how far it went since the state, over `dt`
+    inline void derive(Body* body, float dt) const {
+        const vec2& n0 = stickNormal;
+        const vec2& n1 = body->stick.normal;
+        
+        body->velocity = (body->position - position) / dt;
+        body->stick.velocity = (body->stick.position - stickPosition) / dt;
+        body->stick.angularVelocity = atan2f(n0.x * n1.y - n0.y * n1.x, dot(n0, n1)) / dt;
+    }
+};
+
+/// how far bodies are from their targets, measured by `World::reorder`
+/// distances are in bytes, between the bodies and between their brains, and in tree nodes
+struct LocalityStats
+{
+    /// reorders so far
+    int reorders = 0;
+    
+    /// bodies with a target at the last reorder
+    int pairs = 0;
+    
+    /// mean distance of a body to its target right before and after the last reorder
+    float bodiesBefore = 0.0f;
+    float bodiesAfter = 0.0f;
+    
+    float brainsBefore = 0.0f;
+    float brainsAfter = 0.0f;
+    
+    float leavesBefore = 0.0f;
+    float leavesAfter = 0.0f;
+};
+
+/// overlap over the radius of the smaller object
+inline float depth_ratio(const Obj* A, const Obj* B, float depth) {
+    return depth / std::min(A->radius, B->radius);
+}
+
 struct Manifold
 {    
     Obj* obj1;
@@ -26,7 +239,16 @@ struct Manifold
     float impulse;
     float dt;
     
-    inline Manifold(float totalMass, float dt) : mass(totalMass), impulse(impulse_pressure/dt), dt(dt) {}
+    /// the impulses of the pair in the last substep, and which feature this is, see World::warmStart
+    /// NULL pushes with a penalty on the overlap instead
+    ContactImpulse* cached;
+    int feature;
+    
+    /// the object belongs to a pinned body and gets no impulse, see Body::pinned
+    bool pinned1 = false;
+    bool pinned2 = false;
+    
+    inline Manifold(float totalMass, float dt, ContactImpulse* cached, int feature) : mass(totalMass), impulse(impulse_pressure/dt), dt(dt), cached(cached), feature(feature) {}
     
     void addScore(Obj* obj1, Obj* obj2, float K) {
         if(obj1->type == Obj::e_body && obj2->type == Obj::e_stick) {
@@ -41,16 +263,56 @@ struct Manifold
     }
     
     float solve() {
+        if(cached != NULL)
+            return solveTotal();
+        
         float I = force * impulse * mass;
         
-        obj1->applyImpulse(point, -I * normal);
-        obj2->applyImpulse(point, I * normal);
+        if(!pinned1) obj1->applyImpulse(point, -I * normal);
+        if(!pinned2) obj2->applyImpulse(point, I * normal);
         
         //addScore(obj1, obj2, I);
         //addScore(obj2, obj1, I);
 
         return I;
     }
+    
+    /// the impulse of the last substep was pushed with already, this pushes with the difference
+    /// so the objects part as fast as the penalty would push them apart from rest
+    /// the total can't pull, and the damage is that of the total
+    float solveTotal() {
+        float w = (pinned1 ? 0.0f : obj1->invMass()) + (pinned2 ? 0.0f : obj2->invMass());
+        
+        float& total = cached->impulses[feature];
+        
+        if(w <= 0.0f) {
+            total = 0.0f;
+            return 0.0f;
+        }
+        
+        float vn = dot(obj2->velocity - obj1->velocity, normal);
+        float target = force * impulse * mass * w;
+        
+        float last = total;
+        total = std::max(last + (target - vn) / w, 0.0f);
+        
+        float delta = total - last;
+        
+        if(!pinned1) {
+            obj1->push(point, -delta * normal);
+            obj1->hurt(point, -total * normal);
+        }
+        
+        if(!pinned2) {
+            obj2->push(point, delta * normal);
+            obj2->hurt(point, total * normal);
+        }
+        
+        cached->normals[feature] = normal;
+        cached->offsets[feature] = point - obj1->position;
+        
+        return total;
+    }
 };
 
 class World : public BodySystem
@@ -58,86 +320,573 @@ class World : public BodySystem
     
 public:
     
-    struct NearestBody
+    /// bodies other than `self`, for the nearest query
+    struct TargetFilter
     {
-        Body* body;
-        Body* self;
+        const Body* self;
         
-        float shortestLengthSq;
+        inline bool accept(void* data) const {
+            Obj* obj = (Obj*)data;
+            return obj->type == Obj::e_body && obj != self;
+        }
         
-        NearestBody(float radius) {
-            body = NULL;
-            shortestLengthSq = radius * radius;
+        inline float lengthSq(void* data, const vec2& p) const {
+            return (((Obj*)data)->position - p).lengthSq();
         }
+    };
+    
+    /// the body of a body or of a stick
+    static inline Body* bodyOf(void* data) {
+        Obj* obj = (Obj*)data;
+        return obj->type == Obj::e_body ? (Body*)obj : ((Stick*)obj)->owner;
+    }
+    
+    /// pairs are ordered by the ids of their objects when `deterministic`
+    static inline uint objectKey(const void* data) {
+        return ((const Obj*)data)->id;
+    }
+    
+    /// sleeping bodies with their center in `box`
+    /// the proxies are grown differently by each broadphase, so the center is checked again
+    struct SleeperCollector
+    {
+        AABB box;
+        
+        std::vector<Body*>* list;
         
         bool callback(void* data) {
             Obj* obj = (Obj*)data;
+            if(obj->type == Obj::e_body && !((Body*)obj)->awake && box.lowerBound.x <= obj->position.x && obj->position.x <= box.upperBound.x && box.lowerBound.y <= obj->position.y && obj->position.y <= box.upperBound.y)
+                list->push_back((Body*)obj);
+            return true;
+        }
+    };
+    
+    /// bodies other than `self` with an object in the box
+    struct BodyCollector
+    {
+        const Body* self;
+        
+        std::vector<Body*>* list;
+        
+        bool callback(void* data) {
+            Body* body = bodyOf(data);
+            if(body != self)
+                list->push_back(body);
+            return true;
+        }
+    };
+    
+    /// finds whether any object of another body is in the box, and stops there
+    struct NeighborFinder
+    {
+        const Body* self;
+        
+        bool found = false;
+        
+        bool callback(void* data) {
+            found = bodyOf(data) != self;
+            return !found;
+        }
+    };
+    
+    /// forgets the cached target of every body it finds
+    struct CacheEraser
+    {
+        bool callback(void* data) {
+            bodyOf(data)->cache.valid = false;
+            return true;
+        }
+    };
+    
+    /// pairs of `self`, an object of a body of `array`, with the proxies that touch it
+    /// objects of two bodies of `array` find each other, only the one with the smaller id keeps the pair
+    /// an awake body can be left out of `array`, by the physics LOD, so being awake is not enough
+    struct PairCollector
+    {
+        Obj* self;
+        
+        std::vector<Contact>* list;
+        
+        bool callback(void* data) {
+            Obj* other = (Obj*)data;
             
-            if(obj->type == Obj::e_stick || obj == self)
+            if(other == self || !should_collide(self->filter, other->filter))
                 return true;
             
-            vec2 dir = obj->position - self->position;
-            
-            float lengthSq = dir.lengthSq();
+            if(bodyOf(other)->collecting && other->id < self->id)
+                return true;
             
-            if(lengthSq < shortestLengthSq) {
-                body = (Body*)obj;
-                shortestLengthSq = lengthSq;
-            }
+            Contact contact;
+            contact.obj1 = self->id < other->id ? (void*)self : data;
+            contact.obj2 = self->id < other->id ? data : (void*)self;
+            list->push_back(contact);
             
             return true;
         }
     };
     
-    static void solveBodyBody(Body* A, Body* B, float dt);
-    static void solveBodyStick(Body* A, Stick* B, float dt);
-    static void solveStickStick(Stick* A, Stick* B, float dt);
+    /// `cached` holds the impulses of the pair in the last substep, see `warmStart`, or is NULL
+    /// return the depth of the deepest point
+    static float solveBodyBody(Body* A, Body* B, float dt, ContactImpulse* cached = NULL);
+    static float solveBodyStick(Body* A, Stick* B, float dt, ContactImpulse* cached = NULL);
+    static float solveStickStick(Stick* A, Stick* B, float dt, ContactImpulse* cached = NULL);
+    
+    /// solves every pair of objects of two bodies whose boxes touch and that the filters keep, as a Room does
+    /// returns the deepest `depth_ratio`
+    static float solveBodies(Body* A, Body* B, float dt);
+    
+    /// the body or the stick `obj` moving from `state` to where it is now, over `dt`
+    static Sweep sweepOf(const Obj* obj, const BodyState& state, float dt);
+    
+    /// first time an object of `A` touches one of `B`, moving from `a` and `b` to where they are now
+    /// pairs the filters drop are skipped, returns `dt` if nothing touches
+    static float impactTime(const Body* A, const BodyState& a, const Body* B, const BodyState& b, float dt);
+    
+    /// solves the points that touch and clears the last impulse of the others
+    /// returns the depth of the deepest point
+    static float solvePoints(Obj* A, Obj* B, const ContactPoint* points, int n, float dt, ContactImpulse* cached = NULL);
+    
+    /// pushes `A` and `B` apart along `normal`, from `A` to `B`
+    static void solvePoint(Obj* A, Obj* B, const vec2& normal, const vec2& point, float depth, float totalMass, float dt, ContactImpulse* cached = NULL, int feature = 0);
+    
+    /// the position solver versions, they move the objects apart instead of changing their velocities
+    /// sleeping bodies don't move, a body loses health as if it got the change of velocity as an impulse
+    static float correctBodyBody(Body* A, Body* B, float dt);
+    static float correctBodyStick(Body* A, Stick* B, float dt);
+    static float correctStickStick(Stick* A, Stick* B, float dt);
+    
+    /// as solveBodies
+    static float correctBodies(Body* A, Body* B, float dt);
     
-    static void solveCircleCircle(Obj* A, Obj* B, const vec2& p1, const vec2& p2, float dt);
+    /// moves `A` and `B` apart along `normal` by `depth`, split by their weights at `point`
+    static void correctPoint(Obj* A, Obj* B, const vec2& normal, const vec2& point, float depth, float dt);
     
-    static void solveCircleLine(Obj* A, Stick* B, const vec2& p1, float dt);
+    /// pulls or pushes the stick of `body` back to `absArmLength`, as soft as Body::armCompliance times `compliance`
+    /// `lambda` is what it took so far in the substep, it starts at 0
+    /// the body itself doesn't feel its arm, as in Body::step
+    static void correctArm(Body* body, float compliance, float* lambda, float dt);
     
 protected:
     
-    DynamicTree tree;
+    Broadphase broadphase;
+    
+    ThreadPool pool;
+    
+    /// awake bodies in list order, for the parallel passes
+    /// bodies woken during a step go to the end
+    std::vector<Body*> array;
+    
+    /// bodies asleep
+    int sleeping = 0;
+    
+    /// sleeping bodies each worker sensed
+    std::vector<std::vector<Body*>> woken;
+    
+    /// pairs each worker found for `activeContacts`
+    std::vector<std::vector<Contact>> pairs;
+    
+    /// puts the bodies that were still for `sleepSteps` to sleep, and lists the awake ones in `array`
+    void activate();
+    
+    inline void sleep(Body* body) {
+        body->awake = false;
+        body->stillSteps = 0;
+        body->velocity = vec2(0.0f, 0.0f);
+        body->stick.velocity = vec2(0.0f, 0.0f);
+        body->stick.angularVelocity = 0.0f;
+        body->target = NULL;
+        body->cache.valid = false;
+        ++sleeping;
+    }
+    
+    inline void wake(Body* body) {
+        body->awake = true;
+        body->stillSteps = 0;
+        array.push_back(body);
+        --sleeping;
+    }
+    
+    /// the pairs of every awake object, from a region query of each
+    /// cheaper than the pair query of the broadphase once most bodies sleep
+    void activeContacts();
+    
+    /// drops pairs of two sleeping bodies, nothing moves them
+    void dropSleepingContacts();
+    
+    /// wakes sleeping bodies that an awake one touched in the last solve
+    /// only pairs that really touch count, so it doesn't depend on how the broadphase grows its boxes
+    void wakeContacts();
+    
+    /// wakes sleeping bodies with an awake one in their sensing box
+    void wakeSensed();
+    
+    /// traversal stack of each worker
+    std::vector<std::vector<int>> stacks;
+    
+    /// nearest query heap of each worker
+    std::vector<std::vector<NearestNode>> heaps;
+    
+    /// the most any body moved in a step, summed over every step
+    /// no body moved further than the difference of two values of it
+    float travel = 0.0f;
+    
+    /// steps sensed so far
+    uint frame = 0;
+    
+    /// where bodies were made since the last step
+    std::vector<vec2> created;
+    
+    /// a body was removed by the user, every cached target is dropped
+    bool removed = false;
+    
+    /// full sensing queries of each worker in the last step
+    std::vector<int> queries;
+    
+    /// the target of `body` is still the nearest body in range
+    /// the body moved `ds`, the target `dt`, and no other body more than the travel since then,
+    /// so the target is at most `distance + ds + dt` away and any other body at least `distance + gap - ds - travel`
+    inline bool keepTarget(const Body* body) const {
+        const TargetCache& cache = body->cache;
+        
+        if(!cache.valid || (frame + body->id / 2) % targetRefresh == 0)
+            return false;
+        
+        float ds = (body->position - cache.position).length();
+        float drift = travel - cache.travel;
+        
+        if(body->target == NULL)
+            return ds + drift < cache.gap;
+        
+        float dt = (body->target->position - cache.targetPosition).length();
+        return 2.0f * ds + dt + drift < cache.gap && cache.distance + ds + dt < targetRadius;
+    }
+    
+    /// the nearest query of `brainInputs`, which also fills the cache of `body`
+    void senseTarget(Body* body, int worker);
+    
+    /// same targets as `brainInputs`, only bodies whose cache can't be kept are queried
+    void cachedInputs();
+    
+    /// calls of `step(dt, its)` so far, and the one of the last reorder
+    uint steps = 0;
+    uint reordered = 0;
+    
+    LocalityStats locality;
+    
+    /// reorders once `reorderInterval` steps passed since the last one
+    inline void reorderIfDue() {
+        if(reorderInterval > 0 && steps - reordered >= (uint)reorderInterval)
+            reorder();
+    }
+    
+    /// sensing boxes of `array` and what they found, for `batchedSensing`
+    std::vector<AABB> sensors;
+    BatchResults sensed;
+    
+    /// a body with an id but without proxies
+    Body* allocateBody(const BodyDef* def);
+    
+    /// creates the proxies of `n` bodies at once
+    void createProxies(Body* const* list, int n);
     
     inline void destoryBody(const iterator_type& it) {
         Body* body = *it;
         bodies.erase(it);
-        tree.destoryProxy(body->node);
-        tree.destoryProxy(body->stick.node);
-        delete(body);
+        broadphase.destoryProxy(body->node);
+        broadphase.destoryProxy(body->stick.node);
+        bodyPool.free(body);
     }
     
     std::vector<Contact> contacts;
     
+    /// impulses of the last substep
+    ContactCache cache;
+    
+    /// cache slot of each contact
+    std::vector<int> slots;
+    
+    /// next object id
+    uint nextId = 0;
+    
+    /// color of each contact, no two contacts of a color share an object
+    std::vector<int> colors;
+    
+    /// contact indices grouped by color
+    std::vector<int> batches;
+    
+    /// start of each color in `batches`, the last one is the end
+    std::vector<int> batchStart;
+    
+    /// colors used by each proxy
+    std::vector<uint64_t> used;
+    
+    void colorContacts();
+    
+    Narrowphase narrowphase;
+    
+    /// puts the object with the smaller id first, then a body before a stick
+    void orderContact(int index);
+    
+    /// orders every contact and runs the narrowphase of all of them
+    void collide();
+    
+    Integrator integrator;
+    
+    /// steps every body, with `integrator` if `batchedIntegrator`
+    void integrate(float dt);
+    
+    inline float maxTranslation() const {
+        return continuous ? ccd.maxTranslation : max_translation;
+    }
+    
+    /// `array` before `integrate`, with `continuous`
+    std::vector<BodyState> states;
+    
+    /// awake bodies by address and their place in `array`, for `sweep`
+    std::vector<std::pair<Body*, int>> places;
+    
+    /// place of `body` in `array`, or -1
+    inline int placeOf(const Body* body) const {
+        std::vector<std::pair<Body*, int>>::const_iterator it = std::lower_bound(places.begin(), places.end(), std::make_pair((Body*)body, -1));
+        return it != places.end() && it->first == body ? it->second : -1;
+    }
+    
+    /// pairs of bodies the sweeps found, by id
+    std::vector<std::pair<Body*, Body*>> swept;
+    
+    /// sweeps the objects that moved fast in `integrate` against their neighbors
+    /// the bodies of pairs that would have met go back to where they were and step again
+    /// in pieces, solving the swept pairs in between, their contacts were already solved
+    /// neighbors that don't step again are pinned, they stay where they are and take nothing
+    void sweep(float dt);
+    
+    /// arm of each body of `array` so far in the substep, with `positionBased`
+    std::vector<float> lambdas;
+    
+    /// moves `array` with Body::predict and corrects it with `xpbd.iterations` of the arms and
+    /// the contacts, then gives the bodies the velocities of how far they went
+    /// `states` are the bodies before it
+    void relax(float dt);
+    
+    /// awake bodies stepped with Body::drift this frame, with `physicsLod`
+    std::vector<Body*> coarse;
+    
+    /// bodies of `array` that stepped each way in the last step
+    int fineBodies = 0;
+    int coarseBodies = 0;
+    
+    /// moves the bodies of `array` that were alone for `lodSteps` frames to `coarse`
+    /// the box of each body is grown by how far it and a neighbor could go in `dt`
+    void splitLod(float dt);
+    
+    /// steps `coarse` a whole frame at once, moving their proxies only past `lodSlack`
+    void drift(float dt);
+    
+    /// fast bodies, pairs that met and the most pieces in the last step
+    int sweptBodies = 0;
+    int impacts = 0;
+    int toiSubsteps = 0;
+    
+    /// `depth_ratio` of each contact in the last substep
+    std::vector<float> depths;
+    
+    /// deepest of `depths`
+    float penetration() const;
+    
+    /// substeps of the last frame
+    int substeps = 0;
+    
     /// dynamics
+    void solveContact(int index, float dt);
+    
+    /// `solveContact` of the position solver
+    void correctContact(int index, float dt);
+    
     void solveContacts(float dt);
     
+    /// pushes every pair with its impulses of the last substep before any of them is solved
+    void warmStartContacts();
+    
+    /// with the tiled broadphase, solves the contacts inside each tile in parallel,
+    /// then the ones between tiles in order
+    void solveTiles(float dt);
+    
     inline void moveProxies(float dt) {
-        for(Body* body : bodies) {
-            tree.moveProxy(body->node, body->aabb(), dt * body->velocity);
-            tree.moveProxy(body->stick.node, body->stick.aabb(), dt * body->stick.velocity);
+        for(Body* body : array) {
+            broadphase.moveProxy(body->node, body->aabb(), dt * body->velocity);
+            broadphase.moveProxy(body->stick.node, body->stick.aabb(), dt * body->stick.velocity);
         }
+        
+        broadphase.update(&pool, treeRebuildFactor);
     }
     
     void step(float dt);
     
+    /// drops every target pointing to a body with no health left, then destroys those bodies
+    void removeDead();
+    
+    /// same targets as `brainInputs`, from one batched query of every sensing box
+    void batchedInputs() {
+        int n = (int)array.size();
+        
+        vec2 ext = vec2(targetRadius, targetRadius);
+        
+        sensors.resize(n);
+        for(int i = 0; i != n; ++i)
+            sensors[i] = AABB(array[i]->position - ext, array[i]->position + ext);
+        
+        broadphase.tree.queryBatch(sensors.data(), n, &sensed, &pool);
+        
+        pool.parallel_for(n, [this] (int begin, int end, int /* worker */) {
+            for(int i = begin; i != end; ++i) {
+                Body* body = array[i];
+                TargetFilter filter;
+                filter.self = body;
+                
+                void* nearest = NULL;
+                float lengthSq;
+                int found = 0;
+                
+                for(int j = sensed.offsets[i]; j != sensed.offsets[i + 1]; ++j) {
+                    void* data = sensed.results[j];
+                    
+                    if(!filter.accept(data))
+                        continue;
+                    
+                    float d = filter.lengthSq(data, body->position);
+                    
+                    if(d < targetRadius * targetRadius && (found == 0 || d < lengthSq))
+                        found = insert_nearest(data, d, found, 1, &nearest, &lengthSq);
+                }
+                
+                body->target = found != 0 ? (Body*)nearest : NULL;
+                body->setInputs(aabb);
+            }
+        });
+    }
+    
     void brainInputs() {
-        for(Body* body : bodies) {
-            NearestBody collector(targetRadius);
-            collector.self = body;
-            AABB fatAABB = body->box(targetRadius);
-            tree.query(&collector, fatAABB);
-            body->target = collector.body;
-            body->setInputs(aabb);
+        broadphase.update();
+        
+        stacks.resize(pool.size());
+        heaps.resize(pool.size());
+        
+        if(allowSleep && sleeping != 0)
+            wakeSensed();
+        
+        if(targetCache) {
+            cachedInputs();
+            return;
         }
+        
+        created.clear();
+        
+        if(batchedSensing && broadphase.getType() == Broadphase::e_tree) {
+            batchedInputs();
+            return;
+        }
+        
+        pool.parallel_for((int)array.size(), [this] (int begin, int end, int worker) {
+            for(int i = begin; i != end; ++i) {
+                Body* body = array[i];
+                TargetFilter filter;
+                filter.self = body;
+                void* nearest = NULL;
+                float lengthSq;
+                int found = broadphase.queryNearest(&filter, body->position, targetRadius, 1, &nearest, &lengthSq, &heaps[worker], &stacks[worker]);
+                body->target = found != 0 ? (Body*)nearest : NULL;
+                body->setInputs(aabb);
+            }
+        });
     }
     
 public:
     
     float targetRadius = 8.0f;
     
+    /// solve each contact for the impulse it needs on top of its impulse of the last substep,
+    /// which every contact pushes with first, instead of pushing with a penalty on the overlap
+    /// contacts then stop their objects instead of only pushing them apart
+    /// off, since it doesn't yet overlap less than the penalty over fewer substeps
+    bool warmStart = false;
+    
+    /// solve contacts in parallel batches of different colors
+    bool parallelSolver = false;
+    
+    /// order pairs and sort contacts by the ids of their objects, so results don't depend on
+    /// the tree layout, on the number of workers or on where objects were allocated
+    /// with `seed_random` and the same steps, two runs end with the same `checksum()`
+    /// it sorts every contact every substep, so it is for replays and tests, see Tests/DeterminismTest.cpp
+    bool deterministic = false;
+    
+    /// run the narrowphase of every contact before solving any of them, with the AVX2 kernels where there are any
+    /// off, the solver collides each pair itself with the collide_* functions
+    bool batchedNarrowphase = false;
+    
+    /// check the vector narrowphase against the scalar one every step
+    bool checkNarrowphase = false;
+    
+    /// step the bodies together in arrays instead of one by one, with the AVX2 kernels where there are any
+    /// off, each body steps itself with Body::step
+    bool batchedIntegrator = false;
+    
+    /// check the integrator against Body::step every step
+    bool checkIntegrator = false;
+    
+    /// let `scheduler` pick the substeps of a frame instead of the caller
+    bool adaptiveSubsteps = false;
+    
+    SubstepScheduler scheduler;
+    
+    /// sweep fast objects over each substep, see ContinuousCollision
+    /// objects move up to `ccd.maxTranslation` a substep instead of `max_translation`
+    bool continuous = false;
+    
+    ContinuousCollision ccd;
+    
+    /// solve contacts and arms on positions after moving the bodies, see PositionSolver
+    /// instead of impulses before moving them
+    bool positionBased = false;
+    
+    PositionSolver xpbd;
+    
+    /// sense with one batched tree query instead of a query per body
+    bool batchedSensing = false;
+    
+    /// keep the target of a body while no other body could have come nearer, instead of
+    /// querying every body every step, see `keepTarget`
+    /// a body is queried again every `targetRefresh` steps anyway
+    /// picks the same targets as the queries, and takes over from `batchedSensing`
+    bool targetCache = false;
+    
+    float targetMargin = target_margin;
+    int targetRefresh = target_refresh;
+    
+    /// every this many steps, bodies are sorted along a z-order curve of their position,
+    /// so bodies near each other are stepped one after another and sit near each other in memory and in the tree, see `reorder`
+    /// 0 never reorders
+    int reorderInterval = 0;
+    
+    /// bodies with no other body within `lodRadius * targetRadius` for `lodSteps` frames are
+    /// stepped with Body::drift, once a frame, without contacts and mostly without proxy updates
+    /// unlike sleeping bodies they keep moving, they step fully again once anything comes near
+    bool physicsLod = false;
+    
+    float lodRadius = lod_radius;
+    int lodSteps = lod_steps;
+    float lodSlack = lod_slack;
+    
+    /// bodies that stay still, without a target and without touching another body, fall asleep
+    bool allowSleep = false;
+    
+    float sleepVelocity = sleep_velocity;
+    float sleepAngularVelocity = sleep_angular_velocity;
+    int sleepSteps = sleep_steps;
+    
+    /// checked once a step and after every refit, see `tree_rebuild_factor`
+    float treeRebuildFactor = tree_rebuild_factor;
+    
     float width;
     float height;
     
@@ -145,30 +894,44 @@ public:
     
     const uint maxBodies;
     
-    World(float width, float height, uint md) : width(width), height(height), aabb(vec2(-0.5f * width, -0.5f * height), vec2(0.5f * width, 0.5f * height)), maxBodies(md) {
+    /// where the bodies of `bodies` live, moved around by `reorder`
+    BodyPool bodyPool;
+    
+    World(float width, float height, uint md, float cellSize = default_cell_size, float tileSize = default_tile_size) : broadphase(AABB(vec2(-0.5f * width, -0.5f * height), vec2(0.5f * width, 0.5f * height)), cellSize, tileSize), pool(world_threads), width(width), height(height), aabb(vec2(-0.5f * width, -0.5f * height), vec2(0.5f * width, 0.5f * height)), maxBodies(md), bodyPool(md) {
+        RandomScope scope(&random);
+        
         bs.resize(maxBodies);
         bs.reset(Body::input_size, Body::output_size);
     }
     
     ~World() {
         for(Body* body : bodies) {
-            delete(body);
+            bodyPool.free(body);
         }
     }
     
     void generate(BodyDef def) {
+        std::vector<Body*> list;
         float stride = 2.0f * def.radius * targetRadius;
         for(float x = aabb.lowerBound.x + stride; x < aabb.upperBound.x; x += stride) {
             for(float y = aabb.lowerBound.y + stride; y < aabb.upperBound.y; y += stride) {
                 int idx = (int)bodies.size();
-                if(idx >= maxBodies) return;
+                if(idx >= maxBodies) break;
                 def.position = vec2(x, y);
-                createBody(&def)->brain = bs[idx];
+                Body* body = allocateBody(&def);
+                body->brain = bs[idx];
+                bodies.push_back(body);
+                list.push_back(body);
             }
         }
+        
+        /// one bulk build instead of inserting them one at a time
+        createProxies(list.data(), (int)list.size());
     }
     
     void alter() {
+        RandomScope scope(&random);
+        
         BodyDef def;
         uint begin = size();
         while(begin != maxBodies) {
@@ -188,23 +951,71 @@ public:
             ++begin;
             destoryBody(it);
         }
+        
+        cache.clear();
+        created.clear();
     }
     
     Body* createBody(const BodyDef* def);
     
+    /// puts the body list, and so `array` and the passes over it, in z-order of their position
+    /// the bodies, their brains of `bs` and the proxies of the tree are moved in memory to the same order
+    /// pointers to bodies and brains held outside of the world are no longer valid, ids are
+    void reorder();
+    
+    inline const LocalityStats& getLocality() const {
+        return locality;
+    }
+    
+    /// moves every proxy into a broadphase of another type
+    void setBroadphase(int type);
+    
+    inline int getBroadphase() const {
+        return broadphase.getType();
+    }
+    
     void destoryBody(Body* body);
     
     inline void getContacts() {
         contacts.clear();
-        tree.query(&contacts);
+        broadphase.setProxyKey(deterministic ? &objectKey : NULL);
+        broadphase.update();
+        
+        if(allowSleep && 2 * sleeping >= (int)size()) {
+            activeContacts();
+        }else{
+            broadphase.query(&contacts, &pool);
+        }
+        
+        if(deterministic) {
+            for(Contact& c : contacts) {
+                if(((Obj*)c.obj1)->id > ((Obj*)c.obj2)->id)
+                    std::swap(c.obj1, c.obj2);
+            }
+            
+            std::sort(contacts.begin(), contacts.end(), [] (const Contact& a, const Contact& b) {
+                uint a1 = ((Obj*)a.obj1)->id;
+                uint b1 = ((Obj*)b.obj1)->id;
+                return a1 < b1 || (a1 == b1 && ((Obj*)a.obj2)->id < ((Obj*)b.obj2)->id);
+            });
+        }
+        
+        if(allowSleep)
+            dropSleepingContacts();
+        
+        if(warmStart) {
+        cache.update(contacts, &slots);
+        }else if(cache.size() != 0) {
+            cache.clear();
+        }
     }
     
     inline float getTreeQuality() const {
-        return tree.getAreaRatio();
+        return broadphase.tree.getAreaRatio();
     }
     
     inline int getTreeMaxBalance() const {
-        return tree.getMaxBalance();
+        return broadphase.tree.getMaxBalance();
     }
     
     inline void read(FILE* is) {
@@ -215,15 +1026,100 @@ public:
         bs.write(os);
     }
     
+    inline int getSubsteps() const {
+        return substeps;
+    }
+    
+    inline int getSleepingCount() const {
+        return sleeping;
+    }
+    
+    /// bodies swept in the last step, with `continuous`
+    inline int getSweptBodies() const {
+        return sweptBodies;
+    }
+    
+    /// pairs that would have met within a substep in the last step
+    inline int getImpacts() const {
+        return impacts;
+    }
+    
+    /// most pieces a substep was split into in the last step
+    inline int getToiSubsteps() const {
+        return toiSubsteps;
+    }
+    
+    /// awake bodies stepped fully and with Body::drift in the last step
+    inline int getFineCount() const {
+        return fineBodies;
+    }
+    
+    inline int getCoarseCount() const {
+        return coarseBodies;
+    }
+    
+    /// full sensing queries in the last step, with `targetCache`
+    inline int getTargetQueries() const {
+        int n = 0;
+        for(int count : queries)
+            n += count;
+        return n;
+    }
+    
+    /// the same results for any number, see `deterministic`
+    inline void setThreads(int n) {
+        pool.resize(n);
+    }
+    
+    inline int getThreads() const {
+        return pool.size();
+    }
+    
     void step(float dt, int its) {
+        RandomScope scope(&random);
+        
+        reorderIfDue();
+        
+        broadphase.rebuildIfDegraded(treeRebuildFactor, &pool);
+        
+        activate();
+        
         brainInputs();
         
-        for(Body* body : bodies)
+        for(Body* body : array)
             body->stepBrain(dt);
         
+        coarse.clear();
+        
+        if(physicsLod)
+            splitLod(dt);
+        
+        fineBodies = (int)array.size();
+        coarseBodies = (int)coarse.size();
+        
+        if(adaptiveSubsteps) {
+            float rate = 0.0f;
+            for(Body* body : array)
+                rate = std::max(rate, SubstepScheduler::rate(body));
+            
+            its = scheduler.count(dt, rate, penetration());
+            scheduler.report(its);
+        }
+        
+        substeps = its;
+        
+        sweptBodies = impacts = toiSubsteps = 0;
+        
         dt /= (float) its;
         for(int i = 0; i < its; ++i)
             step(dt);
+        
+        if(!coarse.empty())
+            drift(dt * its);
+        
+        ++steps;
+        
+        reportChecksum();
     }
 };
 
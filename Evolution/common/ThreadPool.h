@@ -0,0 +1,147 @@
+//
+//  ThreadPool.h
+//  Evolution
+//
+
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+
+/**
+ ** A fixed set of workers that all run the same task.
+ ** The calling thread is worker 0, so a pool of size 1 runs everything inline.
+ **/
+
+class ThreadPool
+{
+    
+    std::vector<std::thread> threads;
+    
+    std::mutex mutex;
+    
+    std::condition_variable start;
+    std::condition_variable finish;
+    
+    std::function<void(int)> task;
+    
+    /// bumped every time a task is posted
+    int generation;
+    
+    /// workers still running the current task
+    int pending;
+    
+    bool quit;
+    
+    void loop(int worker) {
+        int seen = 0;
+        
+        while(true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&] { return quit || generation != seen; });
+            
+            if(quit) return;
+            
+            seen = generation;
+            lock.unlock();
+            
+            task(worker);
+            
+            lock.lock();
+            if(--pending == 0)
+                finish.notify_one();
+        }
+    }
+    
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        
+        start.notify_all();
+        
+        for(std::thread& thread : threads)
+            thread.join();
+        
+        threads.clear();
+    }
+    
+public:
+    
+    ThreadPool(int size) : generation(0), pending(0), quit(false) {
+        for(int i = 1; i < size; ++i)
+            threads.emplace_back(&ThreadPool::loop, this, i);
+    }
+    
+    ~ThreadPool() {
+        stop();
+    }
+    
+    /// joins the workers and starts `size` - 1 new ones
+    /// results of `parallel_for` stay the same as long as the chunks are merged in order
+    void resize(int size) {
+        stop();
+        
+        generation = 0;
+        pending = 0;
+        quit = false;
+        
+        for(int i = 1; i < size; ++i)
+            threads.emplace_back(&ThreadPool::loop, this, i);
+    }
+    
+    ThreadPool(const ThreadPool&) = delete;
+    
+    ThreadPool& operator = (const ThreadPool&) = delete;
+    
+    inline int size() const {
+        return (int)threads.size() + 1;
+    }
+    
+    /// runs `fn(worker)` on every worker and waits for all of them
+    void run(const std::function<void(int)>& fn) {
+        if(threads.empty()) {
+            fn(0);
+            return;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = fn;
+            pending = (int)threads.size();
+            ++generation;
+        }
+        
+        start.notify_all();
+        
+        fn(0);
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        finish.wait(lock, [&] { return pending == 0; });
+    }
+    
+    /// splits [0, n) into one contiguous chunk per worker
+    /// calls `fn(begin, end, worker)`, chunk i always goes to worker i
+    template <class F>
+    void parallel_for(int n, const F& fn) {
+        int workers = size();
+        
+        if(n < workers) {
+            fn(0, n, 0);
+            return;
+        }
+        
+        run([&] (int worker) {
+            int begin = (int)((long)n * worker / workers);
+            int end = (int)((long)n * (worker + 1) / workers);
+            fn(begin, end, worker);
+        });
+    }
+};
+
+#endif /* ThreadPool_h */
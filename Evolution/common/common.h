@@ -17,6 +17,7 @@
 #include <string>
 #include <unistd.h>
 #include <float.h>
+#include <cstring>
 
 inline int fstr(const char* file_name, std::string* str) {
     std::ifstream file;
@@ -61,15 +62,113 @@ inline bool starts_with(const std::string& str, const std::string& start) {
 
 #define uint32_inv_max 1.0f / (float)0xffffffff
 
+/// a seeded stream of random numbers, see `seed_random`
+/// worlds, builders and rooms each draw from one of their own while a RandomScope of it is alive,
+/// so they can run on different threads, and each repeats whatever else runs
+struct SeededRandom
+{
+    bool seeded = false;
+    
+    /// streams of one world or builder differ by this
+    uint32_t stream = 0;
+    
+    /// the `seed_random` call it was last seeded after
+    uint32_t generation = 0;
+    
+    std::mt19937 engine;
+    
+    std::normal_distribution<float> normal;
+    
+    inline void seed(uint32_t root) {
+        std::seed_seq seq = {root, stream};
+        engine.seed(seq);
+        normal.reset();
+        seeded = true;
+    }
+};
+
+/// the stream of draws made outside of any RandomScope, and the seed every other stream comes from
+struct RootRandom : SeededRandom
+{
+    uint32_t root = 0;
+};
+
+inline RootRandom& seeded_random() {
+    static RootRandom random;
+    return random;
+}
+
+/// the stream the draws of this thread come from, NULL for the root one
+inline SeededRandom*& current_random() {
+    thread_local SeededRandom* random = NULL;
+    return random;
+}
+
+/// rand32, randomf and gaussian_randomf repeat from here on, and so does `rand`
+/// every other stream is seeded again from `seed` and its own `stream` the next time it is used
+inline void seed_random(uint32_t seed) {
+    RootRandom& random = seeded_random();
+    random.root = seed;
+    random.seed(seed);
+    ++random.generation;
+    srand(seed);
+}
+
+/// the draws of this thread come from `random` while it is alive
+struct RandomScope
+{
+    SeededRandom* last;
+    
+    RandomScope(SeededRandom* random) : last(current_random()) {
+        const RootRandom& root = seeded_random();
+        
+        if(root.seeded && random->generation != root.generation) {
+            random->seed(root.root);
+            random->generation = root.generation;
+        }
+        
+        current_random() = random;
+    }
+    
+    ~RandomScope() {
+        current_random() = last;
+    }
+    
+    RandomScope(const RandomScope&) = delete;
+    
+    RandomScope& operator = (const RandomScope&) = delete;
+};
+
+inline SeededRandom& active_random() {
+    SeededRandom* random = current_random();
+    return random != NULL ? *random : seeded_random();
+}
+
 inline uint32_t rand32() {
-    return arc4random();
+    SeededRandom& random = active_random();
+    return random.seeded ? (uint32_t)random.engine() : arc4random();
 }
 
+/// uniform in [0, ub)
 inline uint32_t rand32(uint32_t ub) {
-    return arc4random_uniform(ub);
+    SeededRandom& random = active_random();
+    
+    if(!random.seeded)
+        return arc4random_uniform(ub);
+    
+    /// as arc4random_uniform
+    if(ub < 2)
+        return 0;
+    
+    return std::uniform_int_distribution<uint32_t>(0, ub - 1)(random.engine);
 }
 
 inline float gaussian_randomf() {
+    SeededRandom& random = active_random();
+    
+    if(random.seeded)
+        return random.normal(random.engine);
+    
     thread_local std::default_random_engine g;
     thread_local std::normal_distribution<float> d(0.0f, 1.0f);
     return d(g);
@@ -79,10 +178,43 @@ inline float randomf(float a, float b) {
     return rand32() * uint32_inv_max * (b - a) + a;
 }
 
+/// adds the bits of `x` to the hash `h`
+inline uint64_t hash_float(uint64_t h, float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    
+    /// splitmix64
+    uint64_t z = h + bits + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
 inline int firstbitf(float x) {
     return 1 & (~((*(int*)&x) >> 31));
 }
 
+/// the AVX2 kernels are built on every x86 target with a target attribute of their own,
+/// and only run where the processor has AVX2, so the rest of the build needs no flag
+#if defined(__x86_64__) || defined(__i386__)
+
+#define avx2_kernels 1
+
+#define avx2_target __attribute__((target("avx2")))
+
+inline bool cpu_has_avx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+#else
+
+inline bool cpu_has_avx2() {
+    return false;
+}
+
+#endif
+
 inline void* Alloc(uint size) {
     return ::operator new(size);
 }
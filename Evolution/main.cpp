@@ -23,6 +23,12 @@ FILE* log_file;
 
 #define READING true
 
+/// fast forward sweeps fast bodies, see World::continuous
+#define CONTINUOUS false
+
+/// fast forward solves the bodies on positions, see World::positionBased
+#define POSITION_BASED false
+
 #define pop_root 32
 
 GLFWwindow *window;
@@ -296,6 +302,9 @@ int main(int argc, const char * argv[]) {
                 
                 float score;
                 
+                builder.continuous = CONTINUOUS && mode == 0;
+                builder.positionBased = POSITION_BASED && mode == 0;
+                
                 if(mode == 1) {
                     score = builder.step(dt1, colSteps, subSteps1);
                     usleep(10000);